@@ -25,6 +25,7 @@ void done();
  *  special_keymap[] : non-ascii keys, as defined by GLUT constants.
  *  _mouse_dx: mouse pointer motion (as fraction of window size) per frame
  *  _mouse_dy: mouse pointer motion (as fraction of window size) per frame
+ *  _typed[] : the characters typed since the last frame, as typed (shift etc applied), '\0'-terminated. For text entry, where keymap[] would lose the order & case
  * Or,
  * if you like standard controls (W,A,S,D + arrow keys), you can use these macros:
  *  keyboard_dz() : forward / backward
@@ -58,6 +59,21 @@ void done();
  *
  *  #define SHOW_FRAME_RATE     : Report the number of frames-per-second in the terminal.
  *
+ *  #define USE_HEADLESS        : Allows running without any window or display, using an offscreen EGL context (Mesa's software rasterizer is fine). To use it, set '_headless = 1;' in pre_init() (so you need USE_PRE_INIT too), along with _screen_x & _screen_y.
+ *                                Then instead of the GLUT main loop, your own function 'int headless()' gets called once, after init(). It's up to you to call draw() or whatever else, and to read the pixels back. Its return value is the program's exit status.
+ *                                The offscreen framebuffer is the size of one tile (headless_tile()), so you can render images much bigger than the GPU allows, in pieces.
+ *                                Needs extra compiler flags: -lEGL
+ *
+ *  #define USE_RECORDING       : Input recording and replay (needs USE_HEADLESS). Set '_record_file' in pre_init() and every key, mouse and window event gets written to it, with the frame number it arrived on.
+ *                                Set '_replay_file' instead and the recording is played back headless, one frame per recorded frame, with the same random seed, printing how long each frame took. So a recorded session doubles as a benchmark.
+ *                                Replay uses the window size from the recording; _screen_x & _screen_y are only the size until its first reshape event.
+ *
+ * Functions that are safe to call whether or not there's a window:
+ *  load_projection_identity() : Use this instead of glMatrixMode(GL_PROJECTION); glLoadIdentity();  It accounts for the current tile, when rendering in tiles.
+ *  set_window_title()         : Same as glutSetWindowTitle(). Does nothing when headless.
+ *  RND(), RND01(), rnd_next() : Random numbers, -1 to 1, 0 to 1, or 32 bits. Much faster than rand(), and safe to use on any thread.
+ *  rnd_seed()                 : The same seed gives the same random numbers (seed 1 if you don't call it), so a run can be reproduced exactly. Threads started afterwards each get their own sequence, in the order they first use it.
+ *
  *
  * Author: Elie Goldman Smith
  * This file is too trivial to copyright (since it's mostly boilerplate code),
@@ -69,6 +85,8 @@ void done();
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <string.h>
+#include <time.h>
 #ifdef USE_GLEW
  #include <GL/glew.h>
 #else
@@ -77,8 +95,30 @@ void done();
  #include <GL/glext.h>
 #endif
 #include <GL/glut.h>
-#define RND()   (rand()*(2.0f/RAND_MAX)-1.0f) // random number from -1 to 1
-#define RND01() (rand()*(1.0f/RAND_MAX))      // random number from  0 to 1
+#define RND()   ((int)rnd_next()*(1.0f/2147483648.0f)) // random number from -1 to 1
+#define RND01() (rnd_next()*(1.0f/4294967296.0f))      // random number from  0 to 1
+
+// random numbers: xorshift64*, with a state for each thread, so unlike rand() there's no lock. Each thread's state comes from the seed (see notes above)
+unsigned long long _rnd_seed = 1;
+unsigned _rnd_threads = 0;
+__thread unsigned long long _rnd_state = 0;
+unsigned long long rnd_mix(unsigned long long z) { // splitmix64's finalizer: turns a seed into a well-scrambled state
+ z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+ z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+ return z ^ (z >> 31);
+}
+static inline unsigned rnd_next() { // 32 random bits
+ if (!_rnd_state) _rnd_state = rnd_mix(_rnd_seed + 0x9E3779B97F4A7C15ull * __sync_add_and_fetch(&_rnd_threads, 1)) | 1; // (first use on this thread)
+ _rnd_state ^= _rnd_state >> 12;
+ _rnd_state ^= _rnd_state << 25;
+ _rnd_state ^= _rnd_state >> 27;
+ return (_rnd_state * 0x2545F4914F6CDD1Dull) >> 32;
+}
+void rnd_seed(unsigned long long seed) { // starts the numbers over, on every thread (that starts using them after this)
+ _rnd_seed = seed;
+ _rnd_threads = 0;
+ _rnd_state = 0;
+}
 
 
 int _screen_x = 8;
@@ -90,26 +130,49 @@ GLfloat _screen_size = 8;
 unsigned _key_mod = 0;
 char keymap[256] = {0};
 char special_keymap[256] = {0};
+char _typed[64] = ""; // see notes above
+int  _n_typed = 0;
+
+unsigned _frame = 0; // frames drawn so far
+
+// input recording (see USE_RECORDING). One line per event: frame, event name, arguments
+#ifdef USE_RECORDING
+const char *_record_file = NULL, *_replay_file = NULL;
+FILE *_record = NULL;
+int _replaying = 0;
+unsigned _replay_mod = 0; // the modifiers of the event being replayed
+#define record_input(...) do { if (_record) fprintf(_record, __VA_ARGS__); } while (0)
+#define get_modifiers()   (_replaying ? _replay_mod : (unsigned)glutGetModifiers())
+#else
+#define _replaying 0
+#define record_input(...)
+#define get_modifiers()   glutGetModifiers()
+#endif
 
 // the 'gcb' prefix just stands for "glut call-back" function
 void gcb_key_down(unsigned char key, int x, int y) {
+ _key_mod = get_modifiers();
+ record_input("%u key %d %d %d %u\n", _frame, key, x, y, _key_mod);
+ if (_n_typed < (int)sizeof(_typed)-1) { _typed[_n_typed++] = key; _typed[_n_typed] = 0; }
  keymap[toupper(key)] = keymap[tolower(key)] = KEY_FRESHLY_PRESSED; // The toupper() and tolower() are to avoid a situation where, for example, the user holds 'shift', and then presses 'W', then releases the 'shift' and then releases the 'W' (which generates a lowercase 'w' keyup event instead).  XXX: This implementation still has some holes in it - for example numbers. We should really do something more universal like keymap[shift(key)] = keymap[shiftless(key)] = KEY_FRESHLY_PRESSED, but then we'd have to define the shift() and shiftless() functions, and they could get very complex if we want to support all locales.
  #ifndef NO_ESCAPE
  if (key == 27) exit(0);
  #endif
- _key_mod = glutGetModifiers();
 }
 void gcb_key_up  (unsigned char key, int x, int y) {
+ _key_mod = get_modifiers();
+ record_input("%u keyup %d %d %d %u\n", _frame, key, x, y, _key_mod);
  keymap[toupper(key)] = keymap[tolower(key)] = 0;
- _key_mod = glutGetModifiers();
 }
 void gcb_special_key_down(int key, int x, int y) {
+ _key_mod = get_modifiers();
+ record_input("%u special %d %d %d %u\n", _frame, key, x, y, _key_mod);
  special_keymap[(unsigned char)key] = KEY_FRESHLY_PRESSED;
- _key_mod = glutGetModifiers();
 }
 void gcb_special_key_up  (int key, int x, int y) {
+ _key_mod = get_modifiers();
+ record_input("%u specialup %d %d %d %u\n", _frame, key, x, y, _key_mod);
  special_keymap[(unsigned char)key] = 0;
- _key_mod = glutGetModifiers();
 }
 
 #define keyboard_dz()     (!!keymap['W']-!!keymap['S']+!!special_keymap[GLUT_KEY_UP     ]-!!special_keymap[GLUT_KEY_DOWN     ]                            ) // forward/backward
@@ -117,6 +180,25 @@ void gcb_special_key_up  (int key, int x, int y) {
 #define keyboard_dx()     (!!keymap['D']-!!keymap['A']+!!special_keymap[GLUT_KEY_RIGHT  ]-!!special_keymap[GLUT_KEY_LEFT     ]                            ) // strafe
 
 int _exit_the_program = GL_FALSE;
+int _headless = GL_FALSE; // see USE_HEADLESS
+
+// the part of the full screen image that is currently being rendered, in pixels. (Only used for rendering in tiles; _tile_w==0 means the whole screen.)
+int _tile_x = 0, _tile_y = 0, _tile_w = 0, _tile_h = 0;
+
+void load_projection_identity() {
+ glMatrixMode(GL_PROJECTION);
+ glLoadIdentity();
+ if (_tile_w > 0 && _tile_h > 0) { // magnify the tile's part of the screen so it fills the viewport
+  GLfloat cx = (_tile_x + 0.5f*_tile_w) * 2.f/_screen_x - 1.f;
+  GLfloat cy = (_tile_y + 0.5f*_tile_h) * 2.f/_screen_y - 1.f;
+  glScalef((GLfloat)_screen_x/_tile_w, (GLfloat)_screen_y/_tile_h, 1.f);
+  glTranslatef(-cx, -cy, 0.f);
+ }
+}
+
+void set_window_title(const char *title) {
+ if (!_headless) glutSetWindowTitle(title);
+}
 
 GLfloat _mouse_x = 0; // mouse pointer position is
 GLfloat _mouse_y = 0; // normalized to _screen_size
@@ -125,6 +207,7 @@ GLfloat _mouse_dy = 0;
 char _mouse_button_map[8] = {0};
 
 void gcb_mouse_motion_with_pointer(int x, int y) {
+ record_input("%u motion %d %d\n", _frame, x, y);
  _mouse_dx = -_mouse_x;
  _mouse_dy = -_mouse_y;
  _mouse_x = (x - _screen_x/2) * 2.0f/_screen_size;
@@ -134,6 +217,7 @@ void gcb_mouse_motion_with_pointer(int x, int y) {
 }
 
 void gcb_mouse_motion_pointerless(int x, int y) {
+ record_input("%u pmotion %d %d\n", _frame, x, y);
  int center_x = _screen_x/2;
  int center_y = _screen_y/2;
  x -= center_x;
@@ -141,24 +225,27 @@ void gcb_mouse_motion_pointerless(int x, int y) {
  if (x != 0 || y != 0) {
   _mouse_dx = x *-2.0f/_screen_size;
   _mouse_dy = y * 2.0f/_screen_size;
-  glutWarpPointer(center_x, center_y);
+  if (!_replaying) glutWarpPointer(center_x, center_y); // (the motion event this makes was recorded too)
  }
  _mouse_x = _mouse_y = 0;
 }
 
 void gcb_mouse_click(int button, int state, int x, int y) {
+ _key_mod = get_modifiers();
+ record_input("%u click %d %d %d %d %u\n", _frame, button, state, x, y, _key_mod);
  if (button >= 0 && button < 8) _mouse_button_map[button] = (state==GLUT_DOWN)*KEY_FRESHLY_PRESSED;
  _mouse_x = (x - _screen_x/2) * 2.0f/_screen_size;
  _mouse_y = (y - _screen_y/2) *-2.0f/_screen_size;
- _key_mod = glutGetModifiers();
 }
 
 void show_mouse() {
+ if (_headless) return;
  glutMotionFunc       (gcb_mouse_motion_with_pointer);
  glutPassiveMotionFunc(gcb_mouse_motion_with_pointer);
  glutSetCursor(GLUT_CURSOR_INHERIT);
 }
 void hide_mouse() {
+ if (_headless) return;
  glutMotionFunc       (gcb_mouse_motion_pointerless);
  glutPassiveMotionFunc(gcb_mouse_motion_pointerless);
  glutSetCursor(GLUT_CURSOR_NONE);
@@ -168,17 +255,7 @@ void hide_mouse() {
 
 
 
-void gcb_draw_frame()
-{
- // clear any junk from the double buffer
- glPushAttrib(GL_ENABLE_BIT); glDepthMask(GL_TRUE); glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
- glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
- glPopAttrib();
-
- // render
- draw();
- if (_exit_the_program) exit(0);
-
+void end_frame() { // input bookkeeping after each frame
  // remove the KEY_FRESHLY_PRESSED
  for (int i=0; i<256; i++) {
   keymap[i]         &= 1;
@@ -187,10 +264,28 @@ void gcb_draw_frame()
  for (int i=0; i<8; i++) {
   _mouse_button_map[i] &= 1;
  }
+ _typed[_n_typed = 0] = 0;
  // smooth out the times when mouse dx & dy don't get updated
  _mouse_dx *= 0.875f;
  _mouse_dy *= 0.875f;
- 
+ _frame++;
+ #ifdef USE_RECORDING
+ if (_record) fflush(_record);
+ #endif
+}
+
+void gcb_draw_frame()
+{
+ // clear any junk from the double buffer
+ glPushAttrib(GL_ENABLE_BIT); glDepthMask(GL_TRUE); glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+ glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+ glPopAttrib();
+
+ // render
+ draw();
+ if (_exit_the_program) { record_input("%u quit\n", _frame); exit(0); }
+ end_frame();
+
  #ifdef SHOW_FRAME_RATE
  static int frame=0;
  if (++frame >= 64) {
@@ -222,6 +317,7 @@ void gcb_reshape_window(int width, int height)
  _screen_y = height;
  _screen_size = sqrtf((float)_screen_x*_screen_y);
  _mouse_x = _mouse_y = 0; glutWarpPointer(_screen_x/2, _screen_y/2);
+ record_input("%u reshape %d %d\n", _frame, width, height);
 }
 
 
@@ -239,6 +335,179 @@ void pre_init();
 
 
 
+#ifdef USE_HEADLESS
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+int headless();
+
+EGLDisplay _egl_display = EGL_NO_DISPLAY;
+EGLContext _egl_context = EGL_NO_CONTEXT;
+GLuint     _headless_fbo[2] = {0}; // [0] is what we draw to; [1] is the resolved copy, when multisampling
+GLuint     _headless_rbo[3] = {0};
+GLint      _headless_max_tile = 0; // biggest tile the GL implementation can do, in either dimension
+
+int headless_context() { // creates an offscreen context + framebuffer big enough for one tile. Returns 0 on failure
+ PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+ if (getPlatformDisplay) _egl_display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+ if (_egl_display == EGL_NO_DISPLAY) _egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+ if (_egl_display == EGL_NO_DISPLAY || !eglInitialize(_egl_display, NULL, NULL)) { fprintf(stderr, "headless: can't open an EGL display\n"); return 0; }
+ if (!eglBindAPI(EGL_OPENGL_API)) { fprintf(stderr, "headless: EGL has no desktop OpenGL\n"); return 0; }
+ EGLint attribs[] = {EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE};
+ EGLConfig config = NULL; EGLint n = 0;
+ eglChooseConfig(_egl_display, attribs, &config, 1, &n); // a config isn't strictly needed (EGL_KHR_no_config_context), but some drivers want one
+ _egl_context = eglCreateContext(_egl_display, n>0 ? config : NULL, EGL_NO_CONTEXT, NULL);
+ if (_egl_context == EGL_NO_CONTEXT || !eglMakeCurrent(_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, _egl_context)) { fprintf(stderr, "headless: can't create an OpenGL context (0x%x)\n", eglGetError()); return 0; }
+ glGetIntegerv(GL_MAX_RENDERBUFFER_SIZE, &_headless_max_tile);
+ GLint dims[2]; glGetIntegerv(GL_MAX_VIEWPORT_DIMS, dims);
+ if (_headless_max_tile > dims[0]) _headless_max_tile = dims[0];
+ if (_headless_max_tile > dims[1]) _headless_max_tile = dims[1];
+ return 1;
+}
+
+int headless_framebuffer(int width, int height) { // (re)creates the offscreen framebuffer. Returns 0 on failure
+ if (width > _headless_max_tile || height > _headless_max_tile) { fprintf(stderr, "headless: tile %dx%d is too big (max %d)\n", width, height, _headless_max_tile); return 0; }
+ if (_headless_fbo[0]) { glDeleteFramebuffers(2, _headless_fbo); glDeleteRenderbuffers(3, _headless_rbo); }
+ glGenFramebuffers(2, _headless_fbo);
+ glGenRenderbuffers(3, _headless_rbo);
+ GLsizei samples = 0;
+ #ifdef USE_MULTISAMPLING
+ samples = 4;
+ #endif
+ glBindFramebuffer(GL_FRAMEBUFFER, _headless_fbo[1]);
+ glBindRenderbuffer(GL_RENDERBUFFER, _headless_rbo[2]);
+ glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+ glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _headless_rbo[2]);
+ glBindFramebuffer(GL_FRAMEBUFFER, _headless_fbo[0]);
+ glBindRenderbuffer(GL_RENDERBUFFER, _headless_rbo[0]);
+ glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+ glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, _headless_rbo[0]);
+ #ifndef NO_DEPTH_BUFFER
+ glBindRenderbuffer(GL_RENDERBUFFER, _headless_rbo[1]);
+ glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+ glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, _headless_rbo[1]);
+ #endif
+ if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) { fprintf(stderr, "headless: incomplete framebuffer\n"); return 0; }
+ return 1;
+}
+
+void headless_tile(int x, int y, int width, int height) { // choose which part of the screen the next frame renders. The framebuffer must be at least width x height
+ _tile_x = x; _tile_y = y; _tile_w = width; _tile_h = height;
+ glBindFramebuffer(GL_FRAMEBUFFER, _headless_fbo[0]);
+ glViewport(0, 0, width, height);
+}
+
+void headless_frame() { // one frame, same as what the GLUT main loop would do (minus the input)
+ glPushAttrib(GL_ENABLE_BIT); glDepthMask(GL_TRUE); glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+ glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+ glPopAttrib();
+ draw();
+}
+
+void headless_read_pixels(unsigned char *rgb) { // reads the current tile, bottom row first, 3 bytes per pixel
+ #ifdef USE_MULTISAMPLING
+ glBindFramebuffer(GL_READ_FRAMEBUFFER, _headless_fbo[0]);
+ glBindFramebuffer(GL_DRAW_FRAMEBUFFER, _headless_fbo[1]);
+ glBlitFramebuffer(0, 0, _tile_w, _tile_h, 0, 0, _tile_w, _tile_h, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+ glBindFramebuffer(GL_READ_FRAMEBUFFER, _headless_fbo[1]);
+ #else
+ glBindFramebuffer(GL_READ_FRAMEBUFFER, _headless_fbo[0]);
+ #endif
+ glPixelStorei(GL_PACK_ALIGNMENT, 1);
+ glReadPixels(0, 0, _tile_w, _tile_h, GL_RGB, GL_UNSIGNED_BYTE, rgb);
+ glBindFramebuffer(GL_FRAMEBUFFER, _headless_fbo[0]);
+}
+
+void headless_done() {
+ if (_headless_fbo[0]) { glDeleteFramebuffers(2, _headless_fbo); glDeleteRenderbuffers(3, _headless_rbo); }
+ eglMakeCurrent(_egl_display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+ eglDestroyContext(_egl_display, _egl_context);
+ eglTerminate(_egl_display);
+}
+#endif
+
+
+
+#ifdef USE_RECORDING
+#ifndef USE_HEADLESS
+#error "USE_RECORDING needs USE_HEADLESS (replay runs headless)"
+#endif
+int replay_reshape(int width, int height) { // the window size changes, in the recording
+ if (width  > _headless_max_tile) width  = _headless_max_tile;
+ if (height > _headless_max_tile) height = _headless_max_tile;
+ if (width < 1 || height < 1 || !headless_framebuffer(width, height)) return 0;
+ _screen_x = width;
+ _screen_y = height;
+ _screen_size = sqrtf((float)_screen_x*_screen_y);
+ _mouse_x = _mouse_y = 0;
+ headless_tile(0, 0, width, height);
+ _tile_w = 0; // (one tile is the whole screen)
+ return 1;
+}
+
+int compare_doubles(const void *a, const void *b) { double x = *(const double*)a, y = *(const double*)b; return (x > y) - (x < y); }
+
+int replay() { // plays _replay_file back, headless, and prints how long each frame took. Returns the exit status
+ FILE *f = fopen(_replay_file, "r");
+ unsigned long long seed = 1;
+ if (!f || fscanf(f, "input-recording seed %llu ", &seed) != 1) { fprintf(stderr, "Couldn't read the input recording '%s'\n", _replay_file); if (f) fclose(f); return 1; }
+ rnd_seed(seed);
+ _headless = _replaying = 1;
+ if (!headless_context() || !replay_reshape(_screen_x, _screen_y)) { fclose(f); return 1; }
+ init();
+
+ double *ms = NULL; size_t nFrames = 0, maxFrames = 0;
+ char line[256], event[16]; unsigned frame = 0; int a[5];
+ int have = 0, n = 0, status = 0;
+ #define NEXT_EVENT() (have = fgets(line, sizeof(line), f) && (n = sscanf(line, "%u %15s %d %d %d %d %d", &frame, event, a, a+1, a+2, a+3, a+4)) >= 2)
+ NEXT_EVENT();
+ printf("frame ms\n");
+ while (have && !_exit_the_program) {
+  for (; have && frame <= _frame; NEXT_EVENT()) {
+   _replay_mod = n >= 6 ? a[n-3] : 0; // (modifiers come last)
+   if      (!strcmp(event, "key")        && n >= 5) gcb_key_down(a[0], a[1], a[2]);
+   else if (!strcmp(event, "keyup")      && n >= 5) gcb_key_up(a[0], a[1], a[2]);
+   else if (!strcmp(event, "special")    && n >= 5) gcb_special_key_down(a[0], a[1], a[2]);
+   else if (!strcmp(event, "specialup")  && n >= 5) gcb_special_key_up(a[0], a[1], a[2]);
+   else if (!strcmp(event, "click")      && n >= 6) gcb_mouse_click(a[0], a[1], a[2], a[3]);
+   else if (!strcmp(event, "motion")     && n >= 4) gcb_mouse_motion_with_pointer(a[0], a[1]);
+   else if (!strcmp(event, "pmotion")    && n >= 4) gcb_mouse_motion_pointerless(a[0], a[1]);
+   else if (!strcmp(event, "reshape")    && n >= 4) { if (!replay_reshape(a[0], a[1])) { status = 1; goto out; } }
+   else if (strcmp(event, "quit")) fprintf(stderr, "replay: skipping '%s' on frame %u\n", event, frame);
+  }
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  headless_frame();
+  glFinish();
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double t = (t1.tv_sec - t0.tv_sec)*1e3 + (t1.tv_nsec - t0.tv_nsec)*1e-6;
+  if (nFrames == maxFrames) {
+   maxFrames = maxFrames ? maxFrames*2 : 1024;
+   double *grown = realloc(ms, maxFrames * sizeof(double));
+   if (!grown) { status = 1; goto out; }
+   ms = grown;
+  }
+  ms[nFrames++] = t;
+  printf("%u %.3f\n", _frame, t);
+  end_frame();
+ }
+ #undef NEXT_EVENT
+ if (nFrames) {
+  double total = 0; for (size_t i=0; i<nFrames; i++) total += ms[i];
+  qsort(ms, nFrames, sizeof(double), compare_doubles);
+  printf("# %zu frames: mean %.3f ms, median %.3f ms, 95th percentile %.3f ms, max %.3f ms\n",
+         nFrames, total/nFrames, ms[nFrames/2], ms[(nFrames*95)/100 < nFrames ? (nFrames*95)/100 : nFrames-1], ms[nFrames-1]);
+ }
+out:
+ free(ms);
+ fclose(f);
+ done();
+ headless_done();
+ return status;
+}
+#endif
+
+
+
 int    _global_argc;
 char **_global_argv;
 
@@ -248,6 +517,24 @@ int main(int argc, char **argv) {
  #ifdef USE_PRE_INIT
  pre_init();  if (_exit_the_program) return 1;
  #endif
+ #ifdef USE_RECORDING
+ if (_replay_file) return replay();
+ if (_record_file) {
+  if (!(_record = fopen(_record_file, "w"))) { perror(_record_file); return 1; }
+  fprintf(_record, "input-recording seed %llu\n", _rnd_seed);
+ }
+ #endif
+ #ifdef USE_HEADLESS
+ if (_headless) {
+  if (!headless_context()) return 1;
+  _screen_size = sqrtf((float)_screen_x*_screen_y);
+  init();
+  int status = headless();
+  done();
+  headless_done();
+  return status;
+ }
+ #endif
  glutInitDisplayMode(GLUT_RGBA | GLUT_DOUBLE
  #ifndef NO_DEPTH_BUFFER
   | GLUT_DEPTH
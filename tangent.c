@@ -18,15 +18,35 @@
  along with this program.  If not, see <https://www.gnu.org/licenses/>.
 ***/
 #define NO_ESCAPE
+#define USE_PRE_INIT
+#define USE_HEADLESS
+#define USE_RECORDING
 #include "fullscreen_main.h"
 #include "text-quads.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <png.h>
+#include <poll.h>
+#include <spawn.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+extern char **environ; // (for posix_spawn)
 
 #define MAXTEXTLEVELS 10
+#define CLUSTER_LEVELS 3
 const float TEXT_BOX_SIZES[MAXTEXTLEVELS] = {3, 4, 5, 7, 9, 11, 14, 17, 21, 26}; // in 'em' units
 
 typedef struct {
@@ -34,31 +54,122 @@ typedef struct {
  float dx,dy;
  float size;
  float falloff;
+ float repelSize;           // what its size got cut down to, the last time its share of the repelling was done (see PHYSICS BUDGET)
+ float fx,fy,heat;          // (adaptive steps) the force on it last step, and how far it moves for its force (0: not yet worked out)
  unsigned char r,g,b,flags;
  char *text;
- int nTextLevels;
+ const char *lazyText;      // text that hasn't been needed yet, so it's still in the file: see nodeText()
+ unsigned lazyLength;
+ int nTextLevels;           // 0 until the text renders get made (the first time the node is near the screen)
  TQ_Drawable textRenders[MAXTEXTLEVELS];
+ struct {
+  int slot[CLUSTER_LEVELS]; // 1-based index into clusters[] at each level. 0 means "not registered yet"
+  int next, prev;           // 1-based indices of the other nodes in the same level-0 cell (0: none)
+  float x,y;                // the position & color that the clusters currently account for
+  unsigned char r,g,b;
+ } cl;
 } Node;
+#ifndef MAXNODES
 #define MAXNODES 8192
+#endif
 int nNodes=0;
 Node nodes[MAXNODES];
 
 typedef struct {
  int from, to;
 } Link;
+#ifndef MAXLINKS
 #define MAXLINKS 16384
+#endif
 int nLinks=0;
 Link links[MAXLINKS];
 
+typedef struct { // a grid cell, at one level of the cluster hierarchy. Summarizes all the nodes inside it
+ int level, ix, iy;
+ int count;
+ float sx, sy;      // sum of positions
+ int   sr, sg, sb;  // sum of colors
+ float fx, fy;      // sum of forces on the distant members (for simulating this cluster as one super-node)
+ int   nFar;        // number of distant members contributing to fx,fy
+ unsigned stamp;    // frame number that fx,fy,nFar belong to
+ int first;         // (level 0 only) 1-based index of one of the nodes in it, or 0. The rest are in the nodes' cl.next, cl.prev
+ TQ_Drawable label; // its impostor's label (the count), made when it's first needed
+ int labelCount;    // (the count that the label says)
+} Cluster;
+#define CLUSTER_CELL_SIZE 0.5f     // width of a level-0 cell. Each level up is CLUSTER_BRANCHING times wider
+#define CLUSTER_BRANCHING 4
+#define CLUSTER_OPEN_RATIO 0.5f    // a distant cluster is drawn as one impostor if (cell width / distance) is below this; otherwise it's split into its sub-cells
+#define MAXCLUSTERS (CLUSTER_LEVELS*MAXNODES*2)
+#define CLUSTER_TABLE_SIZE (MAXCLUSTERS*2) // hash table, open addressing
+int nClusters=0;
+Cluster clusters[MAXCLUSTERS];
+int clusterTable[CLUSTER_TABLE_SIZE]; // 1-based indices into clusters[], 0 = empty
+int nTopClusters=0;
+int topClusters[MAXCLUSTERS];        // indices into clusters[] of the top level ones, where finding impostors starts
+int lumpDistant = 0; // boolean: simulate distant clusters as rigid super-nodes
+
+typedef struct { float x, y, size; unsigned char r,g,b; Cluster *c; } Impostor;
+#define MAXIMPOSTORS 512
+int nImpostors=0;
+Impostor impostors[MAXIMPOSTORS];
+
+// simulation settings (adjustable by keys)
+float directionalityX = 0.f;
+float directionalityY = 0.f;
+float relevanceRange  = 7.f;
+int   wobble          = 1;
+int   adaptiveSteps   = 0; // boolean: each node's step size adapts (I), instead of wobble or no wobble
+int   repelArrowheads = 0; // boolean: connections' arrowheads push nodes away too (A)
+int   hopMode         = 0; // boolean: relevance by hops from the focus, not distance (see HOP MODE)
+int   hopRange        = 4; // (in hops, for hop mode)
+
+// how nodes move for the forces on them: plain steps, steps with momentum (wobble), or adaptive steps - a "temperature" for each node, which rises while it keeps heading the same way and drops when it overshoots, so the layout gets to the same place in far fewer steps
+enum { MOTION_PLAIN, MOTION_WOBBLE, MOTION_ADAPTIVE };
+#define HEAT_UP   1.2f
+#define HEAT_DOWN 0.5f
+#define HEAT_MIN  0.05f
+#define HEAT_MAX  32.f
+#define LAYOUT_SETTLED 0.00002f // (world units) a layout is settled once its nodes move less than this per step, on average
+float stepMovement = 0.f;       // how much they moved in the last step, relative to each other (root mean square)
+
+enum { SIM_ALL, SIM_ACTIVE, SIM_HOPS }; // what simulate() works on: every node, the ACTIVE SET, or the nodes in range in HOP MODE
+int simMode = -1;          // (-1: start over, e.g. the clusters got reset)
+
+// PHYSICS BUDGET: how much physics each frame gets. Steps get timed: when they're cheap, a frame does several (so layouts settle faster than the frame rate), and when one step would go over budget, the repelling (the n^2 part) gets spread over several frames, doing a slice of the relevant nodes at a time
+#define PHYSICS_BUDGET_MS 8.f // (default, leaving the rest of a 60 fps frame for everything else)
+#define MAX_SUBSTEPS      8
+#define MAX_REPEL_SLICES  64
+float physicsBudget = -1.f;  // ms per frame (--physics-budget). 0: exactly one full step per frame. (-1: default, which is 0 when headless or recording input, so results don't depend on timing)
+int   physicsSteps  = 1;     // steps per frame, as chosen
+int   repelSlices   = 1;     // 1: all the repelling every step. n: each node's share every nth step
+int   repelPhase    = 0;     // (whose turn it is)
+float stepMs = 0.f, repelMs = 0.f; // measured cost of a step, and of the repelling in it (smoothed)
+
+unsigned long topologyVersion = 0; // goes up whenever connections change or nodes get renumbered
+
+Node* r[MAXNODES]; // the "relevant" nodes, as of the last simulate()
+int nRelevant=0;
+
+// VIEW: node positions stay put, in "world" coordinates. The camera decides which part of the world is on screen, and follows the focus around (see simulate()). Screen coordinates (like _mouse_x, _mouse_y) are (world - view) * viewZoom
+float viewX = 0.f, viewY = 0.f; // the point at the center of the screen
+float viewZoom = 1.f;           // (mouse wheel)
+#define VIEW_ZOOM_MIN 0.5f      // zoomed out, more nodes are relevant, and the repelling costs n^2
+#define VIEW_ZOOM_MAX 8.f
+#define worldX(sx) (viewX + (sx)/viewZoom)
+#define worldY(sy) (viewY + (sy)/viewZoom)
+
+int selecting = 0;                      // boolean: arrow keys held
+float selectorX = 0.f, selectorY = 0.f; // arrow-key selector position (world)
+
 int focus = 0; // index of node that is in focus
 int mark  =-1; // index of node that is marked
 int toDrag=-1; // index of node being dragged by mouse
 
-const    char *          monitorFileName = "/tmp/edit-text-node";
-volatile struct timespec monitorFileTime = {0};
-volatile int             monitorEditNode = -1; // index of node being edited
+#define MAX_EDIT_SESSIONS 16
+typedef struct { int node; unsigned serial; pid_t editor; int saved; } EditSession; // a node whose text is open in a text editor (see editTextNode()). node is -1 if the slot is free, editor is 0 once the editor has exited
+EditSession editSessions[MAX_EDIT_SESSIONS];
 
-#define HELP_TEXT  "CONTROLS\n----\nN: new node\nE: edit text\nLeft Click: select node\nSPACE: mark node\nC: connect nodes\nD: disconnect nodes\nF: swap 'select' vs 'mark'\nDELETE: delete current node\n+: new orphaned node\nCTRL-S: Save\nCTRL-O: Open\nT: show current filename\nESC: quit"
+#define HELP_TEXT  "CONTROLS\n----\nN: new node\nE: edit text\nLeft Click: select node\nMouse wheel: zoom\nSPACE: mark node\nC: connect nodes\nD: disconnect nodes\nF: swap 'select' vs 'mark'\nDELETE: delete current node\n+: new orphaned node\nCTRL-Z: undo\nCTRL-Y: redo\nCTRL-F: search\nCTRL-S: Save\nCTRL-O: Open\nT: show current filename\nL: lump distant clusters together\nI: adaptive steps (settle faster)\nA: arrowheads push nodes away\nH: only show nodes a few connections away\nU: untangle (lay out again)\nESC: quit"
 TQ_Drawable helpRender = {0};
 
 #define MESSAGE_TIMEOUT_NFRAMES 1000
@@ -68,57 +179,279 @@ int messageTimeout = 0;
 TQ_Drawable dialog1Render = {0};
 TQ_Drawable dialog4Render = {0};
 
+// command-line options
+const char *argFile      = NULL; // graph file to open at startup
+const char *renderToFile = NULL; // headless: write a PNG here and quit
+int         readOnly     = 0;    // boolean: never write to the graph file or its journal (--render, --bench-render, --replay)
+int         renderWidth  = 1920, renderHeight = 1080;
+int         renderTile   = 2048; // max tile size, in pixels, for rendering big images in pieces
+int         layoutSteps  = 500;  // headless: how many physics steps before rendering
+int         benchFrames  = 0;    // headless: if nonzero, benchmark this many frames instead of writing a PNG
+const char *convertFrom  = NULL; // convert between file formats and quit
+const char *convertTo    = NULL;
+const char *benchIOFile  = NULL; // measure loading & saving speed of this file, and quit
+const char *serveSocket  = NULL; // be the server for a shared graph (see COLLABORATION)
+const char *joinSocket   = NULL; // edit a shared graph
+const char *commandSource= NULL; // take commands from here while running (see COMMANDS)
+const char *runSource    = NULL; // do the commands from here without a window, and quit
+
 char filename[FILENAME_MAX]=""; // XXX: should it be FILENAME_MAX+1? if so, gotta change it other places too
 int isModified = 0; // boolean: are there unsaved changes.  TODO: update the window title with a star whenever isModified is set to true
+int loading = 0;    // boolean: is a file still loading? (see continueLoading())
 
 #define FLAG_MINIMAXED 1 // node flags
 
+#define LINK_CULL_MARGIN 0.02f       // how far offscreen a link can be and still get drawn (so chevrons & line widths don't pop at the screen edge)
+#define LINK_MIN_CHEVRON_PIXELS 24.f // links shorter than this (on screen) are drawn without a chevron/arrowhead
+
+
+
+
+// Every change to the graph goes through the functions below, as an Edit. That way it can be journaled (and replayed).
+enum { EDIT_ADD=1, EDIT_DELETE, EDIT_CONNECT, EDIT_DISCONNECT, EDIT_TEXT, EDIT_COLOR, EDIT_FLAGS, EDIT_MOVE, EDIT_SWAP, EDIT_EXCHANGE };
+typedef struct {
+ unsigned char op;
+ int node, node2;          // node indices
+ float x, y;
+ unsigned char r,g,b,flags;
+ const char *text;          // EDIT_TEXT only. Not necessarily '\0'-terminated
+ unsigned textLen;
+} Edit;
+#define EDIT_MAX_FIXED 16   // max encoded size of an Edit, not counting the text
+
+size_t encodeEdit(const Edit *e, unsigned char *buf) { // compact little-endian encoding. Returns the number of bytes, not counting the text (which goes right after)
+ unsigned char *p = buf;
+ *p++ = e->op;
+ #define PUT(v) do { memcpy(p, &(v), sizeof(v)); p += sizeof(v); } while (0)
+ switch (e->op) {
+  case EDIT_ADD:        PUT(e->x); PUT(e->y); *p++=e->r; *p++=e->g; *p++=e->b; *p++=e->flags; break;
+  case EDIT_DELETE:     PUT(e->node); break;
+  case EDIT_CONNECT:
+  case EDIT_DISCONNECT:
+  case EDIT_SWAP:
+  case EDIT_EXCHANGE:   PUT(e->node); PUT(e->node2); break;
+  case EDIT_TEXT:       PUT(e->node); PUT(e->textLen); break;
+  case EDIT_COLOR:      PUT(e->node); *p++=e->r; *p++=e->g; *p++=e->b; break;
+  case EDIT_FLAGS:      PUT(e->node); *p++=e->flags; break;
+  case EDIT_MOVE:       PUT(e->node); PUT(e->x); PUT(e->y); break;
+ }
+ #undef PUT
+ return p-buf;
+}
+
+size_t decodeEdit(const unsigned char *buf, size_t avail, Edit *e) { // returns the number of bytes used (including text), or 0 if the data is incomplete or invalid. e->text points into buf
+ const unsigned char *p = buf, *end = buf+avail;
+ memset(e, 0, sizeof(Edit));
+ #define GET(v) do { if (end-p < (long)sizeof(v)) return 0; memcpy(&(v), p, sizeof(v)); p += sizeof(v); } while (0)
+ #define GETB(v) do { if (p >= end) return 0; (v) = *p++; } while (0)
+ GETB(e->op);
+ switch (e->op) {
+  case EDIT_ADD:        GET(e->x); GET(e->y); GETB(e->r); GETB(e->g); GETB(e->b); GETB(e->flags); break;
+  case EDIT_DELETE:     GET(e->node); break;
+  case EDIT_CONNECT:
+  case EDIT_DISCONNECT:
+  case EDIT_SWAP:
+  case EDIT_EXCHANGE:   GET(e->node); GET(e->node2); break;
+  case EDIT_TEXT:       GET(e->node); GET(e->textLen); if ((size_t)(end-p) < e->textLen) return 0; e->text = (const char*)p; p += e->textLen; break;
+  case EDIT_COLOR:      GET(e->node); GETB(e->r); GETB(e->g); GETB(e->b); break;
+  case EDIT_FLAGS:      GET(e->node); GETB(e->flags); break;
+  case EDIT_MOVE:       GET(e->node); GET(e->x); GET(e->y); break;
+  default: return 0;
+ }
+ #undef GET
+ #undef GETB
+ return p-buf;
+}
+
+// Each edit also records how to undo it, in the undo history (see UNDO below). That's usually just the opposite Edit
+enum { UNDO_RESTORE = 100 }; // (never journaled) undoes deleteNode(): the node comes back at its old index, with its text & connections
+typedef struct {
+ Edit e;                  // the inverse of an edit
+ unsigned char ownsText;  // boolean: e.text is a malloc'ed string that belongs to the history. Otherwise it's lazy text (see nodeText()), or NULL
+ unsigned char startsStep;// boolean: the first record of a step (everything that one Ctrl-Z undoes)
+ unsigned nLinks;         // UNDO_RESTORE only: the node's connections
+ Link *links;
+} UndoRecord;
 
+void journalEdit(const Edit *e);
+void connectNodes(int from, int to);
+void freeText(char *text);
+const char *nodeText(int id);
+void clusterUnregister(int id);
+void clusterSync(int id);
+void noteLongLinks(int id);
+void eraseNodeText(int id);
+void genNodeTextRenders(int id);
+void endEditSession(EditSession *s);
+UndoRecord *undoRecord(const Edit *inverse, int ownsText);
+int undoTakeText(int id, Edit *inverse);
+void undoRecordRestore(int id);
+void collabAddEdit(const Edit *e);
+void collabDisconnect(const char *why);
+void simulate();
+void physics();
+int startRelayout();
+void finishRelayout(int wait);
+void searchAdd(int id);
+void searchForget(int id);
+void searchReindex(int id);
+void searchClear();
 
+int newNode(float x, float y, unsigned char r, unsigned char g, unsigned char b, unsigned char flags) { // returns the new node's index, or -1 if full
+ if (nNodes >= MAXNODES) return -1;
+ int id = nNodes;
+ eraseNodeText(id);
+ memset(&nodes[id], 0, sizeof(Node));
+ nodes[id].x = x;  nodes[id].y = y;
+ nodes[id].r = r;  nodes[id].g = g;  nodes[id].b = b;  nodes[id].flags = flags;
+ nNodes++;
+ clusterSync(id);
+ searchAdd(id);
+ Edit e = {EDIT_ADD, 0, 0, x, y, r, g, b, flags};
+ journalEdit(&e);
+ Edit u = {EDIT_DELETE, id};
+ undoRecord(&u, 0);
+ return id;
+}
 
 void addNodeFrom(int id) { // XXX: maybe these functions should actually be where message() is called? Advantage: better feedback for the user - consider for example all the multiple exit points of connectNodes()
  if (nNodes >= MAXNODES) return; // message_printf("Max %d nodes", MAXNODES);
  if (nLinks >= MAXLINKS) return; // message_printf("Max %d connections", MAXLINKS);
  //focus=nNodes;
- nodes[nNodes].x = _mouse_x;
- nodes[nNodes].y = _mouse_y;
- nodes[nNodes].size = nodes[id].size + RND()*0.02f;
- int lum;
- lum = nodes[id].r + (rand()&255)-128; if(lum<0)lum=0; if(lum>255)lum=255; nodes[nNodes].r = lum;
- lum = nodes[id].g + (rand()&255)-128; if(lum<0)lum=0; if(lum>255)lum=255; nodes[nNodes].g = lum;
- lum = nodes[id].b + (rand()&255)-128; if(lum<0)lum=0; if(lum>255)lum=255; nodes[nNodes].b = lum;
- links[nLinks].from = id;
- links[nLinks].to   = nNodes;
- nLinks++;
- nNodes++;
+ int lum, r, g, b;
+ lum = nodes[id].r + (rnd_next()&255)-128; if(lum<0)lum=0; if(lum>255)lum=255; r = lum;
+ lum = nodes[id].g + (rnd_next()&255)-128; if(lum<0)lum=0; if(lum>255)lum=255; g = lum;
+ lum = nodes[id].b + (rnd_next()&255)-128; if(lum<0)lum=0; if(lum>255)lum=255; b = lum;
+ int n = newNode(worldX(_mouse_x), worldY(_mouse_y), r, g, b, 0);
+ nodes[n].size = nodes[id].size + RND()*0.02f;
+ connectNodes(id, n);
 }
 
 void connectNodes(int from, int to) {
  if (to<0 || from<0 || to==from) return; // invalid connection
+ Edit e = {EDIT_CONNECT, from, to};
  for (int i=0; i<nLinks; i++) {
   if (links[i].to==to   && links[i].from==from) return; // already connected
-  if (links[i].to==from && links[i].from==to)
-     {links[i].to= to   ;  links[i].from= from; return;}// flipped direction
+  if (links[i].to==from && links[i].from==to) {
+   links[i].to= to   ;  links[i].from= from; journalEdit(&e); // flipped direction
+   Edit u = {EDIT_CONNECT, to, from};
+   undoRecord(&u, 0);
+   return;
+  }
  }
  if (nLinks >= MAXLINKS) return; // too many links
  links[nLinks].to   = to;
  links[nLinks].from = from;
  nLinks++; // added connection (main case)
+ topologyVersion++;
+ journalEdit(&e);
+ Edit u = {EDIT_DISCONNECT, from, to};
+ undoRecord(&u, 0);
 }
 
 void disconnectNodes(int from, int to) {
  for (int i=0; i<nLinks; i++) {
   if ((links[i].to==to   && links[i].from==from)
   ||  (links[i].to==from && links[i].from==to)) {
+   Edit u = {EDIT_CONNECT, links[i].from, links[i].to};
    links[i--] = links[--nLinks];
+   topologyVersion++;
+   Edit e = {EDIT_DISCONNECT, from, to};
+   journalEdit(&e);
+   undoRecord(&u, 0);
    return; // deleted connection (main case)
   }
  }
 }
 
+void setNodeText(int id, char *text) { // takes ownership of 'text' (which must be malloc'ed, or NULL)
+ Edit u = {EDIT_TEXT, id};
+ undoRecord(&u, undoTakeText(id, &u)); // (the old text moves into the undo history)
+ eraseNodeText(id);
+ nodes[id].text = text; // (the renders get remade when it's next drawn)
+ searchReindex(id);
+ Edit e = {EDIT_TEXT, id}; e.text = text; e.textLen = text ? strlen(text) : 0;
+ journalEdit(&e);
+}
+
+void setNodeColor(int id, unsigned char r, unsigned char g, unsigned char b) {
+ Edit u = {EDIT_COLOR, id}; u.r = nodes[id].r; u.g = nodes[id].g; u.b = nodes[id].b;
+ undoRecord(&u, 0);
+ nodes[id].r = r;  nodes[id].g = g;  nodes[id].b = b;
+ clusterSync(id);
+ Edit e = {EDIT_COLOR, id}; e.r = r; e.g = g; e.b = b;
+ journalEdit(&e);
+}
+
+void setNodeFlags(int id, unsigned char flags) {
+ Edit u = {EDIT_FLAGS, id}; u.flags = nodes[id].flags;
+ undoRecord(&u, 0);
+ nodes[id].flags = flags;
+ Edit e = {EDIT_FLAGS, id}; e.flags = flags;
+ journalEdit(&e);
+}
+
+void moveNode(int id, float x, float y) { // for deliberate moves only (the physics moves nodes all the time, and that's not worth recording)
+ Edit u = {EDIT_MOVE, id, 0, nodes[id].x, nodes[id].y};
+ undoRecord(&u, 0);
+ nodes[id].x = x;  nodes[id].y = y;
+ clusterSync(id); // (it might not be simulated - see ACTIVE SET)
+ Edit e = {EDIT_MOVE, id, 0, x, y};
+ journalEdit(&e);
+}
+
+void swapNodes(int a, int b) { // swaps everything about the two nodes except their connections
+ clusterUnregister(a);  clusterUnregister(b); // (the cells' lists go by index)
+ Node n=nodes[a]; nodes[a]=nodes[b]; nodes[b]=n;
+ clusterSync(a);  clusterSync(b);
+ nodes[a].falloff = nodes[a].size = nodes[b].falloff = nodes[b].size = 0; // (simulate() works out which are relevant again)
+ searchReindex(a);
+ searchReindex(b);
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) { // (the text goes with the rest, so its editor does too)
+  if      (editSessions[i].node == a) editSessions[i].node = b;
+  else if (editSessions[i].node == b) editSessions[i].node = a;
+ }
+ Edit e = {EDIT_SWAP, a, b};
+ journalEdit(&e);
+ undoRecord(&e, 0);
+}
+
+void exchangeNodes(int a, int b) { // swaps the two nodes' indices, connections and all, so nothing visible changes. (For undoing deleteNode(), which moves the last node into the hole)
+ if (a == b) return;
+ clusterUnregister(a);  clusterUnregister(b);
+ Node n=nodes[a]; nodes[a]=nodes[b]; nodes[b]=n;
+ clusterSync(a);  clusterSync(b);
+ nodes[a].falloff = nodes[a].size = nodes[b].falloff = nodes[b].size = 0;
+ topologyVersion++;
+ searchReindex(a);
+ searchReindex(b);
+ for (int i=0; i<nLinks; i++) {
+  if      (links[i].to  ==a) links[i].to  =b; else if (links[i].to  ==b) links[i].to  =a;
+  if      (links[i].from==a) links[i].from=b; else if (links[i].from==b) links[i].from=a;
+ }
+ #define UR(ref)   if (ref==a) ref=b; else if (ref==b) ref=a;
+ UR(mark);
+ UR(focus);
+ UR(toDrag);
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) UR(editSessions[i].node);
+ #undef UR
+ Edit e = {EDIT_EXCHANGE, a, b};
+ journalEdit(&e);
+ undoRecord(&e, 0);
+}
+
 int nodeNearest(float x, float y) {
  int which = 0;
  float lowest = 1e36;
+ if (nRelevant) { // (only relevant nodes are showing)
+  for (int k=0; k<nRelevant; k++) {
+   int i = r[k] - nodes;
+   if (i >= nNodes) continue; // (deleted since)
+   float dsq = (nodes[i].x - x)*(nodes[i].x - x) + (nodes[i].y - y)*(nodes[i].y - y);
+   if (dsq < lowest) { lowest=dsq; which=i; }
+  }
+  if (lowest < 1e36) return which;
+ }
  for (int i=0; i<nNodes; i++) {
   float dsq = (nodes[i].x - x)*(nodes[i].x - x) + (nodes[i].y - y)*(nodes[i].y - y);
   if (dsq < lowest) { lowest=dsq; which=i; }
@@ -126,16 +459,154 @@ int nodeNearest(float x, float y) {
  return which;
 }
 
+float clusterCellSize(int level) {
+ float size = CLUSTER_CELL_SIZE;
+ while (level-- > 0) size *= CLUSTER_BRANCHING;
+ return size;
+}
+
+void clusterReset() { // forget all clusters. Nodes get re-registered by clusterSync()
+ for (int i=0; i<nClusters; i++) tq_delete(&clusters[i].label);
+ nClusters = nTopClusters = 0;
+ simMode = -1; // (which re-registers them all)
+ memset(clusterTable, 0, sizeof(clusterTable));
+ for (int i=0; i<nNodes; i++) memset(&nodes[i].cl, 0, sizeof(nodes[i].cl));
+}
+
+Cluster *clusterLookup(int level, int ix, int iy, int create) { // returns NULL if not found (or if out of space)
+ unsigned h = (unsigned)ix*73856093u ^ (unsigned)iy*19349663u ^ (unsigned)level*83492791u;
+ for (int n=0; n<CLUSTER_TABLE_SIZE; n++) {
+  h &= CLUSTER_TABLE_SIZE-1;
+  int slot = clusterTable[h];
+  if (!slot) {
+   if (!create || nClusters >= MAXCLUSTERS) return NULL;
+   Cluster *c = &clusters[nClusters++];
+   memset(c, 0, sizeof(Cluster));
+   c->level = level; c->ix = ix; c->iy = iy;
+   if (level == CLUSTER_LEVELS-1) topClusters[nTopClusters++] = nClusters-1;
+   clusterTable[h] = nClusters;
+   return c;
+  }
+  Cluster *c = &clusters[slot-1];
+  if (c->level==level && c->ix==ix && c->iy==iy) return c;
+  h++;
+ }
+ return NULL;
+}
+
+void clusterUnregister(int id) {
+ Node *n = &nodes[id];
+ for (int l=0; l<CLUSTER_LEVELS; l++) {
+  if (!n->cl.slot[l]) continue;
+  Cluster *c = &clusters[n->cl.slot[l]-1];
+  c->count--;
+  c->sx -= n->cl.x; c->sy -= n->cl.y;
+  c->sr -= n->cl.r; c->sg -= n->cl.g; c->sb -= n->cl.b;
+ }
+ if (n->cl.slot[0]) { // out of its cell's list
+  if (n->cl.prev) nodes[n->cl.prev-1].cl.next = n->cl.next; else clusters[n->cl.slot[0]-1].first = n->cl.next;
+  if (n->cl.next) nodes[n->cl.next-1].cl.prev = n->cl.prev;
+ }
+ memset(&n->cl, 0, sizeof(n->cl));
+}
+
+void clusterRegister(int id) {
+ Node *n = &nodes[id];
+ for (int l=0; l<CLUSTER_LEVELS; l++) {
+  float size = clusterCellSize(l);
+  Cluster *c = clusterLookup(l, (int)floorf(n->x/size), (int)floorf(n->y/size), 1);
+  if (!c) { clusterReset(); return; } // ran out of space (too many stale empty cells). Start fresh; everything gets re-registered over the next frame
+  c->count++;
+  c->sx += n->x; c->sy += n->y;
+  c->sr += n->r; c->sg += n->g; c->sb += n->b;
+  n->cl.slot[l] = c - clusters + 1;
+ }
+ Cluster *c0 = &clusters[n->cl.slot[0]-1]; // into its cell's list
+ n->cl.next = c0->first;
+ n->cl.prev = 0;
+ if (c0->first) nodes[c0->first-1].cl.prev = id+1;
+ c0->first = id+1;
+ n->cl.x = n->x; n->cl.y = n->y;
+ n->cl.r = n->r; n->cl.g = n->g; n->cl.b = n->b;
+ noteLongLinks(id); // (its connections may reach further now - see LINK CULLING)
+}
+
+void clusterSync(int id) { // bring the clusters up-to-date with a node's current position & color. Cheap unless it crossed into another cell
+ Node *n = &nodes[id];
+ if (n->cl.slot[0]) {
+  Cluster *c0 = &clusters[n->cl.slot[0]-1];
+  if ((int)floorf(n->x/CLUSTER_CELL_SIZE) == c0->ix && (int)floorf(n->y/CLUSTER_CELL_SIZE) == c0->iy) {
+   float dx = n->x - n->cl.x, dy = n->y - n->cl.y;
+   int   dr = n->r - n->cl.r, dg = n->g - n->cl.g, db = n->b - n->cl.b;
+   for (int l=0; l<CLUSTER_LEVELS; l++) {
+    Cluster *c = &clusters[n->cl.slot[l]-1];
+    c->sx += dx; c->sy += dy;
+    c->sr += dr; c->sg += dg; c->sb += db;
+   }
+   n->cl.x = n->x; n->cl.y = n->y;
+   n->cl.r = n->r; n->cl.g = n->g; n->cl.b = n->b;
+   return;
+  }
+  clusterUnregister(id);
+ }
+ clusterRegister(id);
+}
+
+void findImpostors(Cluster *c, float relevanceRange) { // walks down the cluster hierarchy, collecting distant clusters that can be drawn as a single impostor. (In screen coordinates, like relevance)
+ if (c->count <= 0 || nImpostors >= MAXIMPOSTORS) return;
+ float size = clusterCellSize(c->level);
+ float x1 = (c->ix*size - viewX)*viewZoom, x2 = x1 + size*viewZoom;
+ float y1 = (c->iy*size - viewY)*viewZoom, y2 = y1 + size*viewZoom;
+ float nx = x1>0 ? x1 : x2<0 ? x2 : 0; // nearest point of the cell, to the center of the screen
+ float ny = y1>0 ? y1 : y2<0 ? y2 : 0;
+ if (nx*nx + ny*ny >= relevanceRange) { // entire cell is outside the relevance range
+  float cx = (c->sx / c->count - viewX)*viewZoom;
+  float cy = (c->sy / c->count - viewY)*viewZoom;
+  size *= viewZoom;
+  if (c->level==0 || size*size < CLUSTER_OPEN_RATIO*CLUSTER_OPEN_RATIO*(cx*cx+cy*cy)) {
+   if (c->count < 2) return; // a lone node isn't worth an impostor
+   Impostor *im = &impostors[nImpostors++];
+   im->x = cx; im->y = cy;
+   im->size = 0.008f * (1.f + log2f((float)c->count));
+   im->r = c->sr / c->count; im->g = c->sg / c->count; im->b = c->sb / c->count;
+   im->c = c;
+   return;
+  }
+ }
+ if (c->level == 0) return; // cell straddles the relevance boundary: its relevant nodes are drawn individually
+ for (int j=0; j<CLUSTER_BRANCHING; j++) {
+  for (int i=0; i<CLUSTER_BRANCHING; i++) {
+   Cluster *sub = clusterLookup(c->level-1, c->ix*CLUSTER_BRANCHING+i, c->iy*CLUSTER_BRANCHING+j, 0);
+   if (sub) findImpostors(sub, relevanceRange);
+  }
+ }
+}
+
 void eraseNodeText(int id) {
- free(nodes[id].text);
+ freeText(nodes[id].text);
  nodes[id].text = NULL;
+ nodes[id].lazyText = NULL;
  for (int tl=0; tl < nodes[id].nTextLevels; tl++) tq_delete(&nodes[id].textRenders[tl]);
+ nodes[id].nTextLevels = 0;
 }
 
 void deleteNode(int id) {
+ Edit e = {EDIT_DELETE, id};
+ journalEdit(&e);
+ undoRecordRestore(id); // (before its text & connections are gone)
  eraseNodeText(id);
+ clusterUnregister(id);
+ clusterUnregister(nNodes-1);
+ searchForget(id);
+ searchForget(nNodes-1);
  nodes[id] = nodes[--nNodes];
  memset(&nodes[nNodes], 0, sizeof(Node));
+ if (id < nNodes) { // (the one that moved into the hole)
+  clusterSync(id);
+  nodes[id].falloff = nodes[id].size = 0;
+ }
+ searchAdd(id);
+ topologyVersion++;
  for (int i=0; i<nLinks; i++) {
   if (links[i].to==id || links[i].from==id) links[i--] = links[--nLinks];
   else {
@@ -147,17 +618,42 @@ void deleteNode(int id) {
  UR(mark);
  UR(focus);
  UR(toDrag);
- UR(monitorEditNode);
  #undef UR
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) {
+  if (editSessions[i].node == id) endEditSession(&editSessions[i]);
+  else if (editSessions[i].node == nNodes) editSessions[i].node = id;
+ }
 }
 
-void genNodeTextRenders(int id) {
+int applyEdit(const Edit *e) { // does an Edit that came from elsewhere (e.g. the journal). Returns 0 if it doesn't make sense for the current graph
+ int okA = e->node  >= 0 && e->node  < nNodes;
+ int okB = e->node2 >= 0 && e->node2 < nNodes;
+ switch (e->op) {
+  case EDIT_ADD:        return newNode(e->x, e->y, e->r, e->g, e->b, e->flags) >= 0;
+  case EDIT_DELETE:     if (!okA || nNodes<2) return 0; deleteNode(e->node); return 1;
+  case EDIT_CONNECT:    if (!okA || !okB) return 0; connectNodes(e->node, e->node2); return 1;
+  case EDIT_DISCONNECT: if (!okA || !okB) return 0; disconnectNodes(e->node, e->node2); return 1;
+  case EDIT_TEXT:       if (!okA) return 0; setNodeText(e->node, e->textLen ? strndup(e->text, e->textLen) : NULL); return 1;
+  case EDIT_COLOR:      if (!okA) return 0; setNodeColor(e->node, e->r, e->g, e->b); return 1;
+  case EDIT_FLAGS:      if (!okA) return 0; setNodeFlags(e->node, e->flags); return 1;
+  case EDIT_MOVE:       if (!okA) return 0; moveNode(e->node, e->x, e->y); return 1;
+  case EDIT_SWAP:       if (!okA || !okB) return 0; swapNodes(e->node, e->node2); return 1;
+  case EDIT_EXCHANGE:   if (!okA || !okB) return 0; exchangeNodes(e->node, e->node2); return 1;
+ }
+ return 0;
+}
+
+int layoutText(const char *text, TQ_Drawable *renders) { // lays out text at each TEXT_BOX_SIZE it needs (any thread). Returns how many
  int tl=0;
  while (tl<MAXTEXTLEVELS) { // generate:
-  nodes[id].textRenders[tl++] = tq_centered_fitted(nodes[id].text, TEXT_BOX_SIZES[tl], TEXT_BOX_SIZES[tl]);
+  renders[tl++] = tq_centered_fitted(text, TEXT_BOX_SIZES[tl], TEXT_BOX_SIZES[tl]);
   if ((_tq_flags & TQ_FLAG_COMPLETE)) break;
  }
- nodes[id].nTextLevels = tl; /*
+ return tl;
+}
+
+void genNodeTextRenders(int id) {
+ nodes[id].nTextLevels = layoutText(nodeText(id), nodes[id].textRenders); /*
  for (int i=1; i<tl-1; i++) { // remove redundant levels:
   if (nodes[id].textRenders[i-1].n >= nodes[id].textRenders[i].n) {
    tq_delete(&nodes[id].textRenders[i]);
@@ -192,6 +688,19 @@ int message_printf(const char *fmt, ...) {
  return n;
 }
 
+int segmentOnscreen(float x1, float y1, float x2, float y2, float bx, float by) { // does the line segment touch the rectangle from (-bx,-by) to (bx,by)?
+ // trivial rejection: both ends beyond the same edge
+ if (x1 >  bx && x2 >  bx) return 0;
+ if (x1 < -bx && x2 < -bx) return 0;
+ if (y1 >  by && y2 >  by) return 0;
+ if (y1 < -by && y2 < -by) return 0;
+ // the rectangle must straddle the segment's infinite line, otherwise it's a near miss past a corner
+ float nx = y1 - y2;
+ float ny = x2 - x1;
+ float c  = nx*x1 + ny*y1;        // line equation: nx*x + ny*y = c
+ return fabsf(c) <= fabsf(nx)*bx + fabsf(ny)*by;
+}
+
 void drawCircle(float x, float y, float radius) {
  glBegin(GL_LINE_LOOP);
  float da=(float)M_PI/16.f;
@@ -203,166 +712,3034 @@ void drawCircle(float x, float y, float radius) {
 
 
 
-int saveToFile(const char *filename) {
- FILE *f = fopen(filename,"w");
- if (!f) {perror(filename); return 0;} // TODO: handle error case
- fprintf(f, "view:\nf=%d\nnodes:\n", focus);
+// Binary file format: everything is fixed-size records, so a file can be mmap'ed and used with hardly any parsing.  XXX: assumes a little-endian machine (as does the rest of the world these days)
+//  header
+//  node table:   nNodes records
+//  link table:   nLinks records
+//  string table: all the node texts, each followed by a '\0'
+#define BINARY_MAGIC "TNGB"
+#define BINARY_VERSION 1
+#define BINARY_EXTENSION ".tgb" // new files get the binary format if they're named like this
+typedef struct {
+ char     magic[4];
+ uint32_t version;
+ uint32_t nNodes, nLinks;
+ int32_t  focus;
+ uint32_t textBytes;     // size of the string table
+ uint32_t reserved[2];
+} BinaryHeader;
+typedef struct {
+ float    x, y;
+ uint8_t  r, g, b, flags;
+ uint32_t textOffset;    // into the string table
+ uint32_t textLength;    // not counting the '\0'. 0 means no text
+ uint32_t reserved;
+} BinaryNode;
+typedef struct {
+ int32_t from, to;
+} BinaryLink;
+
+typedef struct { float x, y; unsigned char r,g,b,flags; char *text; const char *lazyText; unsigned lazyLength; } SnapshotNode;
+typedef struct { // a copy of the graph, as it was at one moment, for saving. (So the saving can happen on another thread while the graph keeps changing)
+ int nNodes, nLinks, focus;
+ int escaped;            // boolean: is the lazy text escaped? (see TextSource)
+ SnapshotNode *nodes;    // the texts are shared with nodes[] - see freeText()
+ Link *links;
+} Snapshot;
+
+// Node text can stay in the file it was loaded from (which stays mapped) until something needs it - see nodeText(). That way, most of the text in a huge graph never takes up any memory
+#define LAZY_TEXT_MIN (8<<20) // files smaller than this get all their text loaded right away, and unmapped. (So they can be edited by other programs while open, without any surprises)
+typedef struct {
+ const char *map;
+ size_t size;
+ int escaped;            // boolean: is the text escaped like in the text file format, or plain '\0'-terminated like in the binary format?
+} TextSource;
+TextSource textSource = {0};
+TextSource retiredSources[16];  // previous text sources that are still in use by a snapshot
+int nRetiredSources = 0;
+
+// Texts are never copied into snapshots. Instead, while any snapshot exists, replaced texts don't get freed until the last snapshot is gone (copy-on-write, sort of)
+pthread_mutex_t snapshotLock = PTHREAD_MUTEX_INITIALIZER;
+int    nSnapshots = 0;
+char **deferredFrees = NULL;
+size_t nDeferredFrees = 0, maxDeferredFrees = 0;
+
+void freeText(char *text) { // use this instead of free() for node text
+ if (!text) return;
+ pthread_mutex_lock(&snapshotLock);
+ if (!nSnapshots) free(text);
+ else {
+  if (nDeferredFrees == maxDeferredFrees) {
+   size_t newMax = maxDeferredFrees ? maxDeferredFrees*2 : 1024;
+   char **p = realloc(deferredFrees, newMax*sizeof(char*));
+   if (p) { deferredFrees = p; maxDeferredFrees = newMax; }
+  }
+  if (nDeferredFrees < maxDeferredFrees) deferredFrees[nDeferredFrees++] = text;
+  // else: out of memory. Leaking it is better than freeing it while it's being saved
+ }
+ pthread_mutex_unlock(&snapshotLock);
+}
+
+void freeSnapshot(Snapshot *sn) { // (can be called from any thread)
+ if (!sn) return;
+ free(sn->nodes);
+ free(sn->links);
+ free(sn);
+ pthread_mutex_lock(&snapshotLock);
+ if (--nSnapshots == 0) {
+  for (size_t i=0; i<nDeferredFrees; i++) free(deferredFrees[i]);
+  nDeferredFrees = 0;
+  for (int i=0; i<nRetiredSources; i++) munmap((void*)retiredSources[i].map, retiredSources[i].size);
+  nRetiredSources = 0;
+ }
+ pthread_mutex_unlock(&snapshotLock);
+}
+
+void setTextSource(const char *map, size_t size, int escaped) { // the file that lazy text comes from (or NULL). The previous one gets unmapped once nothing uses it
+ pthread_mutex_lock(&snapshotLock);
+ if (textSource.map) {
+  if (!nSnapshots) munmap((void*)textSource.map, textSource.size);
+  else if (nRetiredSources < (int)(sizeof(retiredSources)/sizeof(TextSource))) retiredSources[nRetiredSources++] = textSource;
+  // else: leak the mapping. Very unlikely, and better than pulling it out from under a save
+ }
+ textSource.map = map;  textSource.size = size;  textSource.escaped = escaped;
+ pthread_mutex_unlock(&snapshotLock);
+}
+
+size_t unescapeText(char *out, const char *p, size_t n) { // undoes the text file format's escaping. Returns the unescaped length. out can be NULL to just measure it (it's never longer than n)
+ const char *end = p+n;
+ size_t len = 0;
+ while (p < end) {
+  const char *bs = memchr(p, '\\', end-p); // copy up to the next escape in bulk
+  if (!bs) bs = end;
+  if (out) memcpy(out+len, p, bs-p);
+  len += bs-p; p = bs;
+  if (p+1 < end) {
+   char c = p[1];
+   if      (c=='\"') { if (out) out[len] = '\"';  len++; }
+   else if (c=='n' ) { if (out) out[len] = '\n';  len++; }
+   else if (c=='\\') { if (out) out[len] = '\\'; len++; }
+   else { if (out) { out[len] = '\\'; out[len+1] = c; } len += 2; } // not an escape code: keep both chars
+   p += 2;
+  } else if (p < end) { if (out) out[len] = '\\'; len++; p++; }
+ }
+ return len;
+}
+
+char *loadLazyText(const char *p, unsigned n, int escaped) { // returns a new malloc'ed '\0'-terminated copy, or NULL if out of memory
+ char *str = malloc(n+1);
+ if (!str) return NULL;
+ size_t len = escaped ? unescapeText(str, p, n) : n;
+ if (!escaped) memcpy(str, p, n);
+ str[len] = '\0';
+ return str;
+}
+
+const char *nodeText(int id) { // use this to read a node's text (NULL if none). It gets loaded from the file the first time
+ if (nodes[id].lazyText) {
+  char *str = loadLazyText(nodes[id].lazyText, nodes[id].lazyLength, textSource.escaped);
+  if (!str) return ""; // (try again next time)
+  nodes[id].text = str;
+  nodes[id].lazyText = NULL;
+ }
+ return nodes[id].text;
+}
+
+void loadAllText() { // so the file can be let go of
+ for (int i=0; i<nNodes; i++) nodeText(i);
+ setTextSource(NULL, 0, 0);
+}
+
+void adoptTextSource(const char *map, size_t size, int escaped) { // for loaders: the nodes' lazyText points into 'map', which is now ours
+ if (map != textSource.map) setTextSource(map, size, escaped);
+ if (size < LAZY_TEXT_MIN) loadAllText();
+ else madvise((void*)map, size, MADV_DONTNEED); // the loader just read through all of it, but that doesn't mean it needs to stay in memory
+}
+
+const char *snapshotText(const Snapshot *sn, int i, char **scratch, size_t *scratchSize) { // like nodeText(), but for a snapshot, and without keeping the loaded text: it goes into *scratch, which gets reused (free it when done). Returns NULL on failure
+ const SnapshotNode *n = &sn->nodes[i];
+ if (!n->lazyText) return n->text ? n->text : "";
+ if (!sn->escaped) return n->lazyText; // (already '\0'-terminated, in the binary format)
+ if (*scratchSize < (size_t)n->lazyLength+1) {
+  char *p = realloc(*scratch, n->lazyLength+1);
+  if (!p) return NULL;
+  *scratch = p;  *scratchSize = n->lazyLength+1;
+ }
+ (*scratch)[unescapeText(*scratch, n->lazyText, n->lazyLength)] = '\0';
+ return *scratch;
+}
+
+size_t snapshotTextLength(const Snapshot *sn, int i) {
+ const SnapshotNode *n = &sn->nodes[i];
+ if (!n->lazyText) return n->text ? strlen(n->text) : 0;
+ return sn->escaped ? unescapeText(NULL, n->lazyText, n->lazyLength) : n->lazyLength;
+}
+
+Snapshot *takeSnapshot() { // O(nodes + links), no text gets copied. Returns NULL if out of memory
+ Snapshot *sn = calloc(1, sizeof(Snapshot));
+ if (!sn) return NULL;
+ pthread_mutex_lock(&snapshotLock);
+ nSnapshots++;
+ pthread_mutex_unlock(&snapshotLock);
+ sn->nodes = malloc((nNodes+1)*sizeof(SnapshotNode));
+ sn->links = malloc((nLinks+1)*sizeof(Link));
+ if (!sn->nodes || !sn->links) { freeSnapshot(sn); return NULL; }
  for (int i=0; i<nNodes; i++) {
-  fprintf(f, "i=%d c=%02X%02X%02X t=\"", i, (int)nodes[i].r, (int)nodes[i].g, (int)nodes[i].b);
-  char *p = nodes[i].text;
-  if (p) {
-   while (*p) {
-    if     (*p=='\n') fputs("\\n", f);
-    else if(*p=='\"') fputs("\\\"",f);
-    else fputc(*p, f);
-    p++;
-   }
-  }fprintf(f,"\"\n");
+  SnapshotNode *n = &sn->nodes[i];
+  n->x = nodes[i].x;  n->y = nodes[i].y;
+  n->r = nodes[i].r;  n->g = nodes[i].g;  n->b = nodes[i].b;  n->flags = nodes[i].flags;
+  n->text = nodes[i].text;
+  n->lazyText = nodes[i].lazyText;  n->lazyLength = nodes[i].lazyLength;
+  sn->nNodes = i+1;
  }
- fprintf(f,"connections:\n");
- for (int i=0; i<nLinks; i++) fprintf(f, "a=%d b=%d\n", links[i].from, links[i].to);
+ memcpy(sn->links, links, nLinks*sizeof(Link));
+ sn->nLinks = nLinks;
+ sn->focus = focus;
+ sn->escaped = textSource.escaped;
+ return sn;
+}
+
+int isBinaryFile(const char *filename) { // does this file (if it exists) start with the binary format's magic number?
+ char magic[4] = {0};
+ FILE *f = fopen(filename, "rb");
+ if (!f) return 0;
+ int n = fread(magic, 1, 4, f);
  fclose(f);
+ return n==4 && !memcmp(magic, BINARY_MAGIC, 4);
+}
+
+int wantsBinaryFormat(const char *filename) { // overwriting a binary file keeps it binary; otherwise the file extension decides
+ size_t len = strlen(filename), elen = strlen(BINARY_EXTENSION);
+ if (len >= elen && !strcmp(filename+len-elen, BINARY_EXTENSION)) return 1;
+ return isBinaryFile(filename);
+}
+
+int saveBinaryFile(const char *filename, const Snapshot *sn) {
+ FILE *f = fopen(filename,"wb");
+ if (!f) {perror(filename); return 0;}
+ BinaryHeader h = {BINARY_MAGIC, BINARY_VERSION, sn->nNodes, sn->nLinks, sn->focus, 0, {0}};
+ BinaryNode *bn = calloc(sn->nNodes ? sn->nNodes : 1, sizeof(BinaryNode));
+ if (!bn) { fclose(f); return 0; }
+ for (int i=0; i<sn->nNodes; i++) {
+  bn[i].x = sn->nodes[i].x;  bn[i].y = sn->nodes[i].y;
+  bn[i].r = sn->nodes[i].r;  bn[i].g = sn->nodes[i].g;  bn[i].b = sn->nodes[i].b;  bn[i].flags = sn->nodes[i].flags;
+  size_t len = snapshotTextLength(sn, i);
+  if (len) {
+   bn[i].textOffset = h.textBytes;
+   bn[i].textLength = len;
+   h.textBytes += len + 1;
+  }
+ }
+ int ok = fwrite(&h, sizeof(h), 1, f)==1;
+ if (sn->nNodes) ok &= fwrite(bn, sizeof(BinaryNode), sn->nNodes, f)==(size_t)sn->nNodes;
+ for (int i=0; i<sn->nLinks; i++) {
+  BinaryLink bl = {sn->links[i].from, sn->links[i].to};
+  ok &= fwrite(&bl, sizeof(bl), 1, f)==1;
+ }
+ char *scratch = NULL; size_t scratchSize = 0;
+ for (int i=0; ok && i<sn->nNodes; i++) {
+  if (!bn[i].textLength) continue;
+  const char *text = snapshotText(sn, i, &scratch, &scratchSize);
+  ok = text && fwrite(text, 1, bn[i].textLength+1, f)==bn[i].textLength+1;
+ }
+ free(scratch);
+ free(bn);
+ if (fclose(f)) ok = 0;
+ if (!ok) perror(filename);
+ return ok;
+}
+
+typedef struct { // buffered writer: collects output in big chunks so we make few write() calls
+ int fd;
+ int failed;
+ size_t n;
+ char buf[1<<16];
+} OutBuffer;
+
+void ob_flush(OutBuffer *ob) {
+ for (size_t done=0; done < ob->n && !ob->failed; ) {
+  ssize_t w = write(ob->fd, ob->buf+done, ob->n-done);
+  if (w < 0) ob->failed = 1; else done += w;
+ }
+ ob->n = 0;
+}
+
+void ob_write(OutBuffer *ob, const char *data, size_t len) {
+ while (len > 0) {
+  if (ob->n == sizeof(ob->buf)) ob_flush(ob);
+  size_t chunk = sizeof(ob->buf) - ob->n;
+  if (chunk > len) chunk = len;
+  memcpy(ob->buf + ob->n, data, chunk);
+  ob->n += chunk; data += chunk; len -= chunk;
+ }
+}
+#define ob_puts(ob, str) ob_write(ob, str, sizeof(str)-1) // string literals only
+
+void ob_int(OutBuffer *ob, int value) { // same as printf("%d")
+ char tmp[12]; int i = sizeof(tmp);
+ unsigned u = value < 0 ? -(unsigned)value : (unsigned)value;
+ do { tmp[--i] = '0' + u%10; u /= 10; } while (u);
+ if (value < 0) tmp[--i] = '-';
+ ob_write(ob, &tmp[i], sizeof(tmp)-i);
+}
+
+void ob_hex2(OutBuffer *ob, unsigned char value) { // same as printf("%02X")
+ char tmp[2] = {"0123456789ABCDEF"[value>>4], "0123456789ABCDEF"[value&15]};
+ ob_write(ob, tmp, 2);
+}
+
+void ob_text(OutBuffer *ob, const char *p, size_t len) { // node text, escaped for inside the quotes of t="..."
+ const char *end = p+len;
+ while (p < end) { // copy runs of plain text in bulk, escaping only newlines and quotes. (Backslashes are deliberately left alone, as they always have been)
+  const char *q = p;
+  while (q < end && *q != '\n' && *q != '\"') q++;
+  ob_write(ob, p, q-p);
+  if (q == end) break;
+  if (*q=='\n') ob_puts(ob, "\\n");
+  else           ob_puts(ob, "\\\"");
+  p = q+1;
+ }
+}
+
+int saveTextFile(const char *filename, const Snapshot *sn) { // writes exactly what the old fprintf()-based version did, just much faster
+ OutBuffer *ob = malloc(sizeof(OutBuffer)); // (too big for the stack)
+ if (!ob) return 0;
+ ob->fd = open(filename, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+ if (ob->fd < 0) {perror(filename); free(ob); return 0;}
+ ob->failed = 0; ob->n = 0;
+ char *scratch = NULL; size_t scratchSize = 0;
+ ob_puts(ob, "view:\nf="); ob_int(ob, sn->focus); ob_puts(ob, "\nnodes:\n");
+ for (int i=0; i<sn->nNodes; i++) {
+  ob_puts(ob, "i="); ob_int(ob, i);
+  ob_puts(ob, " c="); ob_hex2(ob, sn->nodes[i].r); ob_hex2(ob, sn->nodes[i].g); ob_hex2(ob, sn->nodes[i].b);
+  ob_puts(ob, " t=\"");
+  const char *p = snapshotText(sn, i, &scratch, &scratchSize);
+  if (!p) ob->failed = 1;
+  else ob_text(ob, p, strlen(p));
+  ob_puts(ob, "\"\n");
+ }
+ ob_puts(ob, "connections:\n");
+ for (int i=0; i<sn->nLinks; i++) {
+  ob_puts(ob, "a="); ob_int(ob, sn->links[i].from);
+  ob_puts(ob, " b="); ob_int(ob, sn->links[i].to);
+  ob_puts(ob, "\n");
+ }
+ free(scratch);
+ ob_flush(ob);
+ if (close(ob->fd)) ob->failed = 1;
+ int ok = !ob->failed;
+ if (!ok) perror(filename);
+ free(ob);
+ return ok;
+}
+
+int writeSnapshot(const char *filename, const Snapshot *sn, int binary) {
+ return binary ? saveBinaryFile(filename, sn) : saveTextFile(filename, sn);
+}
+
+void tempFileName(char *out, size_t size, const char *filename) { // a name to write to first, then rename() to 'filename'. Unique, in case two threads are saving the same file
+ static int counter = 0;
+ snprintf(out, size, "%s.%d.tmp", filename, __sync_fetch_and_add(&counter, 1));
+}
+
+int commitTempFile(const char *tmp, const char *filename, int ok) { // ok: whether writing 'tmp' worked. Makes sure it's on the disk, then renames it over 'filename'. So there's never a half-written file, even if we crash or the disk fills up
+ struct stat st;
+ if (ok && stat(filename, &st)==0) chmod(tmp, st.st_mode & 07777); // keep the old file's permissions
+ int fd = ok ? open(tmp, O_RDONLY) : -1;
+ if (fd >= 0) { ok = fsync(fd)==0; close(fd); }
+ if (ok) ok = rename(tmp, filename)==0;
+ if (!ok) { perror(filename); unlink(tmp); }
+ return ok;
+}
+
+int writeFileAtomically(const char *filename, const Snapshot *sn, int binary) {
+ char tmp[FILENAME_MAX+32];
+ tempFileName(tmp, sizeof(tmp), filename);
+ return commitTempFile(tmp, filename, writeSnapshot(tmp, sn, binary));
+}
+
+int saveToFile(const char *filename) { // (synchronous - for command-line modes. The program uses startSave())
+ Snapshot *sn = takeSnapshot();
+ int ok = sn && writeFileAtomically(filename, sn, wantsBinaryFormat(filename));
+ freeSnapshot(sn);
+ if (!ok) return 0;
  printf("Saved to file %s\n", filename);
  isModified=0;
- glutSetWindowTitle(filename);
+ set_window_title(filename);
  return 1; // XXX: do i really want it to return 1 on success and 0 on failure? same for loadFile() - it's very non-standard. Also it's kind of awkward that the 'filename' param is the same identifier as 'filename' global variable. There's some underlying inconsistancy about which function deals with what - I should probably think of a more maintainable schema.
 }
 
-void saveAs() {
- char fn[FILENAME_MAX];
- FILE *f = popen("zenity --file --title 'SAVE AS...' --save --confirm-overwrite 'Overwrite existing file?' --maximized --on-top", "r");
- if (f) {
-  char *c = fgets(fn,FILENAME_MAX,f);
-  if (pclose(f)==0) {
-   int len=strlen(fn);
-   if (len>1) {
-    fn[len-1] = 0; // to remove the newline
-    strcpy(filename, fn);
-    if (saveToFile(filename)) message_printf("Saved to %s\n", filename);
-    else   message_printf(   "Failed: Couldn't save to %s\n", filename);
+// The journal: every Edit gets appended to a file next to the graph file ("graph.txt.journal"), so saving only needs to flush it - no matter how big the graph is.
+// It also works as an autosave: after a crash, the unsaved edits are recovered when the file is opened again.
+// When the journal gets big, it gets compacted: the whole graph is written out on a background thread, and the journal starts over.
+#define JOURNAL_MAGIC "TNGJ"
+#define JOURNAL_VERSION 1
+#define JOURNAL_COMPACT_MIN (1<<20) // graph files smaller than this get compacted on every save (cheap, and it keeps the layout - physics doesn't go in the journal). Bigger ones only when the journal is a good fraction of the file
+typedef struct {
+ char     magic[4];
+ uint32_t version;
+ uint64_t baseSize;           // identifies the version of the graph file that the journal applies to. If the file has changed since, the journal is stale
+ int64_t  baseSec, baseNsec;  // (its modification time)
+ uint64_t savedLength;        // journal length as of the last save. Anything after this is unsaved changes
+} JournalHeader;
+
+pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER; // (compaction happens on its own thread)
+FILE    *journal = NULL;
+char     journalBase[FILENAME_MAX] = ""; // the graph file that the journal belongs to
+uint64_t journalSaved = 0;
+int      journalMuted = 0;               // boolean: while replaying, don't record the edits again
+volatile int compacting = 0;
+pthread_t compactThread;
+int       compactJoinable = 0;       // boolean: compactThread was started and hasn't been joined yet
+unsigned journalGeneration = 0;          // goes up whenever 'journal' is replaced by a different file
+unsigned long editVersion = 0;           // goes up with every change to the graph
+FILE    *journalPending = NULL;          // while a full save is in progress, edits also get collected here, to start the new file's journal with
+char    *pendingData = NULL;
+size_t   pendingSize = 0;
+
+void journalFileName(char *out, size_t size, const char *base) {
+ snprintf(out, size, "%s.journal", base);
+}
+
+int journalHeaderFor(JournalHeader *h, const char *base) { // fills in the header that a fresh journal for 'base' would have. Returns 0 if there's no such file
+ struct stat st;
+ if (stat(base, &st)) return 0;
+ memset(h, 0, sizeof(JournalHeader));
+ memcpy(h->magic, JOURNAL_MAGIC, 4);
+ h->version  = JOURNAL_VERSION;
+ h->baseSize = st.st_size;
+ h->baseSec  = st.st_mtim.tv_sec;
+ h->baseNsec = st.st_mtim.tv_nsec;
+ h->savedLength = sizeof(JournalHeader);
+ return 1;
+}
+
+void journalEdit(const Edit *e) {
+ editVersion++;
+ if (journalMuted) return;
+ collabAddEdit(e); // (if this is a shared graph)
+ unsigned char buf[EDIT_MAX_FIXED];
+ size_t n = encodeEdit(e, buf), textLen = e->op == EDIT_TEXT ? e->textLen : 0;
+ pthread_mutex_lock(&journalLock);
+ if (journal) {
+  fwrite(buf, 1, n, journal);
+  if (textLen) fwrite(e->text, 1, textLen, journal);
+  fflush(journal); // into the OS at least, so it survives if we crash. (Save does the fsync)
+ }
+ if (journalPending) {
+  fwrite(buf, 1, n, journalPending);
+  if (textLen) fwrite(e->text, 1, textLen, journalPending);
+ }
+ pthread_mutex_unlock(&journalLock);
+}
+
+void journalCollectPending() { // start collecting edits for the journal of a file that's being saved
+ pthread_mutex_lock(&journalLock);
+ if (!journalPending) journalPending = open_memstream(&pendingData, &pendingSize);
+ pthread_mutex_unlock(&journalLock);
+}
+
+void journalEndPending(int keep) { // keep: append the collected edits to the (new) journal
+ pthread_mutex_lock(&journalLock);
+ if (journalPending) {
+  fclose(journalPending);
+  journalPending = NULL;
+  if (keep && journal && pendingSize) { fwrite(pendingData, 1, pendingSize, journal); fflush(journal); }
+  free(pendingData);
+  pendingData = NULL;
+  pendingSize = 0;
+ }
+ pthread_mutex_unlock(&journalLock);
+}
+
+uint64_t journalReplay(const char *base) { // applies the journal for 'base' to the graph (which must have just been loaded from 'base'). Returns the length of the valid part of the journal, or 0 if there's no valid journal
+ char name[FILENAME_MAX+16];
+ journalFileName(name, sizeof(name), base);
+ int fd = open(name, O_RDONLY);
+ if (fd < 0) return 0;
+ struct stat st;
+ JournalHeader expect, *h;
+ unsigned char *data = NULL;
+ if (fstat(fd, &st) || st.st_size < (off_t)sizeof(JournalHeader) || !journalHeaderFor(&expect, base)
+ || !(data = malloc(st.st_size)) || read(fd, data, st.st_size) != st.st_size) { close(fd); free(data); return 0; }
+ close(fd);
+ h = (JournalHeader*)data;
+ if (memcmp(h->magic, expect.magic, 4) || h->version != expect.version || h->baseSize != expect.baseSize || h->baseSec != expect.baseSec || h->baseNsec != expect.baseNsec) {
+  printf("Ignoring stale journal %s\n", name); // the graph file was changed by something else
+  free(data);
+  return 0;
+ }
+ size_t pos = sizeof(JournalHeader);
+ int nEdits = 0, nUnsaved = 0;
+ journalMuted = 1;
+ while (pos < (size_t)st.st_size) {
+  Edit e;
+  size_t n = decodeEdit(data+pos, st.st_size-pos, &e);
+  if (!n || !applyEdit(&e)) break; // the rest is garbage (e.g. we crashed in the middle of writing it)
+  if (pos >= h->savedLength) nUnsaved++;
+  pos += n;
+  nEdits++;
+ }
+ journalMuted = 0;
+ journalSaved = h->savedLength < pos ? h->savedLength : pos;
+ free(data);
+ if (nUnsaved) {
+  isModified = 1;
+  message_printf("Recovered %d unsaved changes", nUnsaved);
+ }
+ if (nEdits) printf("Replayed %d changes from %s\n", nEdits, name);
+ return pos;
+}
+
+void journalStop() {
+ pthread_mutex_lock(&journalLock);
+ if (journal) fclose(journal);
+ journal = NULL;
+ journalBase[0] = 0;
+ journalGeneration++;
+ pthread_mutex_unlock(&journalLock);
+}
+
+void journalStart(const char *base, uint64_t keepLength) { // starts journaling edits to 'base'. keepLength: how much of an existing journal to keep (from journalReplay()), or 0 to start a fresh one
+ journalStop();
+ char name[FILENAME_MAX+16];
+ journalFileName(name, sizeof(name), base);
+ JournalHeader h;
+ if (!journalHeaderFor(&h, base)) return;
+ pthread_mutex_lock(&journalLock);
+ if (keepLength >= sizeof(JournalHeader) && (journal = fopen(name, "r+b"))) {
+  if (ftruncate(fileno(journal), keepLength)) {} // cut off any garbage at the end
+  fseek(journal, 0, SEEK_END);
+ } else if ((journal = fopen(name, "w+b"))) {
+  fwrite(&h, sizeof(h), 1, journal);
+  fflush(journal);
+  journalSaved = h.savedLength;
+ } else perror(name); // no journal then; saving will write the whole file every time
+ if (journal) strcpy(journalBase, base);
+ pthread_mutex_unlock(&journalLock);
+}
+
+int journalCommit() { // makes everything in the journal count as saved. Returns 0 on failure. The lock isn't held while waiting for the disk, so edits can keep coming in
+ pthread_mutex_lock(&journalLock);
+ int fd = journal && fflush(journal)==0 ? dup(fileno(journal)) : -1; // (dup, in case the journal gets replaced meanwhile)
+ uint64_t length = journal ? ftell(journal) : 0;
+ unsigned generation = journalGeneration;
+ pthread_mutex_unlock(&journalLock);
+ if (fd < 0) return 0;
+ int ok = fsync(fd)==0
+       && pwrite(fd, &length, sizeof(length), offsetof(JournalHeader, savedLength)) == sizeof(length)
+       && fsync(fd)==0;
+ close(fd);
+ pthread_mutex_lock(&journalLock);
+ if (ok && generation == journalGeneration) journalSaved = length; // (if it got compacted meanwhile, the new journal just says those edits are unsaved. They'd be recovered after a crash, either way)
+ pthread_mutex_unlock(&journalLock);
+ return ok;
+}
+
+void journalDiscardUnsaved() { // for when the user chooses "Don't save"
+ pthread_mutex_lock(&journalLock);
+ if (journal) {
+  fflush(journal);
+  if (ftruncate(fileno(journal), journalSaved)) {}
+  fseek(journal, 0, SEEK_END);
+ }
+ pthread_mutex_unlock(&journalLock);
+}
+
+typedef struct { Snapshot *sn; int binary; uint64_t from; char base[FILENAME_MAX]; } Compaction;
+
+void *compactJournal(void *ptr) { // pthread: writes the snapshot over the graph file, then restarts the journal with only what came after the snapshot
+ Compaction *c = ptr;
+ char name[FILENAME_MAX+16], jtmp[FILENAME_MAX+32];
+ journalFileName(name, sizeof(name), c->base);
+ snprintf(jtmp, sizeof(jtmp), "%s.tmp", name);
+ if (writeFileAtomically(c->base, c->sn, c->binary)) {
+  pthread_mutex_lock(&journalLock);
+  JournalHeader h;
+  FILE *nj = NULL;
+  if (journal && !strcmp(journalBase, c->base) && journalHeaderFor(&h, c->base) && (nj = fopen(jtmp, "w+b"))) {
+   fflush(journal);
+   uint64_t end = ftell(journal);
+   h.savedLength = sizeof(h) + (journalSaved > c->from ? journalSaved - c->from : 0);
+   fwrite(&h, sizeof(h), 1, nj);
+   char buf[1<<16];
+   for (uint64_t pos = c->from; pos < end; ) { // copy the edits that happened since the snapshot
+    ssize_t n = pread(fileno(journal), buf, end-pos < sizeof(buf) ? end-pos : sizeof(buf), pos);
+    if (n <= 0) break;
+    fwrite(buf, 1, n, nj);
+    pos += n;
+   }
+   if (fflush(nj)==0 && fsync(fileno(nj))==0 && rename(jtmp, name)==0) {
+    fclose(journal);
+    journal = nj;
+    journalSaved = h.savedLength;
+    journalGeneration++;
+   } else { fclose(nj); unlink(jtmp); }
+  }
+  pthread_mutex_unlock(&journalLock);
+  printf("Compacted %s\n", c->base);
+ } else fprintf(stderr, "Couldn't compact %s\n", c->base);
+ freeSnapshot(c->sn);
+ free(c);
+ compacting = 0;
+ return NULL;
+}
+
+void finishCompaction() { // blocks until any compaction is done (e.g. before quitting: compaction is safe to interrupt, but then the file isn't written, and it has to be done all over again next time)
+ if (!compactJoinable) return;
+ pthread_join(compactThread, NULL);
+ compactJoinable = 0;
+}
+
+void maybeCompactJournal() { // call this right after a save, so the snapshot matches what was saved
+ if (!journal || compacting) return;
+ finishCompaction(); // (the last one is over, so this doesn't wait)
+ struct stat st;
+ pthread_mutex_lock(&journalLock);
+ fflush(journal);
+ long length = ftell(journal);
+ int allSaved = journalSaved == (uint64_t)length; // (otherwise the snapshot would put unsaved edits in the file)
+ pthread_mutex_unlock(&journalLock);
+ if (!allSaved || stat(journalBase, &st) || (st.st_size >= JOURNAL_COMPACT_MIN && length < st.st_size/4)) return;
+ Compaction *c = calloc(1, sizeof(Compaction));
+ if (!c || !(c->sn = takeSnapshot())) { free(c); return; }
+ c->binary = wantsBinaryFormat(journalBase);
+ c->from = length; // the snapshot has every edit up to here (edits only happen on this thread)
+ strcpy(c->base, journalBase);
+ compacting = 1;
+ if (pthread_create(&compactThread, NULL, compactJournal, c)) { compacting = 0; freeSnapshot(c->sn); free(c); return; }
+ compactJoinable = 1;
+}
+
+// UNDO/REDO: every edit records its inverse in the undo history, and undoing it records the inverse of *that* in the redo history.
+// Replaced and deleted texts move into the history instead of being copied (and lazy text stays in the file), so the history costs memory in proportion to the edits, not to the graph
+#ifndef UNDO_MEMORY_LIMIT
+#define UNDO_MEMORY_LIMIT (64<<20) // bytes, by default (see --undo-memory). The oldest steps get forgotten to stay under it
+#endif
+typedef struct { UndoRecord *r; size_t first, n, max; size_t bytes; } UndoHistory; // the records are r[first..n), oldest first
+UndoHistory undoHistory = {0}, redoHistory = {0};
+size_t undoMemoryLimit = UNDO_MEMORY_LIMIT;
+enum { UNDO_NORMAL, UNDO_UNDOING, UNDO_REDOING };
+int undoState = UNDO_NORMAL;
+int undoStepStarted = 0; // boolean: the current step already has a record. (A step is all the edits in one frame - see undoCheckpoint())
+int undoMuted = 0;       // while undoing a deleteNode(), which gets recorded as one thing
+UndoHistory collabInverses = {0}; // editing a shared graph: how to undo your edits that the server hasn't confirmed yet (see COLLABORATION)
+int collabKeepInverses = 0; // boolean: editing a shared graph
+int collabApplying = 0;     // boolean: these edits came from the server (or are taking yours back), so don't send them, or record them anywhere
+int collabReplaying = 0;    // boolean: making your unconfirmed edits again: don't send them again, or put them in your undo history
+
+size_t undoRecordBytes(const UndoRecord *u) {
+ return sizeof(UndoRecord) + (u->ownsText ? u->e.textLen+1 : 0) + u->nLinks*sizeof(Link);
+}
+
+void undoForget(UndoRecord *u) { // frees whatever the record owns
+ if (u->ownsText) freeText((char*)u->e.text);
+ free(u->links);
+}
+
+void undoClearHistory(UndoHistory *h) {
+ for (size_t i=h->first; i<h->n; i++) undoForget(&h->r[i]);
+ h->first = h->n = 0;
+ h->bytes = 0;
+}
+
+void undoClear() { // (e.g. another graph got loaded)
+ undoClearHistory(&undoHistory);
+ undoClearHistory(&redoHistory);
+ undoStepStarted = 0;
+}
+
+int undoTakeText(int id, Edit *inverse) { // puts node id's text in *inverse, for undoRecord(). Returns 1 if it took the malloc'ed text away from the node (so it won't get freed), 0 if it's lazy text or none
+ if (nodes[id].lazyText) {
+  inverse->text = nodes[id].lazyText;
+  inverse->textLen = nodes[id].lazyLength;
+  return 0;
+ }
+ inverse->text = nodes[id].text;
+ inverse->textLen = nodes[id].text ? strlen(nodes[id].text) : 0;
+ nodes[id].text = NULL;
+ return inverse->text != NULL;
+}
+
+UndoRecord *undoPush(UndoHistory *h, const Edit *inverse, int ownsText, Link *links, unsigned nLinks) { // adds a record, taking ownership of the text & links. Returns NULL if out of memory
+ if (h->n == h->max) {
+  if (h->first && h->first >= h->max/2) { // (room at the front, from forgetting old steps)
+   memmove(h->r, h->r + h->first, (h->n - h->first)*sizeof(UndoRecord));
+   h->n -= h->first;
+   h->first = 0;
+  } else {
+   size_t newMax = h->max ? h->max*2 : 256;
+   UndoRecord *p = realloc(h->r, newMax*sizeof(UndoRecord));
+   if (!p) {
+    if (ownsText) freeText((char*)inverse->text);
+    free(links);
+    return NULL;
    }
-   else puts("Empty filename");
+   h->r = p;  h->max = newMax;
   }
-  else puts("No filename selected");
  }
+ UndoRecord *u = &h->r[h->n++];
+ memset(u, 0, sizeof(UndoRecord));
+ u->e = *inverse;
+ u->ownsText = ownsText;
+ u->links = links;  u->nLinks = nLinks;
+ h->bytes += undoRecordBytes(u);
+ return u;
 }
 
-void save() {
- if (!filename[0]) saveAs(); // untitled
- else {
-  if (saveToFile(filename)) message_printf("Saved to %s\n", filename);
-  else   message_printf(   "Failed: Couldn't save to %s\n", filename);
+UndoRecord *undoRecordLinks(const Edit *inverse, int ownsText, Link *links, unsigned nLinks) { // (called by the edit functions) records how to undo an edit. Takes ownership of the text & links either way. Returns the new record, or NULL if it didn't get recorded
+ UndoHistory *h = undoState == UNDO_UNDOING ? &redoHistory : &undoHistory;
+ if (journalMuted || undoMuted) goto none; // (replaying a journal isn't something to undo)
+ if (collabKeepInverses && !collabApplying) { // a copy, in case the edit has to be taken back and made again after someone else's (see collabPoll())
+  Edit copy = *inverse;
+  char *text = ownsText ? strdup(inverse->text) : NULL;
+  Link *ls = nLinks ? malloc(nLinks*sizeof(Link)) : NULL;
+  if (ls) memcpy(ls, links, nLinks*sizeof(Link));
+  if (ownsText) copy.text = text;
+  undoPush(&collabInverses, &copy, text != NULL, ls, ls ? nLinks : 0);
+ }
+ if (collabApplying || collabReplaying) goto none; // (your undo history is for your own edits)
+ if (undoState == UNDO_NORMAL) {
+  undoClearHistory(&redoHistory); // a new edit: what was undone can't be redone any more
+  if (!undoStepStarted && h->n > h->first) { // holding a key to change a color, or moving the same node again, is one step
+   UndoRecord *last = &h->r[h->n-1];
+   if (last->startsStep && last->e.op == inverse->op && last->e.node == inverse->node && (inverse->op == EDIT_COLOR || inverse->op == EDIT_MOVE)) { undoStepStarted = 1; goto none; }
+  }
+ }
+ UndoRecord *u = undoPush(h, inverse, ownsText, links, nLinks);
+ if (!u) { undoClear(); return NULL; } // out of memory: a history with a hole in it would be worse than none
+ u->startsStep = !undoStepStarted;
+ undoStepStarted = 1;
+ return u;
+ none:
+ if (ownsText) freeText((char*)inverse->text);
+ free(links);
+ return NULL;
+}
+
+UndoRecord *undoRecord(const Edit *inverse, int ownsText) {
+ return undoRecordLinks(inverse, ownsText, NULL, 0);
+}
+
+void undoRecordRestore(int id) { // (called by deleteNode(), before it does anything) records all it takes to bring node id back
+ Edit u = {UNDO_RESTORE, id, 0, nodes[id].x, nodes[id].y, nodes[id].r, nodes[id].g, nodes[id].b, nodes[id].flags};
+ int ownsText = undoTakeText(id, &u);
+ unsigned n = 0;
+ for (int i=0; i<nLinks; i++) n += links[i].from==id || links[i].to==id;
+ Link *ls = n ? malloc(n*sizeof(Link)) : NULL; // (out of memory: it comes back unconnected)
+ if (ls) for (int i=0, k=0; i<nLinks; i++) if (links[i].from==id || links[i].to==id) ls[k++] = links[i];
+ undoRecordLinks(&u, ownsText, ls, ls ? n : 0);
+}
+
+int undoApply(UndoRecord *u) { // does the inverse edit (which records its own inverse). Returns 0 if it doesn't fit the graph, which shouldn't happen
+ const Edit *e = &u->e;
+ char *text = NULL;
+ if (e->op == EDIT_TEXT || e->op == UNDO_RESTORE) {
+  if (u->ownsText) { text = (char*)e->text; u->ownsText = 0; } // (back into the node it came from, without copying)
+  else if (e->text) text = loadLazyText(e->text, e->textLen, textSource.escaped);
+  if (e->node < 0 || e->node > nNodes - (e->op == EDIT_TEXT)) { freeText(text); return 0; }
+ }
+ if (e->op == EDIT_TEXT) { setNodeText(e->node, text); return 1; }
+ if (e->op != UNDO_RESTORE) return applyEdit(e);
+ undoMuted++; // (the restore is recorded as one deletion, below)
+ int id = newNode(e->x, e->y, e->r, e->g, e->b, e->flags);
+ if (id >= 0) {
+  exchangeNodes(e->node, id); // (back at its old index, and the node that took its place goes back to the end)
+  setNodeText(e->node, text);
+  for (unsigned i=0; i<u->nLinks && nLinks < MAXLINKS; i++) { // (they can't be duplicates, so connectNodes()'s search isn't needed)
+   links[nLinks++] = u->links[i];
+   Edit c = {EDIT_CONNECT, u->links[i].from, u->links[i].to};
+   journalEdit(&c);
+  }
+ } else freeText(text);
+ undoMuted--;
+ if (id < 0) return 0;
+ Edit d = {EDIT_DELETE, e->node};
+ undoRecord(&d, 0);
+ return 1;
+}
+
+int undoStep(UndoHistory *h, int state) { // undoes (or redoes) the latest step in h. Returns 0 if there's none
+ if (h->n == h->first) return 0;
+ undoState = state;
+ undoStepStarted = 0;
+ UndoRecord u;
+ do {
+  u = h->r[--h->n];
+  h->bytes -= undoRecordBytes(&u);
+  undoApply(&u);
+  undoForget(&u); // (whatever undoApply() didn't take back)
+ } while (!u.startsStep && h->n > h->first);
+ undoState = UNDO_NORMAL;
+ undoStepStarted = 0;
+ return 1;
+}
+
+int undo() { return undoStep(&undoHistory, UNDO_UNDOING); }
+int redo() { return undoStep(&redoHistory, UNDO_REDOING); }
+
+void undoCheckpoint() { // call this every frame: the edits from here on are a new step. Also forgets the oldest steps, if the history is over its memory limit
+ undoStepStarted = 0;
+ while (undoHistory.bytes + redoHistory.bytes > undoMemoryLimit && undoHistory.n > undoHistory.first) {
+  do {
+   UndoRecord *u = &undoHistory.r[undoHistory.first++];
+   undoHistory.bytes -= undoRecordBytes(u);
+   undoForget(u);
+  } while (undoHistory.first < undoHistory.n && !undoHistory.r[undoHistory.first].startsStep);
+ }
+ if (undoHistory.first == undoHistory.n) undoHistory.first = undoHistory.n = 0;
+}
+
+// Saving happens on its own thread, so drawing never has to wait for the disk. Only one save at a time; finishSave() picks up the result
+typedef struct {
+ Snapshot *sn;            // the graph to write, or NULL to just commit the journal
+ int binary;
+ int ok;                  // result, from the save thread
+ unsigned long version;   // editVersion when the save started
+ char filename[FILENAME_MAX];
+} SaveJob;
+SaveJob  *saveJob = NULL;
+pthread_t saveThread;
+volatile int saveFinished = 0;
+
+void *saveInBackground(void *ptr) { // pthread
+ SaveJob *job = ptr;
+ job->ok = job->sn ? writeFileAtomically(job->filename, job->sn, job->binary) : journalCommit();
+ __sync_synchronize();
+ saveFinished = 1;
+ return NULL;
+}
+
+void finishSave(int wait) { // call this every frame. wait: boolean: block until the save is done (e.g. before quitting)
+ if (!saveJob || !(wait || saveFinished)) return;
+ pthread_join(saveThread, NULL);
+ SaveJob *job = saveJob;
+ saveJob = NULL;
+ if (job->sn) { // the whole file was written: journal to it from now on, starting with whatever changed during the save
+  if (job->ok) {
+   journalDiscardUnsaved(); // (if the old journal was for a different file, that file stays as it was last saved)
+   journalStart(job->filename, 0);
+  }
+  journalEndPending(job->ok);
+  freeSnapshot(job->sn);
+ }
+ if (job->ok) {
+  if (job->version == editVersion) isModified = 0;
+  printf("Saved to file %s\n", job->filename);
+  message_printf("Saved to %s", job->filename);
+  set_window_title(job->filename);
+  if (!job->sn) maybeCompactJournal();
+ } else {
+  fprintf(stderr, "Couldn't save to %s\n", job->filename);
+  message_printf("Failed: Couldn't save to %s", job->filename);
+ }
+ free(job);
+}
+
+int startSave(const char *fn) { // returns 0 if the save couldn't even start
+ if (readOnly) { message("Not saving: the file is read-only here"); return 0; }
+ if (saveJob) { message("Still saving - try again in a moment"); return 0; }
+ if (loading) { message("Still loading - try again in a moment"); return 0; }
+ SaveJob *job = calloc(1, sizeof(SaveJob));
+ if (!job) return 0;
+ snprintf(job->filename, sizeof(job->filename), "%s", fn);
+ job->version = editVersion;
+ if (!(journal && !strcmp(journalBase, fn))) { // the usual case is that all the changes are already in the journal. Otherwise, write the whole thing
+  if (!(job->sn = takeSnapshot())) { free(job); message("Failed: Out of memory"); return 0; }
+  job->binary = wantsBinaryFormat(fn);
+  journalCollectPending();
+ }
+ saveFinished = 0;
+ if (pthread_create(&saveThread, NULL, saveInBackground, job)) {
+  if (job->sn) { journalEndPending(0); freeSnapshot(job->sn); }
+  free(job);
+  message_printf("Failed: Couldn't save to %s", fn);
+  return 0;
+ }
+ saveJob = job;
+ message_printf("Saving %s...", fn);
+ return 1;
+}
+
+// FILE DIALOGS are zenity, run as a child process. Its answer comes back through a pipe, which pollFileDialog() checks every frame, so the graph keeps moving while it's up
+enum { DIALOG_NONE, DIALOG_SAVE_AS, DIALOG_OPEN };
+struct { int kind; pid_t pid; int fd; size_t length; char answer[FILENAME_MAX]; } fileDialog = {DIALOG_NONE, 0, -1};
+
+int startFileDialog(int kind) { // returns 0 if it couldn't
+ char *saveAsArgs[] = {"zenity","--file","--title","SAVE AS...","--save","--confirm-overwrite","Overwrite existing file?","--maximized","--on-top",NULL};
+ char *openArgs[]   = {"zenity","--file","--title","Open graph file...","--maximized","--close-on-unfocus",NULL}; // or could also use --on-top
+ if (fileDialog.kind) { message("Close the file dialog first"); return 0; }
+ int fds[2];
+ if (pipe(fds)) { perror("pipe"); return 0; }
+ fcntl(fds[0], F_SETFD, FD_CLOEXEC); // (so editors etc don't hold it open)
+ fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+ posix_spawn_file_actions_t actions;
+ posix_spawn_file_actions_init(&actions);
+ posix_spawn_file_actions_adddup2(&actions, fds[1], 1); // its stdout
+ int err = posix_spawnp(&fileDialog.pid, "zenity", &actions, NULL, kind==DIALOG_OPEN ? openArgs : saveAsArgs, environ);
+ posix_spawn_file_actions_destroy(&actions);
+ close(fds[1]);
+ if (err) { close(fds[0]); message("Can't show the file dialog: zenity isn't installed"); return 0; }
+ fcntl(fds[0], F_SETFL, O_NONBLOCK);
+ fileDialog.kind = kind;
+ fileDialog.fd = fds[0];
+ fileDialog.length = 0;
+ return 1;
+}
+
+int pollFileDialog() { // (every frame) returns the kind of dialog that was just answered (the filename is in fileDialog.answer), or DIALOG_NONE
+ if (!fileDialog.kind) return DIALOG_NONE;
+ if (fileDialog.fd >= 0) {
+  ssize_t n;
+  while ((n = read(fileDialog.fd, fileDialog.answer + fileDialog.length, sizeof(fileDialog.answer)-1 - fileDialog.length)) > 0) fileDialog.length += n;
+  if (n < 0 && (errno == EAGAIN || errno == EINTR)) return DIALOG_NONE; // still up
+  close(fileDialog.fd);
+  fileDialog.fd = -1;
+ }
+ int status = -1;
+ if (waitpid(fileDialog.pid, &status, WNOHANG) == 0) return DIALOG_NONE; // (closing)
+ int kind = fileDialog.kind;
+ fileDialog.kind = DIALOG_NONE;
+ fileDialog.answer[fileDialog.length] = 0;
+ char *nl = strchr(fileDialog.answer, '\n');
+ if (nl) *nl = 0; // to remove the newline
+ if (!WIFEXITED(status) || WEXITSTATUS(status)) { puts("No filename selected"); return DIALOG_NONE; }
+ if (!fileDialog.answer[0])                      { puts("Empty filename");      return DIALOG_NONE; }
+ return kind;
+}
+
+void closeFileDialog() {
+ if (!fileDialog.kind) return;
+ kill(fileDialog.pid, SIGTERM);
+ waitpid(fileDialog.pid, NULL, 0);
+ if (fileDialog.fd >= 0) close(fileDialog.fd);
+ fileDialog.kind = DIALOG_NONE;
+ fileDialog.fd = -1;
+}
+
+void saveAs() { // (the save starts when the dialog is answered - see draw())
+ startFileDialog(DIALOG_SAVE_AS);
+}
+
+void save() {
+ if (!filename[0]) saveAs(); // untitled
+ else startSave(filename);
+}
+
+
+
+void clearGraph() {
+ for (int i=0; i<nNodes; i++) {
+  eraseNodeText(i);
+  nodes[i].x = RND();
+  nodes[i].y = RND();
+ }
+ nNodes = nLinks = 0;
+ topologyVersion++;
+ clusterReset();
+ searchClear();
+}
+
+// LOADING happens on its own thread, so even a huge file doesn't freeze the program. The loader thread publishes what it has parsed so far (all the nodes first, then the connections), and the main thread moves that into the graph a chunk at a time, every frame - see continueLoading(). So the graph grows on screen while the file streams in, and you can look around meanwhile (but not edit)
+#define LOAD_CHUNK 4096            // the loader thread publishes its progress every this many nodes or connections
+#define LOAD_FRAME_BUDGET (1<<16)  // max nodes + connections moved into the graph per frame, so a frame takes about as long no matter how big the file is
+#define PARK_DISTANCE 1e4f         // text files have no positions, so their nodes wait far offscreen until a connection brings them in next to a node that's already placed. Starting from the focus node, so the graph grows outward from where you left it
+enum { LOAD_RUNNING, LOAD_DONE, LOAD_FAILED };
+typedef struct { float x, y; unsigned char r,g,b,flags, present, placed; unsigned textLength; const char *text; } LoadedNode; // (text: still in the file. Escaped, for the text format)
+typedef struct {
+ char filename[FILENAME_MAX];
+ int opening;                 // boolean: opening it for the user (journal, 'filename' etc), rather than just loading it for a command-line mode
+ const char *map;             // the file. The nodes' text points into it
+ size_t size;
+ int escaped;                 // (see TextSource)
+ int focus;                   // the file's focus node
+ volatile int nNodes, nLinks; // how much of loadedNodes[] and loadedLinks[] is ready for the main thread
+ volatile int status;         // LOAD_RUNNING until the loader thread is done
+ volatile int cancel;         // boolean: tells the loader thread to give up
+ int started;                 // boolean (main thread): the old graph has been replaced
+ int joined;                  // boolean (main thread)
+} Loader;
+Loader    loader;
+pthread_t loaderThread;
+LoadedNode loadedNodes[MAXNODES];
+Link       loadedLinks[MAXLINKS];
+
+#define isParked(id) (loading && !loadedNodes[id].placed) // see PARK_DISTANCE
+
+void publish(volatile int *count, int n) { // (loader thread) makes everything parsed so far visible to the main thread
+ __sync_synchronize();
+ *count = n;
+}
+
+const char *mapFile(const char *filename, size_t *size) { // read-only. Returns NULL on failure (or if it's empty)
+ int fd = open(filename, O_RDONLY);
+ if (fd < 0) { perror(filename); return NULL; }
+ struct stat st;
+ if (fstat(fd, &st) || st.st_size <= 0) { close(fd); return NULL; }
+ *size = st.st_size;
+ const char *map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+ close(fd);
+ if (map == MAP_FAILED) { perror(filename); return NULL; }
+ madvise((void*)map, *size, MADV_SEQUENTIAL);
+ return map;
+}
+
+int parseBinaryFile(Loader *ld) { // (loader thread) each node and connection gets validated before it's published
+ if (ld->size < sizeof(BinaryHeader)) return 0;
+ const BinaryHeader *h = (const BinaryHeader*)ld->map;
+ const BinaryNode   *bn = (const BinaryNode*)(h+1);
+ const BinaryLink   *bl = (const BinaryLink*)(bn + h->nNodes);
+ const char         *text = (const char*)(bl + h->nLinks);
+ if (memcmp(h->magic, BINARY_MAGIC, 4) || h->version != BINARY_VERSION
+  || h->nNodes > MAXNODES || h->nLinks > MAXLINKS
+  || sizeof(BinaryHeader) + (size_t)h->nNodes*sizeof(BinaryNode) + (size_t)h->nLinks*sizeof(BinaryLink) + h->textBytes != ld->size) return 0;
+ ld->focus = h->focus;
+ for (uint32_t i=0; i<h->nNodes; i++) {
+  if (bn[i].textLength && !((uint64_t)bn[i].textOffset + bn[i].textLength < h->textBytes
+                         && text[bn[i].textOffset + bn[i].textLength] == '\0'
+                         && memchr(&text[bn[i].textOffset], '\0', bn[i].textLength) == NULL)) return 0;
+  LoadedNode *ln = &loadedNodes[i];
+  ln->x = bn[i].x;  ln->y = bn[i].y;
+  ln->r = bn[i].r;  ln->g = bn[i].g;  ln->b = bn[i].b;  ln->flags = bn[i].flags;
+  ln->present = ln->placed = 1;
+  ln->text = bn[i].textLength ? &text[bn[i].textOffset] : NULL;
+  ln->textLength = bn[i].textLength;
+  if ((i+1) % LOAD_CHUNK == 0) { publish(&ld->nNodes, i+1); if (ld->cancel) return 0; }
+ }
+ publish(&ld->nNodes, h->nNodes);
+ for (uint32_t i=0; i<h->nLinks; i++) {
+  if (!(bl[i].from >= 0 && bl[i].to >= 0 && bl[i].from < (int32_t)h->nNodes && bl[i].to < (int32_t)h->nNodes)) return 0;
+  loadedLinks[i].from = bl[i].from;
+  loadedLinks[i].to   = bl[i].to;
+  if ((i+1) % LOAD_CHUNK == 0) { publish(&ld->nLinks, i+1); if (ld->cancel) return 0; }
+ }
+ publish(&ld->nLinks, h->nLinks);
+ return 1;
+}
+
+typedef struct { // text file tokenizer: the whole file is in memory, and we walk through it with a pointer
+ const char *p, *start, *end;
+ const char *filename;
+ const char *error; // first problem found, if any
+} Tokenizer;
+
+int tk_fail(Tokenizer *tk, const char *what) {
+ if (!tk->error) {
+  tk->error = what;
+  int line = 1;
+  for (const char *q = tk->start; q < tk->p && q < tk->end; q++) line += (*q=='\n');
+  fprintf(stderr, "%s:%d: %s\n", tk->filename, line, what);
+ }
+ return 0;
+}
+
+void tk_space(Tokenizer *tk) { // skips whitespace, like a ' ' or '\n' in a scanf() format
+ while (tk->p < tk->end && isspace((unsigned char)*tk->p)) tk->p++;
+}
+
+int tk_literal(Tokenizer *tk, const char *lit) { // returns 1 and moves past it, if the text is next; otherwise returns 0 and doesn't move
+ size_t len = strlen(lit);
+ if ((size_t)(tk->end - tk->p) < len || memcmp(tk->p, lit, len)) return 0;
+ tk->p += len;
+ return 1;
+}
+
+int tk_expect(Tokenizer *tk, const char *lit) {
+ if (tk_literal(tk, lit)) return 1;
+ static char msg[64];
+ snprintf(msg, sizeof(msg), "expected '%s'", lit);
+ return tk_fail(tk, msg);
+}
+
+int tk_int(Tokenizer *tk, int *value) {
+ const char *p = tk->p;
+ int neg = 0;
+ if (p < tk->end && (*p=='-' || *p=='+')) neg = (*p++ == '-');
+ if (p >= tk->end || !isdigit((unsigned char)*p)) return tk_fail(tk, "expected a number");
+ long long v = 0;
+ while (p < tk->end && isdigit((unsigned char)*p)) {
+  v = v*10 + (*p++ - '0');
+  if (v > INT32_MAX) return tk_fail(tk, "number too big");
+ }
+ *value = neg ? -v : v;
+ tk->p = p;
+ return 1;
+}
+
+int tk_hex2(Tokenizer *tk, unsigned char *value) {
+ int v = 0;
+ for (int i=0; i<2; i++, tk->p++) {
+  if (tk->p >= tk->end || !isxdigit((unsigned char)*tk->p)) return tk_fail(tk, "expected a hex color, like c=FF8000");
+  int c = *tk->p;
+  v = v*16 + (isdigit(c) ? c-'0' : toupper(c)-'A'+10);
+ }
+ *value = v;
+ return 1;
+}
+
+const char *tk_quoted(Tokenizer *tk, unsigned *length) { // finds the rest of a quoted string (after the opening quote), and moves past it. Returns where it starts, still escaped - see unescapeText()
+ const char *q = tk->p;
+ while (q < tk->end && *q != '\"') q += (*q=='\\' && q+1 < tk->end) ? 2 : 1; // find the closing quote
+ if (q >= tk->end) { tk_fail(tk, "unterminated text (missing \")"); return NULL; }
+ if (q - tk->p > UINT32_MAX) { tk_fail(tk, "text too long"); return NULL; }
+ const char *str = tk->p;
+ *length = q - tk->p;
+ tk->p = q+1;
+ return str;
+}
+
+int tk_end_of_line(Tokenizer *tk) { // only whitespace is allowed after the last field on a line
+ while (tk->p < tk->end && *tk->p != '\n') {
+  if (!isspace((unsigned char)*tk->p)) return tk_fail(tk, "unexpected text at end of line");
+  tk->p++;
+ }
+ return 1;
+}
+
+int parseTextFile(Loader *ld) { // (loader thread) nodes get published once there are no gaps in the numbering before them; connections right away (by then, all the nodes are known)
+ Tokenizer tk = {ld->map, ld->map, ld->map+ld->size, ld->filename, NULL};
+ LoadedNode *ln = loadedNodes;
+ int nn=0, nl=0, f=0, ready=0;
+ // header
+ if (tk_expect(&tk,"view:")) { tk_space(&tk);
+ if (tk_expect(&tk,"f=") && tk_int(&tk,&f)) { tk_space(&tk);
+ if (tk_expect(&tk,"nodes:")) tk_space(&tk); }}
+ ld->focus = f;
+ // nodes
+ while (!tk.error && !tk_literal(&tk,"connections:")) {
+  int id;
+  if (!tk_expect(&tk,"i=") || !tk_int(&tk,&id)) break;
+  if (id < 0 || id >= MAXNODES) { tk_fail(&tk, "node number out of range"); break; }
+  if (id < nn && ln[id].present) { tk_fail(&tk, "duplicate node number"); break; }
+  while (nn <= id) memset(&ln[nn++], 0, sizeof(LoadedNode)); // any gaps in the numbering become blank nodes
+  tk_space(&tk);
+  if (!tk_expect(&tk,"c=") || !tk_hex2(&tk,&ln[id].r) || !tk_hex2(&tk,&ln[id].g) || !tk_hex2(&tk,&ln[id].b)) break;
+  tk_space(&tk);
+  if (!tk_expect(&tk,"t=\"")) break;
+  ln[id].present = 1;
+  ln[id].text = tk_quoted(&tk, &ln[id].textLength);
+  if (!ln[id].text || !tk_end_of_line(&tk)) break;
+  tk_space(&tk);
+  if (id == ready) {
+   while (ready < nn && ln[ready].present) ready++;
+   if (ready - ld->nNodes >= LOAD_CHUNK) { publish(&ld->nNodes, ready); if (ld->cancel) return 0; }
+  }
+ }
+ if (tk.error) { publish(&ld->nNodes, ready); return 0; }
+ publish(&ld->nNodes, nn);
+ // connections
+ tk_space(&tk);
+ while (!tk.error && tk.p < tk.end) {
+  int a, b;
+  if (!tk_expect(&tk,"a=") || !tk_int(&tk,&a)) break;
+  tk_space(&tk);
+  if (!tk_expect(&tk,"b=") || !tk_int(&tk,&b)) break;
+  if (a < 0 || b < 0 || a >= nn || b >= nn) { tk_fail(&tk, "connection to a node that doesn't exist"); break; }
+  if (a == b) { tk_fail(&tk, "node connected to itself"); break; }
+  if (nl >= MAXLINKS) { tk_fail(&tk, "too many connections"); break; }
+  loadedLinks[nl].from = a; loadedLinks[nl].to = b; nl++;
+  if (!tk_end_of_line(&tk)) break;
+  tk_space(&tk);
+  if (nl % LOAD_CHUNK == 0) { publish(&ld->nLinks, nl); if (ld->cancel) return 0; }
+ }
+ if (!tk.error && nn == 0) tk_fail(&tk, "no nodes");
+ publish(&ld->nLinks, nl);
+ return !tk.error;
+}
+
+int importFormat(const char *filename);
+int importGraph(const char *from, const char *to, int binary);
+
+void *loadInBackground(void *ptr) { // pthread
+ Loader *ld = ptr;
+ const char *fn = ld->filename;
+ char tmp[] = "/tmp/tangent-import-XXXXXX";
+ int imported = 0, ok = 0;
+ if (importFormat(fn)) { // from another program's format: it gets imported into a temp file, which is then loaded like any other
+  int fd = mkstemp(tmp);
+  if (fd < 0) { perror(tmp); fn = NULL; }
+  else { close(fd); imported = 1; fn = importGraph(ld->filename, tmp, 1) ? tmp : NULL; }
+ }
+ if (fn && (ld->map = mapFile(fn, &ld->size))) {
+  ld->escaped = !(ld->size >= 4 && !memcmp(ld->map, BINARY_MAGIC, 4));
+  ok = ld->escaped ? parseTextFile(ld) : parseBinaryFile(ld);
+ }
+ if (imported) unlink(tmp); // (the text stays readable, because it's mapped)
+ __sync_synchronize();
+ ld->status = ok ? LOAD_DONE : LOAD_FAILED;
+ return NULL;
+}
+
+void addRootNode() { // for when there's no graph at all
+ memset(&nodes[0], 0, sizeof(Node));
+ nodes[0].size = 0.04f;
+ nodes[0].r = nodes[0].g = nodes[0].b = 255;
+ nNodes = 1;
+ focus = 0;
+}
+
+void replaceGraph() { // (main thread) the first of the new nodes are ready: out with the old graph
+ if (loader.opening) {
+  collabDisconnect("Left the shared graph"); // (you opened another one)
+  journalDiscardUnsaved(); // if the previous graph had unsaved changes, the user chose not to save them
+  journalStop();
+  snprintf(filename, sizeof(filename), "%s", importFormat(loader.filename) ? "" : loader.filename); // (imported from another program's format: it's a new, untitled graph)
+ }
+ clearGraph();
+ setTextSource(loader.map, loader.size, loader.escaped);
+ isModified = 0;
+ mark = toDrag = -1;
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) if (editSessions[i].node >= 0) endEditSession(&editSessions[i]);
+ undoClear();
+ focus = 0; // (until the file's focus node is in)
+ set_window_title(loader.filename);
+ loader.started = 1;
+}
+
+void placeLoadedNode(int id, float x, float y) {
+ nodes[id].x = x;
+ nodes[id].y = y;
+ loadedNodes[id].placed = 1;
+}
+
+void moveLoadedNode(int id) { // from loadedNodes[] into the graph
+ const LoadedNode *ln = &loadedNodes[id];
+ Node *n = &nodes[id];
+ n->x = ln->x;  n->y = ln->y;
+ n->dx = n->dy = n->size = n->falloff = 0.f;
+ n->r = ln->present ? ln->r : 255;
+ n->g = ln->present ? ln->g : 255;
+ n->b = ln->present ? ln->b : 255;
+ n->flags = ln->flags; // TODO: decide how to fit 'flags' into the text file format. probably f=XX, with 'XX' being hex digits. Also, don't forget to add 'isModified=1' to the 'M' keystroke afterwards.
+ n->lazyText   = ln->present && ln->textLength ? ln->text : NULL;
+ n->lazyLength = ln->present ? ln->textLength : 0;
+ n->text = NULL;
+ n->nTextLevels = 0;
+ memset(&n->cl, 0, sizeof(n->cl));
+ if (id == loader.focus) {
+  if (focus == 0) focus = id; // (unless the user has already picked another node)
+  if (!ln->placed) placeLoadedNode(id, 0.f, 0.f);
+  if (focus == id) { viewX = n->x;  viewY = n->y; } // (rather than panning all the way over from wherever the last graph was)
+ } else if (!ln->placed) { n->x = PARK_DISTANCE; n->y = 0.f; }
+}
+
+float jitter(unsigned i) { // a repeatable random-looking number from -1 to 1, that depends only on i (so the layout doesn't depend on how the loading got split up into frames)
+ i *= 2654435761u;  i ^= i >> 15;
+ i *= 2246822519u;  i ^= i >> 13;
+ return (int)i * (1.f/2147483648.f);
+}
+
+void placeNear(int id, int near) { // one step further out from the center than 'near' (roughly), so the graph grows outward
+ float dx = nodes[near].x + 0.2f*jitter(2*id);
+ float dy = nodes[near].y + 0.2f*jitter(2*id+1);
+ float s = 0.3f / sqrtf(dx*dx + dy*dy + 1e-6f);
+ placeLoadedNode(id, nodes[near].x + s*dx, nodes[near].y + s*dy);
+}
+
+void moveLoadedLink(int i) {
+ Link l = links[i] = loadedLinks[i];
+ if ( loadedNodes[l.from].placed && !loadedNodes[l.to].placed) placeNear(l.to, l.from);
+ if (!loadedNodes[l.from].placed &&  loadedNodes[l.to].placed) placeNear(l.from, l.to);
+}
+
+void finishLoading(int status) {
+ if (!loader.joined) pthread_join(loaderThread, NULL);
+ loading = 0;
+ if (!loader.started) { // the file was no good, so nothing changed
+  if (loader.map) munmap((void*)loader.map, loader.size);
+  if (loader.opening) {
+   printf("Invalid file %s\n", loader.filename);
+   message_printf("Invalid file '%s' - did not load", loader.filename);
+  }
+  return;
+ }
+ for (int i=0; i<nNodes; i++) if (!loadedNodes[i].placed) { nodes[i].x = RND(); nodes[i].y = RND(); } // never got connected to a placed node
+ adoptTextSource(loader.map, loader.size, loader.escaped);
+ if (nNodes < 1) addRootNode();
+ undoClear(); // (the root node, or the journal's edits, aren't something to undo)
+ if (!loader.opening) return;
+ if (status == LOAD_DONE) {
+  printf("Opened file %s\n", loader.filename);
+  message_printf("Opened file: %s", loader.filename);
+  if (!filename[0]) isModified = 1; // imported
+  else {
+   uint64_t journalLength = journalReplay(filename); // (journalReplay() doesn't record anything to undo)
+   if (!readOnly) journalStart(filename, journalLength);
+  }
+ } else { // it went bad partway through (or got cancelled). Keep what's there, but as an untitled graph, so it can't get saved over the file
+  printf("Invalid file %s\n", loader.filename);
+  message_printf("Invalid file '%s' - only part of it loaded", loader.filename);
+  filename[0] = 0;
+  isModified = 1;
+ }
+}
+
+int continueLoading(int wait) { // call this every frame while 'loading'. Moves what the loader thread has published into the graph. wait: boolean: block until the whole file is in. Returns LOAD_RUNNING, or how it ended
+ if (!loading) return LOAD_DONE;
+ if (wait && !loader.joined) { pthread_join(loaderThread, NULL); loader.joined = 1; }
+ int status = loader.status;
+ __sync_synchronize();
+ int nl = loader.nLinks; // (before nNodes: once there are connections, all the nodes are there)
+ __sync_synchronize();
+ int nn = loader.nNodes;
+ __sync_synchronize();
+ if (!loader.started && (status == LOAD_DONE || (status == LOAD_RUNNING && nn > 0))) replaceGraph(); // (if it turns out bad before the graph got replaced, it doesn't get replaced)
+ if (loader.started) {
+  int budget = wait ? MAXNODES+MAXLINKS : LOAD_FRAME_BUDGET;
+  for (; nNodes < nn && budget > 0; budget--) moveLoadedNode(nNodes++);
+  if (nNodes == nn) for (; nLinks < nl && budget > 0; budget--) moveLoadedLink(nLinks++);
+ }
+ if (status == LOAD_RUNNING || (loader.started && (nNodes < nn || nLinks < nl))) return LOAD_RUNNING;
+ finishLoading(status);
+ return status;
+}
+
+int startLoading(const char *fn, int opening) { // starts loading the file on another thread. See continueLoading(). Returns 0 if it couldn't even start
+ if (loading) { loader.cancel = 1; continueLoading(1); }
+ memset(&loader, 0, sizeof(loader));
+ snprintf(loader.filename, sizeof(loader.filename), "%s", fn);
+ loader.opening = opening;
+ loader.focus = -1;
+ if (pthread_create(&loaderThread, NULL, loadInBackground, &loader)) return 0;
+ loading = 1;
+ return 1;
+}
+
+int loadFile(const char *filename) { // (synchronous - for command-line modes) a bad file doesn't replace the current graph
+ return startLoading(filename, 0) && continueLoading(1) == LOAD_DONE;
+}
+
+int openGraph(const char *fn) { // starts loading the file for the user. When it's all in, continueLoading() replays its journal & sets 'filename'. Returns 0 if it couldn't even start
+ finishSave(1); // (the previous graph's save has to finish first, because it affects the journal)
+ if (!startLoading(fn, 1)) return 0;
+ message_printf("Loading %s...", fn);
+ return 1;
+}
+
+
+
+
+
+//////////////////////////////////////////////////////
+// IMPORTING graphs made by other programs: edge lists (.tsv .csv), Graphviz (.dot .gv), GraphML (.graphml)
+// Everything is streamed. The only things kept in memory are the node IDs & labels, in a hash table. The connections get spooled to a temp file until all the nodes are known, then everything is written out as a Tangent file.
+
+double secondsNow();
+
+enum { IMPORT_NONE, IMPORT_TSV, IMPORT_CSV, IMPORT_DOT, IMPORT_GRAPHML };
+
+int importFormat(const char *filename) { // judging by the file extension. IMPORT_NONE means it's (supposedly) a Tangent file
+ const char *ext = strrchr(filename, '.');
+ if (!ext || strchr(ext, '/')) return IMPORT_NONE;
+ if (!strcasecmp(ext,".tsv") || !strcasecmp(ext,".tab") || !strcasecmp(ext,".edges")) return IMPORT_TSV;
+ if (!strcasecmp(ext,".csv"))                                                         return IMPORT_CSV;
+ if (!strcasecmp(ext,".dot") || !strcasecmp(ext,".gv"))                               return IMPORT_DOT;
+ if (!strcasecmp(ext,".graphml"))                                                     return IMPORT_GRAPHML;
+ return IMPORT_NONE;
+}
+
+typedef struct { // input, read in big chunks
+ int fd;
+ char *buf;
+ size_t pos, len, max;   // buf[pos..len) hasn't been used yet
+ int eof, error;
+ long line;              // for error messages
+} InBuffer;
+
+int ib_open(InBuffer *ib, const char *filename) {
+ memset(ib, 0, sizeof(InBuffer));
+ ib->line = 1;
+ ib->fd = open(filename, O_RDONLY);
+ if (ib->fd < 0) { perror(filename); return 0; }
+ posix_fadvise(ib->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+ ib->max = 1<<20;
+ if (!(ib->buf = malloc(ib->max))) { close(ib->fd); return 0; }
+ return 1;
+}
+
+void ib_close(InBuffer *ib) {
+ close(ib->fd);
+ free(ib->buf);
+}
+
+int ib_fill(InBuffer *ib) { // reads more, keeping whatever hasn't been used yet. Returns 0 at the end of the file
+ if (ib->eof) return 0;
+ if (ib->pos) { memmove(ib->buf, ib->buf+ib->pos, ib->len-ib->pos); ib->len -= ib->pos; ib->pos = 0; }
+ if (ib->len == ib->max) { // a single line (or token) is bigger than the buffer
+  char *p = realloc(ib->buf, ib->max*2);
+  if (!p) { ib->eof = ib->error = 1; return 0; }
+  ib->buf = p;
+  ib->max *= 2;
+ }
+ ssize_t n;
+ do n = read(ib->fd, ib->buf+ib->len, ib->max-ib->len); while (n < 0 && errno == EINTR);
+ if (n <= 0) { ib->eof = 1; ib->error = n < 0; return 0; }
+ ib->len += n;
+ return 1;
+}
+
+static inline int ib_peek(InBuffer *ib) { // next char, or -1 at the end
+ if (ib->pos == ib->len && !ib_fill(ib)) return -1;
+ return (unsigned char)ib->buf[ib->pos];
+}
+
+static inline int ib_get(InBuffer *ib) {
+ if (ib->pos == ib->len && !ib_fill(ib)) return -1;
+ char c = ib->buf[ib->pos++];
+ ib->line += (c=='\n');
+ return (unsigned char)c;
+}
+
+char *ib_line(InBuffer *ib, size_t *length) { // the next line, without the line ending. Returns NULL at the end of the file. (It's only valid until the next call)
+ size_t scanned = 0;
+ while (1) {
+  char *start = ib->buf + ib->pos;
+  char *nl = memchr(start+scanned, '\n', ib->len - ib->pos - scanned);
+  if (!nl) {
+   scanned = ib->len - ib->pos;
+   if (ib_fill(ib)) continue;
+   if (ib->pos == ib->len) return NULL;
+   start = ib->buf + ib->pos;
+   nl = ib->buf + ib->len; // last line, with no newline at the end
+  }
+  ib->pos = nl - ib->buf + (nl < ib->buf + ib->len);
+  ib->line++;
+  *length = nl - start;
+  if (*length && start[*length-1]=='\r') (*length)--;
+  return start;
+ }
+}
+
+typedef struct { char *p; size_t n, max; } TextBuffer; // growable
+
+int tb_add(TextBuffer *tb, const char *p, size_t n) {
+ if (tb->n + n + 1 > tb->max) {
+  size_t newMax = tb->max ? tb->max : 256;
+  while (tb->n + n + 1 > newMax) newMax *= 2;
+  char *q = realloc(tb->p, newMax);
+  if (!q) return 0;
+  tb->p = q;
+  tb->max = newMax;
+ }
+ memcpy(tb->p + tb->n, p, n);
+ tb->n += n;
+ tb->p[tb->n] = '\0';
+ return 1;
+}
+
+typedef struct {
+ uint64_t id, label;              // offsets into the arena
+ uint32_t idLength, labelLength;  // labelLength 0 means the label is the ID
+ unsigned char r,g,b;
+} ImportNode;
+
+typedef struct {
+ const char *filename;
+ ImportNode *nodes;    uint32_t nNodes, maxNodes;
+ uint64_t   *table;    uint32_t tableSize;    // hash table, by ID: the top 32 bits of the hash, then node number+1. (0 = empty slot). Size is a power of 2
+ char       *arena;    size_t arenaLength, arenaMax;
+ FILE       *spool;    uint64_t nLinks, nSelfLinks; // connections, as pairs of int32_t
+ int failed;
+} Importer;
+
+int imp_fail(Importer *im, InBuffer *ib, const char *what) {
+ if (!im->failed) fprintf(stderr, "%s:%ld: %s\n", im->filename, ib ? ib->line : 0, what);
+ im->failed = 1;
+ return 0;
+}
+
+uint64_t hashBytes(const char *p, size_t n) { // FNV-1a, with a final mix so all the bits are good
+ uint64_t h = 14695981039346656037ull;
+ for (size_t i=0; i<n; i++) h = (h ^ (unsigned char)p[i]) * 1099511628211ull;
+ h ^= h >> 33;  h *= 0xff51afd7ed558ccdull;  h ^= h >> 33;
+ return h;
+}
+
+uint64_t imp_store(Importer *im, const char *p, size_t n) { // copies a string into the arena, and returns where
+ if (im->arenaLength + n > im->arenaMax) {
+  size_t newMax = im->arenaMax;
+  while (im->arenaLength + n > newMax) newMax *= 2;
+  char *a = realloc(im->arena, newMax);
+  if (!a) { imp_fail(im, NULL, "out of memory"); return 0; }
+  im->arena = a;
+  im->arenaMax = newMax;
+ }
+ memcpy(im->arena + im->arenaLength, p, n);
+ im->arenaLength += n;
+ return im->arenaLength - n;
+}
+
+int imp_grow_table(Importer *im) {
+ uint32_t size = im->tableSize*2;
+ uint64_t *t = calloc(size, sizeof(uint64_t));
+ if (!t) return imp_fail(im, NULL, "out of memory");
+ for (uint32_t i=0; i<im->nNodes; i++) {
+  uint64_t h = hashBytes(im->arena + im->nodes[i].id, im->nodes[i].idLength);
+  uint32_t slot = h & (size-1);
+  while (t[slot]) slot = (slot+1) & (size-1);
+  t[slot] = (h & 0xFFFFFFFF00000000ull) | (i+1);
+ }
+ free(im->table);
+ im->table = t;
+ im->tableSize = size;
+ return 1;
+}
+
+int64_t imp_node_hashed(Importer *im, const char *id, size_t n, uint64_t h) { // finds or adds the node with this ID. Returns its number, or -1 on failure
+ if (n > UINT32_MAX) { imp_fail(im, NULL, "node ID too long"); return -1; }
+ uint64_t tag = h & 0xFFFFFFFF00000000ull;
+ uint32_t slot = h & (im->tableSize-1);
+ for (; im->table[slot]; slot = (slot+1) & (im->tableSize-1)) {
+  if ((im->table[slot] & 0xFFFFFFFF00000000ull) != tag) continue; // (checking the hash first saves looking at the node, which is probably not in the cache)
+  uint32_t i = (im->table[slot] & 0xFFFFFFFF) - 1;
+  if (im->nodes[i].idLength == n && !memcmp(im->arena + im->nodes[i].id, id, n)) return i;
+ }
+ if (im->nNodes == UINT32_MAX-1) { imp_fail(im, NULL, "too many nodes"); return -1; }
+ if (im->nNodes == im->maxNodes) {
+  ImportNode *p = realloc(im->nodes, im->maxNodes*2*sizeof(ImportNode));
+  if (!p) { imp_fail(im, NULL, "out of memory"); return -1; }
+  im->nodes = p;
+  im->maxNodes *= 2;
+ }
+ ImportNode *in = &im->nodes[im->nNodes];
+ memset(in, 0, sizeof(ImportNode));
+ in->r = in->g = in->b = 255;
+ in->id = imp_store(im, id, n);
+ in->idLength = n;
+ if (im->failed) return -1;
+ im->table[slot] = tag | ++im->nNodes;
+ if (im->nNodes*2 > im->tableSize && !imp_grow_table(im)) return -1; // keep it at most half full
+ return im->nNodes-1;
+}
+
+int64_t imp_node(Importer *im, const char *id, size_t n) {
+ return imp_node_hashed(im, id, n, hashBytes(id, n));
+}
+
+void imp_link(Importer *im, int64_t from, int64_t to) {
+ if (from < 0 || to < 0) return;
+ if (from == to) { im->nSelfLinks++; return; } // Tangent doesn't do those
+ int32_t pair[2] = {from, to};
+ if (fwrite(pair, sizeof(pair), 1, im->spool) != 1) imp_fail(im, NULL, "couldn't write temp file");
+ im->nLinks++;
+}
+
+void imp_label(Importer *im, int64_t node, const char *text, size_t n) {
+ if (node < 0 || !n || n > UINT32_MAX) return;
+ im->nodes[node].label = imp_store(im, text, n);
+ im->nodes[node].labelLength = n;
+}
+
+int hexDigit(int c) { return isdigit(c) ? c-'0' : isxdigit(c) ? toupper(c)-'A'+10 : -1; }
+
+void imp_color(Importer *im, int64_t node, const char *spec, size_t n) { // only "#RRGGBB" (and "#RRGGBBAA") for now
+ if (node < 0 || (n != 7 && n != 9) || spec[0] != '#') return;
+ int v[6];
+ for (int i=0; i<6; i++) if ((v[i] = hexDigit((unsigned char)spec[i+1])) < 0) return;
+ im->nodes[node].r = v[0]*16 + v[1];
+ im->nodes[node].g = v[2]*16 + v[3];
+ im->nodes[node].b = v[4]*16 + v[5];
+}
+
+
+
+// Edge lists: one connection per line, "from<tab>to" (or comma-separated for .csv). Anything after the second column is ignored. A line with only one column is a node with no connections.
+// Lines starting with # or % are comments, and a header line like "source,target" is skipped.
+typedef struct { char *p; size_t n; } Field;
+
+int splitFields(char *line, size_t len, int csv, Field *f, int maxFields) { // splits in place (CSV quotes get removed). Returns the number of fields
+ char *p = line, *end = line+len;
+ int tabs = !csv && memchr(line, '\t', len) != NULL; // TSV without any tabs: split on spaces instead
+ int n = 0;
+ while (p <= end && n < maxFields) {
+  if (!csv && !tabs) { while (p < end && (*p==' ' || *p=='\t')) p++; if (p == end) break; }
+  if (csv) while (p < end && *p==' ') p++;
+  char *start = p;
+  if (csv && p < end && *p=='\"') { // quoted: "" is a quote. (Newlines inside quotes aren't supported)
+   char *o = start;
+   for (p++; p < end; p++) {
+    if (*p=='\"') { if (p+1 < end && p[1]=='\"') p++; else { p++; break; } }
+    *o++ = *p;
+   }
+   f[n].p = start; f[n].n = o-start;
+   while (p < end && *p != ',') p++;
+  } else {
+   char *q = p;
+   char sep = csv ? ',' : tabs ? '\t' : ' ';
+   while (q < end && *q != sep) q++;
+   f[n].p = start; f[n].n = q-start;
+   if (csv) while (f[n].n && start[f[n].n-1]==' ') f[n].n--;
+   p = q;
+  }
+  n++;
+  p++; // past the separator
+ }
+ return n;
+}
+
+int isHeaderWord(const Field *f) {
+ const char *words[] = {"source","target","from","to","src","dst","node","node1","node2","id1","id2",NULL};
+ for (int i=0; words[i]; i++) if (f->n == strlen(words[i]) && !strncasecmp(f->p, words[i], f->n)) return 1;
+ return 0;
+}
+
+#define EDGE_BATCH 64
+typedef struct { // lines waiting to be looked up (see flushEdges)
+ TextBuffer ids;
+ struct { size_t at[2]; uint32_t length[2]; uint64_t hash[2]; int n; } e[EDGE_BATCH];
+ int count;
+} EdgeBatch;
+
+void flushEdges(Importer *im, EdgeBatch *b) { // Looking up millions of random IDs is limited by memory latency, not the CPU. So first prefetch what all the lookups in the batch will need (so the cache misses overlap), then do them
+ #define EACH_ID for (int i=0; i<b->count; i++) for (int j=0; j<b->e[i].n; j++)
+ #define ENTRY im->table[b->e[i].hash[j] & (im->tableSize-1)]
+ EACH_ID { b->e[i].hash[j] = hashBytes(b->ids.p + b->e[i].at[j], b->e[i].length[j]); __builtin_prefetch(&ENTRY); }
+ EACH_ID if (ENTRY) __builtin_prefetch(&im->nodes[(ENTRY & 0xFFFFFFFF)-1]);
+ EACH_ID if (ENTRY) __builtin_prefetch(im->arena + im->nodes[(ENTRY & 0xFFFFFFFF)-1].id);
+ for (int i=0; i<b->count; i++) { // (for real this time - the table may change as nodes get added)
+  int64_t a = imp_node_hashed(im, b->ids.p + b->e[i].at[0], b->e[i].length[0], b->e[i].hash[0]);
+  if (b->e[i].n == 2) imp_link(im, a, imp_node_hashed(im, b->ids.p + b->e[i].at[1], b->e[i].length[1], b->e[i].hash[1]));
+ }
+ #undef EACH_ID
+ #undef ENTRY
+ b->count = 0;
+ b->ids.n = 0;
+}
+
+int importEdgeList(Importer *im, InBuffer *ib, int csv) {
+ char *line;
+ size_t len;
+ int first = 1;
+ EdgeBatch *b = calloc(1, sizeof(EdgeBatch));
+ if (!b) return imp_fail(im, ib, "out of memory");
+ while ((line = ib_line(ib, &len)) && !im->failed) {
+  if (!len || line[0]=='#' || line[0]=='%') continue;
+  Field f[2];
+  int n = splitFields(line, len, csv, f, 2);
+  if (first && n==2 && isHeaderWord(&f[0]) && isHeaderWord(&f[1])) { first = 0; continue; }
+  first = 0;
+  if (n < 1 || !f[0].n) continue;
+  if (n < 2 || !f[1].n) n = 1;
+  if (f[0].n > UINT32_MAX || f[n-1].n > UINT32_MAX) { imp_fail(im, ib, "node ID too long"); break; }
+  for (int j=0; j<n; j++) { // (the line won't be there after the next ib_line(), so copy the IDs)
+   b->e[b->count].at[j] = b->ids.n;
+   b->e[b->count].length[j] = f[j].n;
+   if (!tb_add(&b->ids, f[j].p, f[j].n)) { imp_fail(im, ib, "out of memory"); break; }
+  }
+  b->e[b->count++].n = n;
+  if (b->count == EDGE_BATCH) flushEdges(im, b);
+ }
+ if (!im->failed) flushEdges(im, b);
+ free(b->ids.p);
+ free(b);
+ return !im->failed;
+}
+
+
+
+// Graphviz DOT. Supports node & edge statements (including chains like a -> b -> c, and {subgraphs} as endpoints), with 'label' and 'color'/'fillcolor' node attributes. Other attributes are ignored
+enum { DOT_EOF = -1, DOT_ID = 256 };
+typedef struct {
+ Importer *im;
+ InBuffer *ib;
+ int type;              // DOT_EOF, DOT_ID, or a punctuation char: { } [ ] ; , = :   ('>' means "->" and '-' means "--")
+ int quoted;            // boolean: was the ID in quotes (so it's never a keyword)
+ char *tok;  size_t tokLength, tokMax;
+ char *prev; size_t prevLength, prevMax; // the token before, when we need to look ahead
+} DotParser;
+
+typedef struct { uint32_t *nodes; size_t n, max; } NodeSet;
+
+void nodeSetAdd(NodeSet *s, int64_t node) {
+ if (node < 0) return;
+ if (s->n == s->max) {
+  size_t newMax = s->max ? s->max*2 : 16;
+  uint32_t *p = realloc(s->nodes, newMax*sizeof(uint32_t));
+  if (!p) return; // (just loses some connections)
+  s->nodes = p;
+  s->max = newMax;
+ }
+ s->nodes[s->n++] = node;
+}
+
+void dot_char(DotParser *dp, int c) {
+ if (dp->tokLength+1 >= dp->tokMax) {
+  size_t newMax = dp->tokMax ? dp->tokMax*2 : 256;
+  char *p = realloc(dp->tok, newMax);
+  if (!p) { imp_fail(dp->im, dp->ib, "out of memory"); return; }
+  dp->tok = p;
+  dp->tokMax = newMax;
+ }
+ dp->tok[dp->tokLength++] = c;
+ dp->tok[dp->tokLength] = '\0';
+}
+
+int dot_id_char(int c) { return isalnum(c) || c=='_' || c=='.' || c >= 128; }
+
+void dot_next(DotParser *dp) { // reads the next token
+ InBuffer *ib = dp->ib;
+ char *t = dp->prev; dp->prev = dp->tok; dp->tok = t; // (keep the current one, as 'prev')
+ size_t m = dp->prevMax; dp->prevMax = dp->tokMax; dp->tokMax = m;
+ dp->prevLength = dp->tokLength;
+ int c;
+ dp->tokLength = 0;
+ dp->quoted = 0;
+ if (dp->tok) dp->tok[0] = '\0';
+ while (1) { // skip whitespace & comments
+  c = ib_get(ib);
+  if (c == '#') { while ((c = ib_get(ib)) >= 0 && c != '\n'); continue; } // (preprocessor output lines)
+  if (c == '/' && ib_peek(ib) == '/') { while ((c = ib_get(ib)) >= 0 && c != '\n'); continue; }
+  if (c == '/' && ib_peek(ib) == '*') { ib_get(ib); int prev = 0; while ((c = ib_get(ib)) >= 0 && !(prev=='*' && c=='/')) prev = c; continue; }
+  if (c < 0 || !isspace(c)) break;
+ }
+ if (c < 0) { dp->type = DOT_EOF; return; }
+ dp->type = DOT_ID;
+ if (c == '\"') { // quoted string. \" is a quote, backslash-newline is nothing, and any other backslash stays (for labels to deal with)
+  dp->quoted = 1;
+  while ((c = ib_get(ib)) >= 0 && c != '\"') {
+   if (c == '\\') {
+    int d = ib_peek(ib);
+    if (d == '\"') { dot_char(dp, ib_get(ib)); continue; }
+    if (d == '\n') { ib_get(ib); continue; }
+   }
+   dot_char(dp, c);
+  }
+  if (c < 0) imp_fail(dp->im, ib, "unterminated string (missing \")");
+ } else if (c == '<') { // HTML string: <...> with nested <>
+  dp->quoted = 1;
+  for (int depth = 1; (c = ib_get(ib)) >= 0; ) {
+   depth += (c=='<') - (c=='>');
+   if (!depth) break;
+   dot_char(dp, c);
+  }
+ } else if (c == '-' && (ib_peek(ib) == '>' || ib_peek(ib) == '-')) {
+  dp->type = ib_get(ib);
+ } else if (dot_id_char(c) || c == '-') {
+  dot_char(dp, c);
+  while (dot_id_char(ib_peek(ib))) dot_char(dp, ib_get(ib));
+ } else if (strchr("{}[];,=:", c)) {
+  dp->type = c;
+ } else {
+  imp_fail(dp->im, ib, "unexpected character");
+  dp->type = DOT_EOF;
+ }
+}
+
+int dot_keyword(DotParser *dp, const char *word) {
+ return dp->type == DOT_ID && !dp->quoted && !strcasecmp(dp->tok, word);
+}
+
+void dot_label(Importer *im, int64_t node, char *text, size_t n) { // label escapes: \n \l \r are line breaks, \\ is a backslash
+ char *o = text;
+ for (size_t i=0; i<n; i++) {
+  if (text[i]=='\\' && i+1 < n) {
+   char c = text[++i];
+   *o++ = (c=='n' || c=='l' || c=='r') ? '\n' : c;
+  } else *o++ = text[i];
+ }
+ while (o > text && o[-1]=='\n') o--; // (\l at the end is common)
+ imp_label(im, node, text, o-text);
+}
+
+void dot_attributes(DotParser *dp, int64_t node) { // [a=b, c=d][...]. Applies them to 'node', if it's >= 0
+ while (dp->type == '[' && !dp->im->failed) {
+  dot_next(dp);
+  while (dp->type != ']' && dp->type != DOT_EOF && !dp->im->failed) {
+   if (dp->type != DOT_ID) { imp_fail(dp->im, dp->ib, "expected an attribute name"); return; }
+   char key[16];
+   snprintf(key, sizeof(key), "%s", dp->tok);
+   dot_next(dp);
+   if (dp->type == '=') {
+    dot_next(dp);
+    if (dp->type != DOT_ID) { imp_fail(dp->im, dp->ib, "expected an attribute value"); return; }
+    if (!strcmp(key, "label")) dot_label(dp->im, node, dp->tok, dp->tokLength);
+    else if (!strcmp(key, "color") || !strcmp(key, "fillcolor")) imp_color(dp->im, node, dp->tok, dp->tokLength);
+    dot_next(dp);
+   }
+   if (dp->type == ',' || dp->type == ';') dot_next(dp);
+  }
+  if (dp->type != ']') { imp_fail(dp->im, dp->ib, "expected ']'"); return; }
+  dot_next(dp);
+ }
+}
+
+void dot_statements(DotParser *dp, NodeSet *mentioned);
+
+int dot_operand(DotParser *dp, NodeSet *out) { // a node ID (with optional :port:compass), or a {subgraph}. Adds its node(s) to 'out'. Returns 1 if it was a node ID, 2 if a subgraph, 0 if neither
+ if (dot_keyword(dp, "subgraph")) {
+  dot_next(dp);
+  if (dp->type == DOT_ID) dot_next(dp); // (name)
+  if (dp->type != '{') return imp_fail(dp->im, dp->ib, "expected '{'");
+ }
+ if (dp->type == '{') {
+  dot_next(dp);
+  dot_statements(dp, out);
+  if (dp->type != '}') return imp_fail(dp->im, dp->ib, "expected '}'");
+  dot_next(dp);
+  return 2;
+ }
+ if (dp->type != DOT_ID) return imp_fail(dp->im, dp->ib, "expected a node");
+ nodeSetAdd(out, imp_node(dp->im, dp->tok, dp->tokLength));
+ dot_next(dp);
+ while (dp->type == ':') { dot_next(dp); if (dp->type == DOT_ID) dot_next(dp); } // ports are ignored
+ return 1;
+}
+
+void dot_statement(DotParser *dp, NodeSet *mentioned) {
+ if (dot_keyword(dp, "graph") || dot_keyword(dp, "node") || dot_keyword(dp, "edge")) { // default attributes: ignored
+  dot_next(dp);
+  dot_attributes(dp, -1);
+  return;
+ }
+ NodeSet a = {0}, b = {0};
+ int kind = 1;
+ if (dp->type == DOT_ID && !dot_keyword(dp, "subgraph")) { // a node, unless it's "name = value" (a graph attribute: ignored)
+  dot_next(dp);
+  if (dp->type == '=') {
+   dot_next(dp);
+   if (dp->type == DOT_ID) dot_next(dp);
+   return;
+  }
+  nodeSetAdd(&a, imp_node(dp->im, dp->prev, dp->prevLength));
+  while (dp->type == ':') { dot_next(dp); if (dp->type == DOT_ID) dot_next(dp); } // ports are ignored
+ }
+ else if (!(kind = dot_operand(dp, &a))) return;
+ int isEdge = 0;
+ while ((dp->type == '>' || dp->type == '-') && !dp->im->failed) { // a -> b -> c ...
+  dot_next(dp);
+  b.n = 0;
+  if (!dot_operand(dp, &b)) break;
+  for (size_t i=0; i<a.n; i++) for (size_t j=0; j<b.n; j++) imp_link(dp->im, a.nodes[i], b.nodes[j]);
+  if (mentioned) for (size_t i=0; i<a.n; i++) nodeSetAdd(mentioned, a.nodes[i]);
+  NodeSet t = a; a = b; b = t;
+  isEdge = 1;
+ }
+ if (mentioned) for (size_t i=0; i<a.n; i++) nodeSetAdd(mentioned, a.nodes[i]);
+ dot_attributes(dp, !isEdge && kind == 1 ? (int64_t)a.nodes[0] : -1);
+ free(a.nodes);
+ free(b.nodes);
+}
+
+void dot_statements(DotParser *dp, NodeSet *mentioned) { // until '}'
+ while (dp->type != '}' && dp->type != DOT_EOF && !dp->im->failed) {
+  dot_statement(dp, mentioned);
+  if (dp->type == ';' || dp->type == ',') dot_next(dp);
+ }
+}
+
+int importDot(Importer *im, InBuffer *ib) {
+ DotParser dp = {im, ib};
+ dot_next(&dp);
+ while (dp.type != DOT_EOF && !im->failed) { // (there can be several graphs in one file)
+  if (dot_keyword(&dp, "strict")) dot_next(&dp);
+  if (!dot_keyword(&dp, "graph") && !dot_keyword(&dp, "digraph")) { imp_fail(im, ib, "expected 'graph' or 'digraph'"); break; }
+  dot_next(&dp);
+  if (dp.type == DOT_ID) dot_next(&dp);
+  if (dp.type != '{') { imp_fail(im, ib, "expected '{'"); break; }
+  dot_next(&dp);
+  dot_statements(&dp, NULL);
+  if (dp.type != '}') { imp_fail(im, ib, "expected '}'"); break; }
+  dot_next(&dp);
+ }
+ free(dp.tok);
+ free(dp.prev);
+ return !im->failed;
+}
+
+
+
+// GraphML. Nodes get their label from a <data> whose <key> is named label/name/title, and their color from one named color ("#RRGGBB"), or r/g/b (0-255, like Gephi does).
+// yEd's <y:NodeLabel> and <y:Fill color=...> work too. Everything else (hyperedges, ports, nested graphs' structure) is ignored; nested graphs just get flattened
+enum { ROLE_NONE, ROLE_LABEL, ROLE_COLOR, ROLE_R, ROLE_G, ROLE_B };
+typedef struct { char id[64]; int role; } GraphMLKey;
+
+size_t xmlDecode(char *s, size_t n) { // replaces &amp; &lt; &#65; etc, in place. Returns the new length
+ char *o = s, *end = s+n;
+ for (char *p = s; p < end; ) {
+  char *semi;
+  if (*p != '&' || !(semi = memchr(p, ';', end-p < 12 ? end-p : 12))) { *o++ = *p++; continue; }
+  size_t len = semi-p-1;
+  const char *name = p+1;
+  long code = -1;
+  if      (len==3 && !memcmp(name,"amp" ,3)) code = '&';
+  else if (len==2 && !memcmp(name,"lt"  ,2)) code = '<';
+  else if (len==2 && !memcmp(name,"gt"  ,2)) code = '>';
+  else if (len==4 && !memcmp(name,"quot",4)) code = '\"';
+  else if (len==4 && !memcmp(name,"apos",4)) code = '\'';
+  else if (len >= 2 && name[0]=='#') code = name[1]=='x' ? strtol(name+2, NULL, 16) : strtol(name+1, NULL, 10);
+  if (code <= 0 || code > 0x10FFFF) { *o++ = *p++; continue; } // not an entity we know: leave it
+  if      (code < 0x80)    { *o++ = code; } // as UTF-8
+  else if (code < 0x800)   { *o++ = 0xC0|(code>>6);  *o++ = 0x80|(code&63); }
+  else if (code < 0x10000) { *o++ = 0xE0|(code>>12); *o++ = 0x80|((code>>6)&63); *o++ = 0x80|(code&63); }
+  else                     { *o++ = 0xF0|(code>>18); *o++ = 0x80|((code>>12)&63); *o++ = 0x80|((code>>6)&63); *o++ = 0x80|(code&63); }
+  p = semi+1;
+ }
+ return o-s;
+}
+
+char *xmlAttribute(char *tag, const char *name, size_t *length) { // finds name="value" in a tag, and decodes the value in place. Returns NULL if it's not there
+ size_t nl = strlen(name);
+ for (char *p = tag; (p = strstr(p, name)); p += nl) {
+  if (p == tag || !isspace((unsigned char)p[-1])) continue;
+  char *q = p+nl;
+  while (isspace((unsigned char)*q)) q++;
+  if (*q != '=') continue;
+  q++;
+  while (isspace((unsigned char)*q)) q++;
+  if (*q != '\"' && *q != '\'') continue;
+  char *end = strchr(q+1, *q);
+  if (!end) return NULL;
+  *length = xmlDecode(q+1, end-q-1);
+  return q+1;
+ }
+ return NULL;
+}
+
+int importGraphML(Importer *im, InBuffer *ib) {
+ GraphMLKey *keys = NULL;
+ int nKeys = 0;
+ TextBuffer tag = {0}, text = {0};
+ int64_t node = -1;  // the <node> we're inside, if any
+ int role = ROLE_NONE; // what the text we're collecting is for
+ int c;
+ while ((c = ib_get(ib)) >= 0 && !im->failed) {
+  if (c != '<') { // text
+   if (role) { char ch = c; if (!tb_add(&text, &ch, 1)) imp_fail(im, ib, "out of memory"); }
+   continue;
+  }
+  tag.n = 0;
+  int quote = 0;
+  while ((c = ib_get(ib)) >= 0 && (quote || c != '>')) { // read the whole tag
+   if (c=='\"' || c=='\'') quote = quote==c ? 0 : quote ? quote : c;
+   char ch = c;
+   if (!tb_add(&tag, &ch, 1)) { imp_fail(im, ib, "out of memory"); break; }
+   if (tag.n==3 && !memcmp(tag.p, "!--", 3)) { // comment: skip to -->
+    int a = 0, b = 0;
+    while ((c = ib_get(ib)) >= 0 && !(a=='-' && b=='-' && c=='>')) { a = b; b = c; }
+    tag.n = 0;
+    break;
+   }
+   if (tag.n==8 && !memcmp(tag.p, "![CDATA[", 8)) { // CDATA: it's all text, up to ]]>
+    int a = 0, b = 0;
+    while ((c = ib_get(ib)) >= 0 && !(a==']' && b==']' && c=='>')) {
+     if (role) { char ch = c; tb_add(&text, &ch, 1); }
+     a = b; b = c;
+    }
+    if (role && text.n >= 2) text.n -= 2; // (the "]]")
+    tag.n = 0;
+    break;
+   }
+  }
+  if (c < 0) { imp_fail(im, ib, "unexpected end of file inside a tag"); break; }
+  if (!tag.n || tag.p[0]=='?' || tag.p[0]=='!') continue; // <?xml ...?>, <!DOCTYPE ...>
+  tag.p[tag.n] = '\0';
+  int closing = tag.p[0]=='/';
+  int selfClosing = tag.p[tag.n-1]=='/';
+  char *name = tag.p + closing;
+  size_t nameLength = strcspn(name, " \t\r\n/");
+  char *colon = memchr(name, ':', nameLength); // ignore any namespace prefix
+  if (colon) { nameLength -= colon+1-name; name = colon+1; }
+  #define IS(str) (nameLength == sizeof(str)-1 && !memcmp(name, str, nameLength))
+  size_t len1, len2;
+  char *a1, *a2;
+  if (closing) {
+   if (IS("node")) node = -1;
+   if ((IS("data") || IS("NodeLabel")) && role) {
+    char *p = text.p;
+    size_t n = xmlDecode(p, text.n);
+    while (n && isspace((unsigned char)*p)) { p++; n--; }
+    while (n && isspace((unsigned char)p[n-1])) n--;
+    if (role == ROLE_LABEL) imp_label(im, node, p, n);
+    if (role == ROLE_COLOR) imp_color(im, node, p, n);
+    if (role >= ROLE_R && node >= 0) {
+     int v = n ? atoi(p) : 255;
+     unsigned char ch = v < 0 ? 0 : v > 255 ? 255 : v;
+     if (role == ROLE_R) im->nodes[node].r = ch;
+     if (role == ROLE_G) im->nodes[node].g = ch;
+     if (role == ROLE_B) im->nodes[node].b = ch;
+    }
+    role = ROLE_NONE;
+   }
+  }
+  else if (IS("key") && (a1 = xmlAttribute(tag.p, "id", &len1))) {
+   GraphMLKey *k = realloc(keys, (nKeys+1)*sizeof(GraphMLKey));
+   if (!k) { imp_fail(im, ib, "out of memory"); break; }
+   keys = k;
+   k = &keys[nKeys++];
+   snprintf(k->id, sizeof(k->id), "%.*s", (int)len1, a1);
+   k->role = ROLE_NONE;
+   if ((a2 = xmlAttribute(tag.p, "for", &len2)) && !(len2==4 && !memcmp(a2,"node",4)) && !(len2==3 && !memcmp(a2,"all",3))) continue;
+   if ((a2 = xmlAttribute(tag.p, "attr.name", &len2))) {
+    a2[len2] = '\0';
+    if      (!strcasecmp(a2,"label") || !strcasecmp(a2,"name") || !strcasecmp(a2,"title")) k->role = ROLE_LABEL;
+    else if (!strcasecmp(a2,"color") || !strcasecmp(a2,"colour")) k->role = ROLE_COLOR;
+    else if (!strcmp(a2,"r")) k->role = ROLE_R;
+    else if (!strcmp(a2,"g")) k->role = ROLE_G;
+    else if (!strcmp(a2,"b")) k->role = ROLE_B;
+   }
+  }
+  else if (IS("node") && (a1 = xmlAttribute(tag.p, "id", &len1))) {
+   node = imp_node(im, a1, len1);
+   if (selfClosing) node = -1;
+  }
+  else if (IS("edge") && (a1 = xmlAttribute(tag.p, "source", &len1)) && (a2 = xmlAttribute(tag.p, "target", &len2))) {
+   int64_t from = imp_node(im, a1, len1); // (a1 & a2 don't overlap, so it's fine that a1 isn't '\0'-terminated)
+   imp_link(im, from, imp_node(im, a2, len2));
+  }
+  else if (IS("data") && node >= 0 && !selfClosing && (a1 = xmlAttribute(tag.p, "key", &len1))) {
+   for (int i=0; i<nKeys; i++) if (strlen(keys[i].id)==len1 && !memcmp(keys[i].id, a1, len1)) role = keys[i].role;
+   text.n = 0;
+  }
+  else if (IS("NodeLabel") && node >= 0 && !selfClosing) { role = ROLE_LABEL; text.n = 0; }
+  else if (IS("Fill") && node >= 0 && (a1 = xmlAttribute(tag.p, "color", &len1))) imp_color(im, node, a1, len1);
+  #undef IS
+ }
+ free(keys);
+ free(tag.p);
+ free(text.p);
+ return !im->failed;
+}
+
+
+
+void ob_label(OutBuffer *ob, const char *p, size_t n, int binary) { // node text from an import. Any '\0's become spaces
+ while (n) {
+  const char *z = memchr(p, '\0', n);
+  size_t run = z ? (size_t)(z-p) : n;
+  if (binary) ob_write(ob, p, run); else ob_text(ob, p, run);
+  if (!z) break;
+  ob_puts(ob, " ");
+  p += run+1;
+  n -= run+1;
+ }
+}
+
+int writeImport(Importer *im, const char *filename, int binary) { // writes out a Tangent file
+ char tmp[FILENAME_MAX+32];
+ tempFileName(tmp, sizeof(tmp), filename);
+ OutBuffer *ob = malloc(sizeof(OutBuffer));
+ if (!ob) return 0;
+ ob->fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+ if (ob->fd < 0) { perror(tmp); free(ob); return 0; }
+ ob->failed = 0; ob->n = 0;
+ #define LABEL(in) (in)->labelLength ? im->arena + (in)->label : im->arena + (in)->id, (in)->labelLength ? (in)->labelLength : (in)->idLength
+ if (binary) {
+  BinaryHeader h = {BINARY_MAGIC, BINARY_VERSION, im->nNodes, im->nLinks, 0, 0, {0}};
+  uint64_t textBytes = 0;
+  for (uint32_t i=0; i<im->nNodes; i++) { ImportNode *in = &im->nodes[i]; size_t n = in->labelLength ? in->labelLength : in->idLength; if (n) textBytes += n+1; }
+  if (textBytes > UINT32_MAX || im->nLinks > UINT32_MAX) { fprintf(stderr, "%s: too big for the binary format\n", filename); ob->failed = 1; }
+  h.textBytes = textBytes;
+  ob_write(ob, (char*)&h, sizeof(h));
+  uint32_t offset = 0;
+  for (uint32_t i=0; i<im->nNodes && !ob->failed; i++) {
+   ImportNode *in = &im->nodes[i];
+   BinaryNode bn = {RND(), RND(), in->r, in->g, in->b, 0, 0, in->labelLength ? in->labelLength : in->idLength, 0};
+   if (bn.textLength) { bn.textOffset = offset; offset += bn.textLength+1; }
+   ob_write(ob, (char*)&bn, sizeof(bn));
+  }
+ } else {
+  ob_puts(ob, "view:\nf=0\nnodes:\n");
+  for (uint32_t i=0; i<im->nNodes && !ob->failed; i++) {
+   ImportNode *in = &im->nodes[i];
+   ob_puts(ob, "i="); ob_int(ob, i);
+   ob_puts(ob, " c="); ob_hex2(ob, in->r); ob_hex2(ob, in->g); ob_hex2(ob, in->b);
+   ob_puts(ob, " t=\""); ob_label(ob, LABEL(in), 0); ob_puts(ob, "\"\n");
+  }
+  ob_puts(ob, "connections:\n");
+ }
+ fflush(im->spool);
+ rewind(im->spool);
+ static int32_t pairs[1<<14][2];
+ size_t n;
+ while (!ob->failed && (n = fread(pairs, sizeof(pairs[0]), sizeof(pairs)/sizeof(pairs[0]), im->spool)) > 0) {
+  if (binary) ob_write(ob, (char*)pairs, n*sizeof(pairs[0]));
+  else for (size_t i=0; i<n; i++) { ob_puts(ob, "a="); ob_int(ob, pairs[i][0]); ob_puts(ob, " b="); ob_int(ob, pairs[i][1]); ob_puts(ob, "\n"); }
+ }
+ if (ferror(im->spool)) ob->failed = 1;
+ if (binary) for (uint32_t i=0; i<im->nNodes && !ob->failed; i++) {
+  ImportNode *in = &im->nodes[i];
+  if (!in->labelLength && !in->idLength) continue;
+  ob_label(ob, LABEL(in), 1);
+  ob_write(ob, "", 1);
+ }
+ #undef LABEL
+ ob_flush(ob);
+ if (close(ob->fd)) ob->failed = 1;
+ int ok = !ob->failed;
+ free(ob);
+ return commitTempFile(tmp, filename, ok);
+}
+
+int importGraph(const char *from, const char *to, int binary) { // converts a file in any format that importFormat() knows into a Tangent file. Returns 1 on success
+ double t0 = secondsNow();
+ InBuffer ib;
+ if (!ib_open(&ib, from)) return 0;
+ Importer im = {from};
+ im.maxNodes = im.tableSize = 1<<16;
+ im.arenaMax = 1<<20;
+ im.nodes = malloc(im.maxNodes*sizeof(ImportNode));
+ im.table = calloc(im.tableSize, sizeof(uint64_t));
+ im.arena = malloc(im.arenaMax);
+ im.spool = tmpfile();
+ if (!im.nodes || !im.table || !im.arena || !im.spool) imp_fail(&im, NULL, "out of memory");
+ else {
+  static char spoolBuffer[1<<20];
+  setvbuf(im.spool, spoolBuffer, _IOFBF, sizeof(spoolBuffer));
+  switch (importFormat(from)) {
+   case IMPORT_TSV:     importEdgeList(&im, &ib, 0); break;
+   case IMPORT_CSV:     importEdgeList(&im, &ib, 1); break;
+   case IMPORT_DOT:     importDot(&im, &ib);         break;
+   case IMPORT_GRAPHML: importGraphML(&im, &ib);     break;
+   default:             imp_fail(&im, NULL, "not a format that can be imported");
+  }
+ }
+ if (ib.error) imp_fail(&im, &ib, "couldn't read the file");
+ if (!im.failed && im.nNodes == 0) imp_fail(&im, &ib, "no nodes");
+ ib_close(&ib);
+ int ok = !im.failed && writeImport(&im, to, binary);
+ if (ok) {
+  printf("Imported %u nodes and %llu connections from %s in %.2f s\n", im.nNodes, (unsigned long long)im.nLinks, from, secondsNow()-t0);
+  if (im.nSelfLinks) printf("(Skipped %llu connections from nodes to themselves)\n", (unsigned long long)im.nSelfLinks);
+  if (im.nNodes > MAXNODES || im.nLinks > MAXLINKS) printf("Note: this program can only open graphs of up to %d nodes and %d connections. (Rebuild with -DMAXNODES=... -DMAXLINKS=... for bigger ones)\n", MAXNODES, MAXLINKS);
+ }
+ if (im.spool) fclose(im.spool);
+ free(im.nodes);
+ free(im.table);
+ free(im.arena);
+ return ok;
+}
+
+// COLLABORATION: 'tangent --serve SOCKET [file]' keeps the shared graph, and 'tangent --join SOCKET' edits it along with everyone else.
+// Clients send their edits to the server once a frame, as one batch of encoded Edits (the journal's format - see encodeEdit()). The server applies them in the order they arrive, and relays them to the other clients.
+// The server answers each batch with an ack, so the client knows where its own edits fell among everyone else's. Until then the client shows its edits anyway, keeping their inverses (see undoRecordLinks()).
+// When someone else's edits come first, the client takes its unconfirmed edits back, applies theirs, and makes its own again on top, in the order the server applied them. So everyone ends up with the server's graph.
+// Every message from the server also says how many nodes & connections it has: a client that's caught up and doesn't match asks for the whole graph again (which shouldn't happen)
+#define COLLAB_MAX_CLIENTS 32
+#define COLLAB_MAX_MESSAGE (1u<<30)
+#define COLLAB_MAX_BACKLOG (256u<<20) // the server drops a client that falls this many bytes behind
+enum { COLLAB_EDITS=1, COLLAB_STATE, COLLAB_RESYNC };
+typedef struct { uint32_t length; unsigned char type, ack, pad[2]; int32_t nNodes, nLinks; } CollabHeader; // then 'length' bytes of encoded Edits. ack: this is the server's answer to the client's own batch
+typedef struct { int fd; TextBuffer in, out; size_t sent; } CollabPeer; // (in & out: bytes not yet parsed / not yet written)
+
+CollabPeer collab = {-1};       // client: the connection to the server
+TextBuffer collabBatch = {0};   // client: this frame's edits, to send
+struct { unsigned char op; int node; size_t at; } collabLast[64]; // where in collabBatch the last few position & color changes are
+int nCollabLast = 0;
+TextBuffer collabSent = {0};    // client: the batches the server hasn't answered yet, oldest first
+struct { size_t bytes, records; } *collabSentBatches = NULL; // (records: how many of collabInverses are the batch's)
+int nCollabSent = 0, maxCollabSent = 0;
+int collabResyncing = 0;        // boolean: asked for the whole graph, and it hasn't come yet
+
+void collabSend(CollabPeer *p, int type, int ack, const char *data, size_t length) { // queues a message. It goes out in collabWrite()
+ CollabHeader h = {length, type, ack, {0}, nNodes, nLinks};
+ if (!tb_add(&p->out, (const char*)&h, sizeof(h)) || !tb_add(&p->out, data, length)) { close(p->fd); p->fd = -1; } // (out of memory: better to start over than to carry on with a hole)
+}
+
+int collabWrite(CollabPeer *p) { // writes as much as the socket takes right now. Returns 0 if the connection is gone
+ if (p->fd < 0) return 0;
+ while (p->sent < p->out.n) {
+  ssize_t n = write(p->fd, p->out.p + p->sent, p->out.n - p->sent);
+  if (n < 0 && errno == EINTR) continue;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+  if (n <= 0) return 0;
+  p->sent += n;
+ }
+ if (p->sent == p->out.n) p->sent = p->out.n = 0;
+ return 1;
+}
+
+int collabRead(CollabPeer *p) { // reads whatever has arrived, without waiting. Returns 0 if the connection is gone
+ char buf[1<<16];
+ while (1) {
+  ssize_t n = read(p->fd, buf, sizeof(buf));
+  if (n < 0 && errno == EINTR) continue;
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 1;
+  if (n <= 0 || !tb_add(&p->in, buf, n)) return 0;
+ }
+}
+
+const char *collabNextMessage(CollabPeer *p, size_t *pos, CollabHeader *h) { // the next complete message in p->in after *pos (and moves *pos past it), or NULL. Call collabConsumed() when done
+ if (p->in.n - *pos < sizeof(CollabHeader)) return NULL;
+ memcpy(h, p->in.p + *pos, sizeof(CollabHeader));
+ if (p->in.n - *pos - sizeof(CollabHeader) < h->length) return NULL;
+ const char *data = p->in.p + *pos + sizeof(CollabHeader);
+ *pos += sizeof(CollabHeader) + h->length;
+ return data;
+}
+
+void collabConsumed(CollabPeer *p, size_t pos) {
+ memmove(p->in.p, p->in.p + pos, p->in.n - pos);
+ p->in.n -= pos;
+}
+
+void collabClose(CollabPeer *p) {
+ if (p->fd >= 0) close(p->fd);
+ free(p->in.p);
+ free(p->out.p);
+ memset(p, 0, sizeof(CollabPeer));
+ p->fd = -1;
+}
+
+int isStructuralEdit(int op) { // does it change which node is which number?
+ return op == EDIT_ADD || op == EDIT_DELETE || op == EDIT_SWAP || op == EDIT_EXCHANGE;
+}
+
+void collabAddEdit(const Edit *e) { // (from journalEdit()) adds a local edit to this frame's batch for the server
+ if (collab.fd < 0 || collabApplying || collabReplaying) return;
+ unsigned char buf[EDIT_MAX_FIXED];
+ size_t n = encodeEdit(e, buf);
+ if (e->op == EDIT_MOVE || e->op == EDIT_COLOR) { // only the last position or color of a node in a frame matters
+  for (int i=0; i<nCollabLast; i++) if (collabLast[i].op == e->op && collabLast[i].node == e->node) { memcpy(collabBatch.p + collabLast[i].at, buf, n); return; }
+  if (nCollabLast < (int)(sizeof(collabLast)/sizeof(collabLast[0]))) { collabLast[nCollabLast].op = e->op; collabLast[nCollabLast].node = e->node; collabLast[nCollabLast].at = collabBatch.n; nCollabLast++; }
+ }
+ else if (isStructuralEdit(e->op)) nCollabLast = 0;
+ tb_add(&collabBatch, (const char*)buf, n);
+ if (e->op == EDIT_TEXT && e->textLen) tb_add(&collabBatch, e->text, e->textLen);
+}
+
+int collabApply(const char *data, size_t length) { // applies edits from the server. Returns 1 if any of them were structural
+ int structural = 0;
+ while (length) {
+  Edit e;
+  size_t n = decodeEdit((const unsigned char*)data, length, &e);
+  if (!n) break;
+  applyEdit(&e);
+  structural |= isStructuralEdit(e.op);
+  data += n;  length -= n;
+ }
+ return structural;
+}
+
+int collabRollBack() { // takes back your edits the server hasn't confirmed, newest first. Returns 1 if any of that was structural
+ int structural = 0;
+ collabApplying = 1;
+ while (collabInverses.n > collabInverses.first) {
+  UndoRecord u = collabInverses.r[--collabInverses.n];
+  structural |= isStructuralEdit(u.e.op) || u.e.op == UNDO_RESTORE;
+  undoApply(&u);
+  undoForget(&u);
+ }
+ undoClearHistory(&collabInverses);
+ collabApplying = 0;
+ return structural;
+}
+
+void collabForgetInverses(size_t n) { // the oldest n inverses: the server confirmed those edits, so they'll never be taken back
+ UndoHistory *h = &collabInverses;
+ for (; n && h->first < h->n; n--) {
+  h->bytes -= undoRecordBytes(&h->r[h->first]);
+  undoForget(&h->r[h->first++]);
+ }
+ if (h->first == h->n) h->first = h->n = 0;
+}
+
+void collabDropBatch() { // the oldest sent batch
+ memmove(collabSent.p, collabSent.p + collabSentBatches[0].bytes, collabSent.n - collabSentBatches[0].bytes);
+ collabSent.n -= collabSentBatches[0].bytes;
+ memmove(collabSentBatches, collabSentBatches+1, (--nCollabSent)*sizeof(collabSentBatches[0]));
+}
+
+void collabDisconnect(const char *why) {
+ if (collab.fd < 0) return;
+ collabClose(&collab);
+ collabBatch.n = collabSent.n = 0;
+ nCollabLast = nCollabSent = collabResyncing = 0;
+ undoClearHistory(&collabInverses);
+ collabKeepInverses = 0;
+ if (why) { puts(why); message(why); }
+}
+
+int collabJoin(const char *path) { // connects to a server. The graph gets replaced when it arrives. Returns 0 on failure
+ struct sockaddr_un addr = {AF_UNIX};
+ if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "Socket path too long: %s\n", path); return 0; }
+ strcpy(addr.sun_path, path);
+ int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+ if (fd < 0 || connect(fd, (struct sockaddr*)&addr, sizeof(addr))) { perror(path); if (fd >= 0) close(fd); return 0; }
+ fcntl(fd, F_SETFL, O_NONBLOCK);
+ collabDisconnect(NULL);
+ collab.fd = fd;
+ collabKeepInverses = 1;
+ collabSend(&collab, COLLAB_RESYNC, 0, NULL, 0);
+ collabResyncing = 1;
+ message_printf("Joining %s...", path);
+ return 1;
+}
+
+void collabReplaceGraph(const char *data, size_t length) { // (client) the whole shared graph came
+ journalStop();
+ filename[0] = 0; // (it's the server's graph. Saving makes a copy)
+ isModified = 0;
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) if (editSessions[i].node >= 0) endEditSession(&editSessions[i]);
+ undoClear();
+ clearGraph();
+ setTextSource(NULL, 0, 0);
+ mark = toDrag = -1;
+ collabApplying = 1;
+ collabApply(data, length);
+ collabApplying = 0;
+}
+
+void collabPoll() { // (client, every frame) sends the last frame's edits, and applies what's come from the server, all without waiting
+ if (collab.fd < 0 || loading) return;
+ if (collabBatch.n) {
+  if (nCollabSent == maxCollabSent) {
+   int newMax = maxCollabSent ? maxCollabSent*2 : 16;
+   void *p = realloc(collabSentBatches, newMax*sizeof(collabSentBatches[0]));
+   if (!p) { collabDisconnect("Out of memory for the shared graph"); return; }
+   collabSentBatches = p;  maxCollabSent = newMax;
+  }
+  size_t records = collabInverses.n - collabInverses.first;
+  for (int i=0; i<nCollabSent; i++) records -= collabSentBatches[i].records;
+  collabSentBatches[nCollabSent].bytes = collabBatch.n;
+  collabSentBatches[nCollabSent++].records = records;
+  collabSend(&collab, COLLAB_EDITS, 0, collabBatch.p, collabBatch.n);
+  if (!tb_add(&collabSent, collabBatch.p, collabBatch.n)) { collabDisconnect("Out of memory for the shared graph"); return; }
+  collabBatch.n = 0;
+  nCollabLast = 0;
+ }
+ if (!collabWrite(&collab) || !collabRead(&collab)) { collabDisconnect("Lost the connection to the shared graph"); return; }
+ size_t pos = 0;
+ CollabHeader h = {0};
+ const char *data;
+ int rolledBack = 0, structural = 0;
+ while ((data = collabNextMessage(&collab, &pos, &h))) {
+  if (h.type == COLLAB_STATE) {
+   undoClearHistory(&collabInverses); // (the graph they'd undo edits on is gone. The batches still unanswered get made again on the new one)
+   rolledBack = 1;
+   collabReplaceGraph(data, h.length);
+   if (collabResyncing) message("Joined the shared graph");
+   collabResyncing = 0;
+  } else if (h.type == COLLAB_EDITS && h.ack && nCollabSent) { // your oldest batch, as the server applied it
+   if (rolledBack) {
+    collabApplying = 1;
+    structural |= collabApply(collabSent.p, collabSentBatches[0].bytes);
+    collabApplying = 0;
+   }
+   else collabForgetInverses(collabSentBatches[0].records); // (it's already shown)
+   collabDropBatch();
+  } else if (h.type == COLLAB_EDITS) { // someone else's edits: they go before yours
+   if (nCollabSent && !rolledBack) { structural |= collabRollBack(); rolledBack = 1; }
+   collabApplying = 1;
+   structural |= collabApply(data, h.length);
+   collabApplying = 0;
+  }
+  if (!collabResyncing && !nCollabSent && (h.nNodes != nNodes || h.nLinks != nLinks)) { // out of step with the server
+   collabSend(&collab, COLLAB_RESYNC, 0, NULL, 0);
+   collabResyncing = 1;
+  }
+ }
+ collabConsumed(&collab, pos);
+ if (rolledBack) { // make your unanswered edits again, on top
+  collabReplaying = 1;
+  for (int i=0, at=0; i<nCollabSent; at += collabSentBatches[i++].bytes) {
+   size_t before = collabInverses.n;
+   structural |= collabApply(collabSent.p + at, collabSentBatches[i].bytes);
+   collabSentBatches[i].records = collabInverses.n - before;
+  }
+  collabReplaying = 0;
+ }
+ if (structural) undoClear(); // (your undo history refers to nodes by number, and those just changed)
+ if (nNodes < 1) addRootNode();
+ if (focus < 0 || focus >= nNodes) focus = nodeNearest(viewX, viewY); // (someone deleted it)
+ if (mark >= nNodes) mark = -1;
+ if (toDrag >= nNodes) toDrag = -1;
+ if (h.length > COLLAB_MAX_MESSAGE) collabDisconnect("Bad data from the shared graph's server");
+}
+
+void collabSendState(CollabPeer *p) { // (server) the whole graph, as the edits that would build it
+ TextBuffer tb = {0};
+ unsigned char buf[EDIT_MAX_FIXED];
+ for (int i=0; i<nNodes; i++) {
+  Edit a = {EDIT_ADD, 0, 0, nodes[i].x, nodes[i].y, nodes[i].r, nodes[i].g, nodes[i].b, nodes[i].flags};
+  tb_add(&tb, (const char*)buf, encodeEdit(&a, buf));
+  const char *text = nodeText(i);
+  if (text && *text) {
+   Edit t = {EDIT_TEXT, i}; t.text = text; t.textLen = strlen(text);
+   tb_add(&tb, (const char*)buf, encodeEdit(&t, buf));
+   tb_add(&tb, text, t.textLen);
+  }
+ }
+ for (int i=0; i<nLinks; i++) {
+  Edit c = {EDIT_CONNECT, links[i].from, links[i].to};
+  tb_add(&tb, (const char*)buf, encodeEdit(&c, buf));
+ }
+ collabSend(p, COLLAB_STATE, 0, tb.p, tb.n);
+ free(tb.p);
+}
+
+volatile int stopServing = 0;
+void stopServingSignal(int sig) { stopServing = 1; }
+
+int serveGraph(const char *path, const char *file) { // --serve: runs the shared graph's server until interrupted. Returns the exit code
+ if (file && !(startLoading(file, 1) && continueLoading(1) == LOAD_DONE)) { fprintf(stderr, "Couldn't load %s\n", file); return 1; }
+ if (nNodes < 1) addRootNode();
+ unsigned long loadedVersion = editVersion;
+ undoMuted = 1; // (nobody undoes anything on the server: clients undo by sending the opposite edits)
+ struct sockaddr_un addr = {AF_UNIX};
+ if (strlen(path) >= sizeof(addr.sun_path)) { fprintf(stderr, "Socket path too long: %s\n", path); return 1; }
+ strcpy(addr.sun_path, path);
+ struct stat st;
+ if (!stat(path, &st) && S_ISSOCK(st.st_mode)) unlink(path); // (left over from a server that didn't get to clean up)
+ int ls = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+ if (ls < 0 || bind(ls, (struct sockaddr*)&addr, sizeof(addr)) || listen(ls, 16)) { perror(path); return 1; }
+ signal(SIGPIPE, SIG_IGN);
+ signal(SIGINT, stopServingSignal);
+ signal(SIGTERM, stopServingSignal);
+ printf("Serving %s on %s\n", file ? file : "a new graph", path);
+ CollabPeer peers[COLLAB_MAX_CLIENTS];
+ struct pollfd pfd[COLLAB_MAX_CLIENTS+1];
+ int nPeers = 0;
+ TextBuffer relay = {0};
+ while (!stopServing) {
+  pfd[0].fd = ls;  pfd[0].events = nPeers < COLLAB_MAX_CLIENTS ? POLLIN : 0;
+  for (int i=0; i<nPeers; i++) { pfd[i+1].fd = peers[i].fd;  pfd[i+1].events = POLLIN | (peers[i].out.n ? POLLOUT : 0); }
+  if (poll(pfd, nPeers+1, -1) < 0) {
+   if (errno == EINTR) continue;
+   perror("poll");
+   break;
+  }
+  if ((pfd[0].revents & POLLIN)) {
+   int fd = accept(ls, NULL, NULL);
+   if (fd >= 0) {
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    memset(&peers[nPeers], 0, sizeof(CollabPeer));
+    peers[nPeers].fd = fd;
+    pfd[++nPeers].revents = 0;
+    printf("Client joined (%d now)\n", nPeers);
+   }
+  }
+  for (int i=0; i<nPeers; i++) {
+   CollabPeer *p = &peers[i];
+   if (p->fd < 0 || !(pfd[i+1].revents & (POLLIN|POLLHUP|POLLERR))) continue;
+   int alive = collabRead(p);
+   size_t pos = 0;
+   CollabHeader h = {0};
+   const char *data;
+   while ((data = collabNextMessage(p, &pos, &h))) {
+    if (h.type == COLLAB_RESYNC) collabSendState(p);
+    if (h.type != COLLAB_EDITS) continue;
+    relay.n = 0;
+    for (size_t at = 0; at < h.length; ) { // apply them, keeping the ones that made sense here
+     Edit e;
+     size_t n = decodeEdit((const unsigned char*)data + at, h.length - at, &e);
+     if (!n) break;
+     if (applyEdit(&e)) tb_add(&relay, data + at, n);
+     at += n;
+    }
+    for (int j=0; j<nPeers; j++) if (j != i && peers[j].fd >= 0 && relay.n) collabSend(&peers[j], COLLAB_EDITS, 0, relay.p, relay.n);
+    collabSend(p, COLLAB_EDITS, 1, NULL, 0); // (the sender knows what it sent, and does the same)
+   }
+   collabConsumed(p, pos);
+   if (!alive || h.length > COLLAB_MAX_MESSAGE) { close(p->fd); p->fd = -1; }
+  }
+  for (int i=0; i<nPeers; i++) {
+   if (peers[i].fd >= 0 && (!collabWrite(&peers[i]) || peers[i].out.n - peers[i].sent > COLLAB_MAX_BACKLOG)) { close(peers[i].fd); peers[i].fd = -1; }
+   if (peers[i].fd < 0) {
+    collabClose(&peers[i]);
+    peers[i] = peers[--nPeers];
+    i--;
+    printf("Client left (%d now)\n", nPeers);
+   }
+  }
+ }
+ for (int i=0; i<nPeers; i++) collabClose(&peers[i]);
+ free(relay.p);
+ close(ls);
+ unlink(path);
+ finishCompaction(); // (pre_init() exits straight after this, without done())
+ if (filename[0] && editVersion != loadedVersion) { // the edits are in the journal already, but other programs read the file: write it out, and start the journal over
+  if (saveToFile(filename)) journalStart(filename, 0);
+  else { fprintf(stderr, "Couldn't save to %s (the edits are in its journal)\n", filename);  return 1; }
+ }
+ return 0;
+}
+
+// SEARCH (Ctrl-F): type, and the focus jumps to the first node whose text has that in it, ignoring case. Enter goes to the next one, Shift-Enter back, ESC ends the search.
+// Lookups go through a trigram index: for every 3 characters in a row in any node's text, the list of nodes that have them. The query's rarest trigram gives a short list of candidates, and those get checked for real.
+// The index only ever grows: when a node's text changes, or a node gets another number, it's listed again under its new trigrams, and the old entries go stale (checking the candidates weeds those out). Once there are more stale entries than live ones, it gets rebuilt.
+// Building it happens a few ms at a time, every frame (see searchIndexStep()), including while a file loads, so a million nodes don't stall anything. Nodes it hasn't got to yet get searched the slow way
+#define SEARCH_FRAME_BUDGET 0.003 // seconds per frame for building the index
+#define SEARCH_SCAN_LIMIT 65536   // more nodes than this, and 1 or 2 letters (which the index can't help with) aren't worth searching for
+typedef struct { uint32_t key, n, max; int *ids; } Trigram; // key: 3 lowercased bytes (0 means an empty slot)
+
+Trigram *searchTable = NULL; // open addressing
+size_t searchTableSize = 0, searchTableUsed = 0; // (a power of 2)
+int searchIndexed = 0;       // nodes 0 to searchIndexed-1 are in the index
+size_t searchEntries = 0, searchStale = 0;
+int searchFailed = 0;        // boolean: ran out of memory, so don't bother with the index any more
+unsigned searchCount[MAXNODES];  // how many entries each node has in the index
+unsigned searchStamp[MAXNODES], searchEpoch = 0; // (so a candidate gets checked once)
+char *searchScratch = NULL;  size_t searchScratchSize = 0;
+
+int searching = 0;           // boolean: typing a search
+char searchQuery[256] = "";
+int *searchResults = NULL;   // the nodes that match, lowest number first
+int nSearchResults = 0, maxSearchResults = 0, searchAt = 0;
+unsigned long searchVersion = 0; // editVersion when the results were found
+int searchTooShort = 0;      // boolean: the query needs more letters
+
+const char *peekNodeText(int id, size_t *len, char **scratch, size_t *scratchSize) { // like nodeText(), but lazy text doesn't stay loaded (it goes into *scratch, if it needs unescaping). Not '\0'-terminated. Returns NULL if none (or out of memory)
+ const Node *n = &nodes[id];
+ if (!n->lazyText) { *len = n->text ? strlen(n->text) : 0; return n->text; }
+ if (!textSource.escaped) { *len = n->lazyLength; return n->lazyText; }
+ if (*scratchSize < n->lazyLength) {
+  char *p = realloc(*scratch, n->lazyLength);
+  if (!p) { *len = 0; return NULL; }
+  *scratch = p;  *scratchSize = n->lazyLength;
+ }
+ *len = unescapeText(*scratch, n->lazyText, n->lazyLength);
+ return *scratch;
+}
+
+static inline uint32_t trigramAt(const char *p) {
+ return (uint32_t)tolower((unsigned char)p[0])<<16 | (uint32_t)tolower((unsigned char)p[1])<<8 | (uint32_t)tolower((unsigned char)p[2]);
+}
+
+void searchClear() { // (e.g. another graph got loaded)
+ for (size_t i=0; i<searchTableSize; i++) free(searchTable[i].ids);
+ free(searchTable);
+ searchTable = NULL;
+ searchTableSize = searchTableUsed = 0;
+ searchIndexed = 0;
+ searchEntries = searchStale = 0;
+}
+
+Trigram *searchSlot(uint32_t key, int create) { // the trigram's list, or NULL if it has none (or there's no memory to make one)
+ if (create && (searchTableUsed+1)*2 > searchTableSize) {
+  size_t newSize = searchTableSize ? searchTableSize*2 : 4096;
+  Trigram *t = calloc(newSize, sizeof(Trigram));
+  if (!t) return NULL;
+  for (size_t i=0; i<searchTableSize; i++) if (searchTable[i].key) {
+   size_t j = (searchTable[i].key * 2654435761u) & (newSize-1);
+   while (t[j].key) j = (j+1) & (newSize-1);
+   t[j] = searchTable[i];
+  }
+  free(searchTable);
+  searchTable = t;  searchTableSize = newSize;
+ }
+ if (!searchTableSize) return NULL;
+ for (size_t i = (key * 2654435761u) & (searchTableSize-1); ; i = (i+1) & (searchTableSize-1)) {
+  if (searchTable[i].key == key) return &searchTable[i];
+  if (!searchTable[i].key) {
+   if (!create) return NULL;
+   searchTable[i].key = key;
+   searchTableUsed++;
+   return &searchTable[i];
+  }
+ }
+}
+
+void searchAdd(int id) { // (from the edit functions) puts node id's text in the index. Nodes past searchIndexed wait for searchIndexStep()
+ if (searchIndexed > nNodes) searchIndexed = nNodes; // (the last ones got deleted)
+ if (id > searchIndexed || id >= nNodes || searchFailed) return;
+ if (id == searchIndexed) searchIndexed++;
+ size_t len;
+ const char *t = peekNodeText(id, &len, &searchScratch, &searchScratchSize);
+ unsigned count = 0;
+ for (size_t i=0; t && i+2 < len; i++) {
+  Trigram *tg = searchSlot(trigramAt(t+i), 1);
+  if (!tg) goto outOfMemory;
+  if (tg->n && tg->ids[tg->n-1] == id) continue; // (the same 3 characters again in this text)
+  if (tg->n == tg->max) {
+   uint32_t newMax = tg->max ? tg->max*2 : 4;
+   int *p = realloc(tg->ids, newMax*sizeof(int));
+   if (!p) goto outOfMemory;
+   tg->ids = p;  tg->max = newMax;
+  }
+  tg->ids[tg->n++] = id;
+  count++;
+ }
+ searchCount[id] = count;
+ searchEntries += count;
+ return;
+ outOfMemory: // searching still works, just slowly
+ searchClear();
+ searchFailed = 1;
+}
+
+void searchForget(int id) { // (from the edit functions) node id's entries are stale: its text is changing, or it's getting another number
+ if (id >= searchIndexed) return;
+ searchStale += searchCount[id];
+ searchCount[id] = 0;
+}
+
+void searchReindex(int id) {
+ searchForget(id);
+ searchAdd(id);
+}
+
+void searchIndexStep() { // (every frame) builds the index some more
+ if (searchStale > 65536 && searchStale*2 > searchEntries) searchClear(); // mostly stale: start over
+ if (searchIndexed >= nNodes || searchFailed) return;
+ double t0 = secondsNow();
+ while (searchIndexed < nNodes && !searchFailed) {
+  for (int k=0; k<64 && searchIndexed < nNodes; k++) searchAdd(searchIndexed);
+  if (secondsNow() - t0 > SEARCH_FRAME_BUDGET) break;
+ }
+}
+
+int searchHas(int id, const char *q, size_t qlen) { // boolean: does node id's text have q (which is lowercase) in it?
+ size_t len;
+ const char *t = peekNodeText(id, &len, &searchScratch, &searchScratchSize);
+ for (size_t i=0; t && i+qlen <= len; i++) {
+  size_t j = 0;
+  while (j < qlen && tolower((unsigned char)t[i+j]) == (unsigned char)q[j]) j++;
+  if (j == qlen) return 1;
+ }
+ return 0;
+}
+
+int compareInts(const void *a, const void *b) {
+ return *(const int*)a - *(const int*)b;
+}
+
+void searchFind(const char *query) { // fills searchResults[]
+ char q[sizeof(searchQuery)];
+ size_t qlen = 0;
+ for (; query[qlen] && qlen < sizeof(q)-1; qlen++) q[qlen] = tolower((unsigned char)query[qlen]);
+ nSearchResults = searchAt = 0;
+ searchVersion = editVersion;
+ searchTooShort = qlen < 3 && nNodes > SEARCH_SCAN_LIMIT;
+ if (!qlen || searchTooShort) return;
+ if (!++searchEpoch) { memset(searchStamp, 0, sizeof(searchStamp)); searchEpoch = 1; }
+ int from = 0; // where the slow way starts
+ if (qlen >= 3) {
+  Trigram *rarest = NULL;
+  for (size_t i=0; i+2 < qlen; i++) {
+   Trigram *tg = searchSlot(trigramAt(q+i), 0);
+   if (!tg || !tg->n) { rarest = NULL; break; } // (nothing indexed has it)
+   if (!rarest || tg->n < rarest->n) rarest = tg;
+  }
+  for (uint32_t k=0; rarest && k < rarest->n; k++) {
+   int id = rarest->ids[k];
+   if (id >= searchIndexed || searchStamp[id] == searchEpoch) continue;
+   searchStamp[id] = searchEpoch;
+   if (!searchHas(id, q, qlen)) continue;
+   if (nSearchResults == maxSearchResults) {
+    int newMax = maxSearchResults ? maxSearchResults*2 : 256;
+    int *p = realloc(searchResults, newMax*sizeof(int));
+    if (!p) break;
+    searchResults = p;  maxSearchResults = newMax;
+   }
+   searchResults[nSearchResults++] = id;
+  }
+  qsort(searchResults, nSearchResults, sizeof(int), compareInts);
+  from = searchIndexed;
+ }
+ for (int id=from; id<nNodes; id++) { // (1 or 2 letters, or the nodes the index hasn't got to)
+  if (!searchHas(id, q, qlen)) continue;
+  if (nSearchResults == maxSearchResults) {
+   int newMax = maxSearchResults ? maxSearchResults*2 : 256;
+   int *p = realloc(searchResults, newMax*sizeof(int));
+   if (!p) break;
+   searchResults = p;  maxSearchResults = newMax;
+  }
+  searchResults[nSearchResults++] = id;
+ }
+}
+
+void searchShow() {
+ if (searchTooShort) message_printf("Search: %s_   (keep typing)", searchQuery);
+ else if (!nSearchResults) message_printf("Search: %s_%s", searchQuery, searchQuery[0] ? "   (not found)" : "");
+ else message_printf("Search: %s_   (%d of %d)", searchQuery, searchAt+1, nSearchResults);
+}
+
+void searchKeys() { // (every frame while searching) takes all the typed keys
+ int changed = 0, step = 0;
+ for (const char *c = _typed; *c; c++) {
+  if (*c == 27) { searching = 0; message("Search ended"); break; }
+  else if (*c == 13) step = (_key_mod & GLUT_ACTIVE_SHIFT) ? -1 : 1;
+  else if (*c == 8 || *c == 127) {
+   size_t n = strlen(searchQuery);
+   while (n && ((unsigned char)searchQuery[n-1] & 0xC0) == 0x80) n--; // (a whole UTF-8 character)
+   if (n) n--;
+   searchQuery[n] = 0;
+   changed = 1;
+  }
+  else if ((unsigned char)*c >= 32) {
+   size_t n = strlen(searchQuery);
+   if (n < sizeof(searchQuery)-1) { searchQuery[n] = *c; searchQuery[n+1] = 0; changed = 1; }
+  }
+ }
+ memset(keymap, 0, sizeof(keymap)); // (so the typing doesn't also add nodes etc)
+ if (!searching) return;
+ messageTimeout = MESSAGE_TIMEOUT_NFRAMES;
+ if (step && searchVersion != editVersion) { searchFind(searchQuery); changed = 1; step = 0; } // (the graph changed since: the numbers might have too)
+ if (changed) searchFind(searchQuery);
+ else if (step && nSearchResults) searchAt = (searchAt + step + nSearchResults) % nSearchResults;
+ else if (!step) return;
+ if (nSearchResults) focus = searchResults[searchAt];
+ searchShow();
+}
+
+// COMMANDS: 'tangent --commands SOURCE' takes edits from SOURCE (a file, a named pipe, or - for stdin) while the window is up, and 'tangent --run SOURCE [file]' does them without a window.
+// One command per line. A node is its number (0 is the first), or . for the focused node, or $ for the newest node. A color is #rrggbb or R G B:
+//   add [X Y [COLOR]]   connect A B   disconnect A B   delete A   text A SOME TEXT (\n for a new line)   color A COLOR   move A X Y   focus A   layout [STEPS] (up to COMMAND_MAX_STEPS)   relayout   save [FILE]
+// Whatever has come in by the start of a frame gets done at once, before that frame's physics & rendering, so it's also one step to undo. The edits go through applyEdit(), so they're journaled & shared like any others
+#define COMMANDS_PER_FRAME (1<<20) // most bytes of commands to read in one frame, so a huge script doesn't freeze the window
+#define COMMAND_MAX_STEPS  10000   // most physics steps one layout command can ask for, for the same reason
+
+int commandFd = -1;
+const char *commandName = NULL;  // (for error messages)
+long commandLine = 0;
+TextBuffer commandInput = {0};   // read but not done yet
+
+char *commandWord(char **s) { // the next word in *s (and moves *s past it), or NULL if there's none
+ char *p = *s + strspn(*s, " \t");
+ if (!*p) return NULL;
+ char *end = p + strcspn(p, " \t");
+ *s = *end ? end+1 : end;
+ *end = 0;
+ return p;
+}
+
+int commandMore(const char *s) { // boolean: are there more words?
+ return s[strspn(s, " \t")] != 0;
+}
+
+int commandNode(char **s, int *id) { // returns 0 if the next word isn't a node
+ char *w = commandWord(s), *end;
+ if (!w) return 0;
+ if      (!strcmp(w,".")) *id = focus;
+ else if (!strcmp(w,"$")) *id = nNodes-1;
+ else {
+  long n = strtol(w, &end, 10);
+  if (*end || end==w || n<0 || n>=nNodes) return 0;
+  *id = n;
+ }
+ return *id >= 0 && *id < nNodes;
+}
+
+int commandFloat(char **s, float *f) {
+ char *w = commandWord(s), *end;
+ if (!w) return 0;
+ *f = strtof(w, &end);
+ return !*end && end!=w && isfinite(*f);
+}
+
+int commandInt(char **s, int *n, int min, int max) { // returns 0 if the next word isn't a whole number from min to max
+ char *w = commandWord(s), *end;
+ if (!w) return 0;
+ errno = 0;
+ long v = strtol(w, &end, 10);
+ if (*end || end==w || errno || v<min || v>max) return 0;
+ *n = v;
+ return 1;
+}
+
+int commandColor(char **s, Edit *e) { // returns 0 if the next words aren't a color
+ char *w = commandWord(s), *end;
+ if (!w) return 0;
+ if (*w == '#') {
+  unsigned long c = strtoul(w+1, &end, 16);
+  if (*end || end-w != 7) return 0;
+  e->r = c>>16;  e->g = c>>8;  e->b = c;
+  return 1;
+ }
+ unsigned char *rgb[3] = {&e->r, &e->g, &e->b};
+ for (int i=0; i<3; i++) {
+  if (i && !(w = commandWord(s))) return 0;
+  long l = strtol(w, &end, 10);
+  if (*end || end==w || l<0 || l>255) return 0;
+  *rgb[i] = l;
+ }
+ return 1;
+}
+
+void commandUnescape(char *s) { // \n \t \\ (in place)
+ char *out = s;
+ for (; *s; s++) {
+  if (*s == '\\' && s[1]) {
+   s++;
+   *out++ = *s=='n' ? '\n' : *s=='t' ? '\t' : *s;
+  } else *out++ = *s;
+ }
+ *out = 0;
+}
+
+const char *runCommand(char *s) { // does one line. Returns NULL, or what was wrong with it
+ char *cmd = commandWord(&s);
+ if (!cmd || *cmd == '#') return NULL; // (blank, or a comment)
+ Edit e = {0};
+ if (!strcmp(cmd,"add")) {
+  e.op = EDIT_ADD;
+  e.r = e.g = e.b = 255;
+  if (commandMore(s)) {
+   if (!commandFloat(&s, &e.x) || !commandFloat(&s, &e.y)) return "add: expected X Y";
+   if (commandMore(s) && !commandColor(&s, &e)) return "add: bad color";
+  } else {
+   int near = focus >= 0 && focus < nNodes ? focus : 0;
+   e.x = nodes[near].x + RND()*0.05f;
+   e.y = nodes[near].y + RND()*0.05f;
+  }
+ }
+ else if (!strcmp(cmd,"connect") || !strcmp(cmd,"disconnect")) {
+  e.op = cmd[0]=='c' ? EDIT_CONNECT : EDIT_DISCONNECT;
+  if (!commandNode(&s, &e.node) || !commandNode(&s, &e.node2)) return "expected two nodes";
+  if (e.node == e.node2) return "can't connect a node to itself";
+ }
+ else if (!strcmp(cmd,"delete")) {
+  e.op = EDIT_DELETE;
+  if (!commandNode(&s, &e.node)) return "delete: expected a node";
+  if (nNodes < 2) return "delete: can't delete the last node";
+ }
+ else if (!strcmp(cmd,"text")) {
+  e.op = EDIT_TEXT;
+  if (!commandNode(&s, &e.node)) return "text: expected a node";
+  commandUnescape(s);
+  e.text = s;
+  e.textLen = strlen(s);
+  if (!applyEdit(&e)) return "text: failed";
+  isModified = 1;
+  return NULL;
+ }
+ else if (!strcmp(cmd,"color")) {
+  e.op = EDIT_COLOR;
+  if (!commandNode(&s, &e.node) || !commandColor(&s, &e)) return "color: expected a node and a color";
+ }
+ else if (!strcmp(cmd,"move")) {
+  e.op = EDIT_MOVE;
+  if (!commandNode(&s, &e.node) || !commandFloat(&s, &e.x) || !commandFloat(&s, &e.y)) return "move: expected a node, X and Y";
+ }
+ else if (!strcmp(cmd,"focus")) {
+  if (!commandNode(&s, &e.node)) return "focus: expected a node";
+  focus = e.node;
+ }
+ else if (!strcmp(cmd,"layout")) {
+  int steps = layoutSteps < COMMAND_MAX_STEPS ? layoutSteps : COMMAND_MAX_STEPS;
+  if (commandMore(s) && !commandInt(&s, &steps, 0, COMMAND_MAX_STEPS)) return "layout: expected a number of steps, up to 10000"; // (COMMAND_MAX_STEPS)
+  for (int i=0; i<steps; i++) simulate();
+ }
+ else if (!strcmp(cmd,"relayout")) {
+  if (!startRelayout()) return "relayout: couldn't start";
+  finishRelayout(1);
+ }
+ else if (!strcmp(cmd,"save")) {
+  char *fn = commandWord(&s);
+  if (!fn && !filename[0]) return "save: the graph has no file name yet";
+  finishSave(1); // (one at a time)
+  if (!startSave(fn ? fn : filename)) return "save: failed";
+  if (fn) snprintf(filename, sizeof(filename), "%s", fn);
+  if (_headless) finishSave(1);
+ }
+ else return "unknown command";
+ if (commandMore(s)) return "too many words";
+ if (!e.op) return NULL;
+ if (!applyEdit(&e)) return e.op == EDIT_ADD ? "add: the graph is full" : "failed";
+ isModified = 1;
+ return NULL;
+}
+
+int runCommands(int final, int *failed) { // does all the complete lines in commandInput (and an unfinished last one too, if final). Returns how many it did
+ if (final && commandInput.n && commandInput.p[commandInput.n-1] != '\n') tb_add(&commandInput, "\n", 1);
+ char *p = commandInput.p, *end = p + commandInput.n, *nl;
+ int n = 0;
+ for (; p < end && (nl = memchr(p, '\n', end-p)); p = nl+1, n++) {
+  *nl = 0;
+  if (nl > p && nl[-1] == '\r') nl[-1] = 0;
+  commandLine++;
+  const char *why = runCommand(p);
+  if (why) { fprintf(stderr, "%s:%ld: %s\n", commandName, commandLine, why); (*failed)++; }
+ }
+ commandInput.n = end - p;
+ memmove(commandInput.p, p, commandInput.n);
+ return n;
+}
+
+int openCommands(const char *path, int wait) { // wait: boolean: read with blocking reads (no window to keep going). Returns 0 on failure
+ commandName = path;
+ commandLine = 0;
+ if (!strcmp(path, "-")) { commandName = "stdin"; commandFd = 0; return 1; }
+ struct stat st;
+ int fifo = !wait && !stat(path, &st) && S_ISFIFO(st.st_mode);
+ commandFd = open(path, (fifo ? O_RDWR : O_RDONLY) | O_CLOEXEC); // (a named pipe that we also have open for writing never ends, so there can be any number of writers, one after another)
+ if (commandFd < 0) { perror(path); return 0; }
+ return 1;
+}
+
+void closeCommands() {
+ if (commandFd > 0) close(commandFd);
+ commandFd = -1;
+ free(commandInput.p);
+ memset(&commandInput, 0, sizeof(commandInput));
+}
+
+void pollCommands() { // (every frame) does the commands that came since the last frame, without waiting for more
+ if (commandFd < 0 || loading) return;
+ char buf[1<<16];
+ size_t total = 0;
+ int ended = 0, failed = 0;
+ struct pollfd pfd = {commandFd, POLLIN};
+ while (total < COMMANDS_PER_FRAME && poll(&pfd, 1, 0) > 0) {
+  ssize_t n = read(commandFd, buf, sizeof(buf));
+  if (n < 0 && errno == EINTR) continue;
+  if (n <= 0 || !tb_add(&commandInput, buf, n)) { ended = 1; break; }
+  total += n;
+ }
+ int n = runCommands(ended, &failed);
+ if (focus < 0 || focus >= nNodes) focus = nodeNearest(viewX, viewY); // (it got deleted)
+ if (failed) message_printf("%d of %d commands from %s failed (see the terminal)", failed, n, commandName);
+ else if (n) message_printf("Did %d command%s from %s", n, n==1 ? "" : "s", commandName);
+ if (ended) {
+  closeCommands();
+  printf("End of commands from %s\n", commandName);
+ }
+}
+
+int runScript(const char *path, const char *file) { // --run: does the commands without a window, then quits. Returns the exit code
+ if (file && !(startLoading(file, 1) && continueLoading(1) == LOAD_DONE)) { fprintf(stderr, "Couldn't load %s\n", file); return 1; }
+ if (nNodes < 1) addRootNode();
+ if (!openCommands(path, 1)) return 1;
+ undoMuted = 1; // (nobody's going to undo anything)
+ int failed = 0;
+ char buf[1<<16];
+ while (1) { // each read is one batch: whatever the writer has written so far
+  ssize_t n = read(commandFd, buf, sizeof(buf));
+  if (n < 0 && errno == EINTR) continue;
+  if (n <= 0 || !tb_add(&commandInput, buf, n)) break;
+  runCommands(0, &failed);
+ }
+ runCommands(1, &failed);
+ closeCommands();
+ finishSave(1);
+ finishCompaction(); // (a 'save' may have started one. pre_init() exits straight after this, without done())
+ if (filename[0] && isModified) { // the edits are in the journal already, but that's no use to anything else that reads the file: write it out, and start the journal over
+  if (saveToFile(filename)) journalStart(filename, 0);
+  else { fprintf(stderr, "Couldn't save to %s (the edits are in its journal)\n", filename);  failed = 1; }
  }
+ else if (isModified) fprintf(stderr, "Not saved anywhere: the commands didn't include 'save FILE'\n");
+ return failed ? 1 : 0;
 }
 
+// EDITING node text happens in a text editor, on a file per node in a temp directory. The file monitor thread waits (with inotify) for
+// an editor to save one, reads it, lays it out and queues it; the main thread picks it up in applyEditedTexts()
+char editDir[] = "/tmp/tangent-edit-XXXXXX";
+int  editWatch = -1;     // inotify fd on editDir, or -1 if editing isn't available
+unsigned editSerial = 0; // (every session gets a new file name, so a late save for an ended session can't land on another node)
 
+typedef struct { unsigned serial; char *text; int nTextLevels; TQ_Drawable textRenders[MAXTEXTLEVELS]; } EditedText;
+#define EDIT_QUEUE_SIZE 16
+EditedText *editQueue[EDIT_QUEUE_SIZE]; // lock-free: only the file monitor thread adds (editQueueIn), only the main thread takes (editQueueOut)
+volatile unsigned editQueueIn = 0, editQueueOut = 0;
 
-int loadFile(const char *filename) { // TODO: respond more robustly (i.e. to avoid segfault when trying to load an invalid file)
- int success = 0;
- FILE *f = fopen(filename, "r");
- if (f) {
-  if (fscanf(f,"view:\nf=%d\nnodes:\n",&focus)>0) {
-   // clear existing data
-   for (int i=0; i<nNodes; i++) {
-    eraseNodeText(i);
-    nodes[i].x = RND();
-    nodes[i].y = RND();
-   }
-   nNodes = nLinks = 0;
-   // read nodes from file
-   for (int i=0; i<MAXNODES; i++) {
-    int id; int r,g,b; char c;
-    if (fscanf(f, "i=%d c=%02X%02X%02X t=\"", &id, &r, &g, &b)>0) {
-     if (id >= 0 && id < MAXNODES) {
-      nodes[id].r=r; nodes[id].g=g; nodes[id].b=b; nodes[i].flags=0; // TODO: decide how to fit 'flags' into the file format. probably f=XX, with 'XX' being hex digits. Also, don't forget to add 'isModified=1' to the 'M' keystroke afterwards.
-      if (nNodes <= id) nNodes = id+1;
-      size_t size;
-      FILE *ss = open_memstream(&nodes[id].text, &size);
-      while (1) {
-       c = fgetc(f);
-       if (c == '\"' || c == EOF) break;
-       if (c == '\\') {
-        c = fgetc(f);
-        if      (c == EOF) break;
-        if      (c == '\"') fputc('\"',ss);
-        else if (c == 'n' ) fputc('\n',ss);
-        else if (c == '\\') fputc('\\',ss);
-        else {
-         fputc('\\',ss);
-         fputc(c, ss);
-        }
-       } else fputc(c, ss);
-      } fclose(ss);
-     }
-    } else i=MAXNODES; // reached the line "connections:" so end this for-loop
-    while ((c=fgetc(f)) != '\n' && c != EOF); // skip to the next line
-   }
-   // read the list of connections from file
-   for (int i=0; i<MAXLINKS; i++, nLinks++) {
-    int a,b;
-    if (fscanf(f,"a=%d b=%d\n",&a,&b)==2) {
-     links[i].from = a;
-     links[i].to   = b;
-    } else break;
-   } success=1;
-  }
-  fclose(f);
-  if (success) {
-   for (int i=0; i<nNodes; i++) genNodeTextRenders(i); // this is done here instead of earlier, because it might need a lot of memory. fclose() would have freed some
-   printf("Opened file %s\n", filename);
-   isModified = 0;
-   mark = toDrag = monitorEditNode = -1;
-   glutSetWindowTitle(filename);
-  } else printf("Invalid file %s\n", filename);
- } else perror(filename); // XXX: i dont like the inconsistancy of what goes to stdout vs stderr vs main screen. Also the inconsistancy of which functions are responsible for such printing (like what about the puts() calls in draw()). Need to decide on a proper schema for this.
- return success;
+void editFileName(char *fn, size_t size, unsigned serial) {
+ snprintf(fn, size, "%s/text%u.txt", editDir, serial);
 }
 
-
-
-
+void endEditSession(EditSession *s) { // (the editor may still be open, but what it saves won't go anywhere)
+ char fn[64];
+ editFileName(fn, sizeof(fn), s->serial);
+ unlink(fn);
+ s->node = -1;
+}
 
 void editTextNode(int id) {
  if (id<0) return;
+ if (editWatch < 0) { message("Can't edit node: can't watch for changes"); return; }
  const char *editor_names[] = {"leafpad","defaulttexteditor","gedit","geany","kate","notepad++","notepad","wordpad","nano","pico","vim","vi","emacs",NULL};
- FILE *f = fopen(monitorFileName, "w");
- if (f) {
-  if (nodes[id].text) fputs(nodes[id].text, f);
-  fclose(f);
-  struct stat st;
-  stat(monitorFileName, &st);
-  monitorFileTime = st.st_mtim;
-  monitorEditNode = id;
-  if (fork()==0) {
-   for (int i=0; editor_names[i]; i++) execlp(editor_names[0], editor_names[0], monitorFileName, (char*)NULL);
-   printf("Can't edit node: No text editor found.\n");
-   exit(1);
-  }
+ EditSession *s = NULL;
+ for (int i=0; i<MAX_EDIT_SESSIONS && !s; i++) if (editSessions[i].node == id) s = &editSessions[i]; // (editing it again starts it over)
+ for (int i=0; i<MAX_EDIT_SESSIONS && !s; i++) if (editSessions[i].node < 0) s = &editSessions[i];
+ if (!s) { // all in use: take over the oldest
+  s = &editSessions[0];
+  for (int i=1; i<MAX_EDIT_SESSIONS; i++) if (editSessions[i].serial < s->serial) s = &editSessions[i];
  }
- else {} // TODO: handle error case
+ if (s->node >= 0) endEditSession(s);
+ s->node = id; s->serial = ++editSerial; s->editor = 0; s->saved = 0;
+ char fn[64];
+ editFileName(fn, sizeof(fn), s->serial);
+ FILE *f = fopen(fn, "w");
+ if (!f) { perror(fn); message("Can't edit node: couldn't write its text to a file"); s->node = -1; return; }
+ if (nodeText(id)) fputs(nodeText(id), f);
+ fclose(f);
+ for (int i=0; editor_names[i]; i++) {
+  char *argv[] = {(char*)editor_names[i], fn, NULL};
+  if (posix_spawnp(&s->editor, editor_names[i], NULL, NULL, argv, environ) == 0) return;
+ }
+ printf("Can't edit node: No text editor found.\n");
+ message("Can't edit node: No text editor found");
+ s->editor = 0;
+ endEditSession(s);
+}
+
+EditedText *readEditedText(unsigned serial) { // (file monitor thread) NULL if it can't be read
+ char fn[64];
+ editFileName(fn, sizeof(fn), serial);
+ FILE *f = fopen(fn, "rb");
+ if (!f) return NULL; // (e.g. its session has ended)
+ struct stat st;
+ EditedText *et = calloc(1, sizeof(EditedText));
+ if (!et || fstat(fileno(f), &st) || !(et->text = malloc(st.st_size+1))) { free(et); fclose(f); return NULL; }
+ et->text[fread(et->text, 1, st.st_size, f)] = '\0';
+ fclose(f);
+ et->serial = serial;
+ et->nTextLevels = layoutText(et->text, et->textRenders); // (the slow part - better here than in a frame)
+ return et;
 }
 
-void *fileMonitor(void *ptr) { // pthread
+void *fileMonitor(void *ptr) { // pthread: hands text saved in a text editor to the main thread
+ char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
  while (1) {
-  if (monitorEditNode >= 0) {
-   struct stat st;
-   stat(monitorFileName, &st);
-   if (st.st_mtim.tv_sec != monitorFileTime.tv_sec || st.st_mtim.tv_nsec != monitorFileTime.tv_nsec) {
-    char *str = malloc(st.st_size+1);
-    if (!str) return NULL;        // TODO: handle error case
-    FILE *f = fopen(monitorFileName, "r");
-    if(!f){free(str);return NULL;}// TODO: handle error case
-    int n = fread(str, 1, st.st_size, f);
-    str[n]=0;
-    fclose(f);
-    eraseNodeText(monitorEditNode);
-    nodes[monitorEditNode].text = str;
-    genNodeTextRenders(monitorEditNode);
-    monitorFileTime = st.st_mtim;
-    monitorEditNode = -1;
-    message("Edit was confirmed - make sure you closed the text editor now.");
-   }
-  } sleep(1);
+  ssize_t n = read(editWatch, buf, sizeof(buf)); // (sleeps until something in editDir is saved)
+  if (n < 0 && errno == EINTR) continue;
+  if (n <= 0) return NULL;
+  for (char *p = buf; p < buf+n; ) {
+   const struct inotify_event *ev = (const struct inotify_event*)p;
+   p += sizeof(struct inotify_event) + ev->len;
+   unsigned serial; int end = 0;
+   if (!ev->len || sscanf(ev->name, "text%u.txt%n", &serial, &end) != 1 || ev->name[end]) continue; // (editors' swap & backup files)
+   EditedText *et = readEditedText(serial);
+   if (!et) continue;
+   while (editQueueIn - editQueueOut == EDIT_QUEUE_SIZE) usleep(10000); // (full - the main thread is busy)
+   editQueue[editQueueIn % EDIT_QUEUE_SIZE] = et;
+   __sync_synchronize();
+   editQueueIn++;
+  }
+ }
+}
+
+void startFileMonitor() {
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) editSessions[i].node = -1;
+ if (!mkdtemp(editDir) || (editWatch = inotify_init1(IN_CLOEXEC)) < 0) { perror("Can't edit node text"); return; }
+ if (inotify_add_watch(editWatch, editDir, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) { // (IN_MOVED_TO: editors that save to a temp file and rename it)
+  perror("Can't edit node text");
+  close(editWatch); editWatch = -1;
+  return;
+ }
+ pthread_t fm;
+ pthread_create(&fm, NULL, fileMonitor, NULL);
+}
+
+void applyEditedTexts() { // (main thread, every frame)
+ while (editQueueOut != editQueueIn) {
+  __sync_synchronize();
+  EditedText *et = editQueue[editQueueOut % EDIT_QUEUE_SIZE];
+  __sync_synchronize();
+  editQueueOut++;
+  EditSession *s = NULL;
+  for (int i=0; i<MAX_EDIT_SESSIONS; i++) if (editSessions[i].node >= 0 && editSessions[i].serial == et->serial) s = &editSessions[i];
+  const char *old = s ? nodeText(s->node) : NULL;
+  if (s && strcmp(et->text, old ? old : "")) { // (not our own writing of the file, or a save without changes)
+   setNodeText(s->node, et->text);
+   memcpy(nodes[s->node].textRenders, et->textRenders, sizeof(et->textRenders));
+   nodes[s->node].nTextLevels = et->nTextLevels;
+   isModified = 1;
+   s->saved = 1;
+   message("Node text updated");
+   if (!s->editor) endEditSession(s); // (its editor had already exited - see below)
+  } else {
+   free(et->text);
+   for (int tl=0; tl<et->nTextLevels; tl++) tq_delete(&et->textRenders[tl]);
+  }
+  free(et);
+ }
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) { // editors that have been closed
+  EditSession *s = &editSessions[i];
+  if (s->node < 0 || s->editor <= 0 || waitpid(s->editor, NULL, WNOHANG) != s->editor) continue;
+  s->editor = 0;
+  if (s->saved) endEditSession(s);
+  // else it may just have handed the file to an instance that was already running (gedit etc), so keep watching until it's saved
  }
 }
 
@@ -375,26 +3752,139 @@ void *fileMonitor(void *ptr) { // pthread
 //////////////////////////////////////////////////////
 // MAIN PROGRAM ENTRY POINTS: init(), draw(), done() :                         [see fullscreen_main.h for more details]
 
+int benchmarkIO(const char *file) { // times the loader & saver for this file's format (without generating text renders etc)
+ int binary = isBinaryFile(file);
+ struct stat st;
+ if (stat(file, &st)) { perror(file); return 1; }
+ double mb = st.st_size / 1e6;
+ int n = 0;
+ double t0 = secondsNow(), t = 0;
+ while (n < 3 || t < 1.0) {
+  if (!loadFile(file)) { printf("Invalid file %s\n", file); return 1; }
+  n++; t = secondsNow()-t0;
+ }
+ printf("%s format, %.1f MB, %d nodes, %d links\n", binary?"binary":"text", mb, nNodes, nLinks);
+ printf("load: %8.1f MB/s  (%.2f ms)\n", mb*n/t, 1e3*t/n);
+ char tmp[] = "/tmp/tangent-bench-XXXXXX";
+ int fd = mkstemp(tmp);
+ if (fd < 0) { perror(tmp); return 1; }
+ close(fd);
+ n = 0; t0 = secondsNow(); t = 0;
+ while (n < 3 || t < 1.0) {
+  Snapshot *sn = takeSnapshot();
+  int ok = sn && (binary ? saveBinaryFile(tmp, sn) : saveTextFile(tmp, sn));
+  freeSnapshot(sn);
+  if (!ok) { unlink(tmp); return 1; }
+  n++; t = secondsNow()-t0;
+ }
+ stat(tmp, &st);
+ unlink(tmp);
+ printf("save: %8.1f MB/s  (%.2f ms)\n", st.st_size/1e6*n/t, 1e3*t/n);
+ return 0;
+}
+
+#define USAGE "Usage: %s [options] [file]\n" \
+ "Options:\n" \
+ " --render out.png   Don't open a window. Lay out the graph, write a picture of it, and quit\n" \
+ " --size WxH         Resolution for --render and --bench-render (default 1920x1080)\n" \
+ " --tile N           Render in tiles of at most NxN pixels (default 2048). Allows pictures bigger than the GPU can do at once\n" \
+ " --steps N          Physics steps to run before rendering (default 500)\n" \
+ " --bench-render N   Don't open a window. Time N frames of physics+rendering and report ms per frame\n" \
+ " --convert IN OUT   Convert a graph file between the text and binary formats, and quit. OUT is binary if it's named *" BINARY_EXTENSION "\n" \
+ "                    IN can also be an edge list (.tsv .csv), Graphviz (.dot .gv) or GraphML (.graphml) file, of any size\n" \
+ " --bench-io FILE    Measure how fast FILE loads and saves, in MB/s, and quit\n" \
+ " --serve SOCKET     Don't open a window. Share the graph (file, if given) with everyone who joins at SOCKET, until interrupted\n" \
+ " --join SOCKET      Edit a graph that's being shared at SOCKET\n" \
+ " --commands SOURCE  Take commands (add, connect, text, save etc) from SOURCE while running: a file, a named pipe, or - for stdin\n" \
+ " --run SOURCE       Don't open a window. Do the commands from SOURCE to the graph (file, if given), save it, and quit\n" \
+ " --hops N           Start with only the nodes within N connections of the focus showing (like pressing H)\n" \
+ " --physics-budget MS  Physics time per frame, in ms (default %g). Several steps when they're cheap, the repelling spread over frames when not\n" \
+ "                    0 means exactly one step per frame, the default for --bench-render, and always for --record and --replay\n" \
+ " --adaptive         Start with adaptive steps (like pressing I): the layout settles in fewer steps. --render and --bench-render say how many\n" \
+ " --arrowheads       Start with connections' arrowheads pushing nodes away (like pressing A)\n" \
+ " --seed N           Seed for the random numbers (default 1). The same seed and the same input do the same thing, for reproducing bugs & benchmarks\n" \
+ " --record FILE      Write every key press and mouse movement to FILE, with the frame it happened on\n" \
+ " --replay FILE      Don't open a window. Play back a --record'ed session (give it the graph file as it was when recording started; it won't be changed), timing every frame\n" \
+ " --undo-memory MB   How much memory the undo history can use (default %d). The oldest edits get forgotten past that\n"
+
+void pre_init() { // parse the command line
+ for (int i=1; i<_global_argc; i++) {
+  const char *arg = _global_argv[i];
+  const char *val = i+1 < _global_argc ? _global_argv[i+1] : NULL;
+  int ok = 1;
+  if      (!strcmp(arg,"--render")      && val) { renderToFile = val; i++; }
+  else if (!strcmp(arg,"--size")        && val) { ok = sscanf(val, "%dx%d", &renderWidth, &renderHeight)==2 && renderWidth>0 && renderHeight>0; i++; }
+  else if (!strcmp(arg,"--tile")        && val) { ok = sscanf(val, "%d", &renderTile)==1 && renderTile>0; i++; }
+  else if (!strcmp(arg,"--steps")       && val) { ok = sscanf(val, "%d", &layoutSteps)==1 && layoutSteps>=0; i++; }
+  else if (!strcmp(arg,"--bench-render")&& val) { ok = sscanf(val, "%d", &benchFrames)==1 && benchFrames>0; i++; }
+  else if (!strcmp(arg,"--convert") && i+2 < _global_argc) { convertFrom = val; convertTo = _global_argv[i+2]; i+=2; }
+  else if (!strcmp(arg,"--bench-io")    && val) { benchIOFile = val; i++; }
+  else if (!strcmp(arg,"--serve")       && val) { serveSocket = val; i++; }
+  else if (!strcmp(arg,"--join")        && val) { joinSocket = val; i++; }
+  else if (!strcmp(arg,"--commands")    && val) { commandSource = val; i++; }
+  else if (!strcmp(arg,"--run")         && val) { runSource = val; i++; }
+  else if (!strcmp(arg,"--hops")        && val) { ok = sscanf(val, "%d", &hopRange)==1 && hopRange>0 && hopRange<256; hopMode = 1; i++; }
+  else if (!strcmp(arg,"--physics-budget") && val) { ok = sscanf(val, "%f", &physicsBudget)==1 && physicsBudget>=0; i++; }
+  else if (!strcmp(arg,"--adaptive"))           adaptiveSteps = 1;
+  else if (!strcmp(arg,"--arrowheads"))         repelArrowheads = 1;
+  else if (!strcmp(arg,"--seed")        && val) { unsigned long long seed; ok = sscanf(val, "%llu", &seed)==1; rnd_seed(seed); i++; }
+  else if (!strcmp(arg,"--record")      && val) { _record_file = val; i++; }
+  else if (!strcmp(arg,"--replay")      && val) { _replay_file = val; i++; }
+  else if (!strcmp(arg,"--undo-memory") && val) { int mb; ok = sscanf(val, "%d", &mb)==1 && mb>=0; undoMemoryLimit = (size_t)mb<<20; i++; }
+  else if (arg[0]=='-' || argFile) ok = 0;
+  else argFile = arg;
+  if (!ok) {
+   fprintf(stderr, USAGE, _global_argv[0], PHYSICS_BUDGET_MS, UNDO_MEMORY_LIMIT>>20);
+   _exit_the_program = 1;
+   return;
+  }
+ }
+ if (convertFrom) { // no graphics needed at all
+  _headless = 1;
+  if (importFormat(convertFrom)) exit(importGraph(convertFrom, convertTo, wantsBinaryFormat(convertTo)) ? 0 : 1); // (streamed, so it's not limited to MAXNODES)
+  int ok = loadFile(convertFrom);
+  if (ok) journalReplay(convertFrom); // (read-only)
+  exit(ok && saveToFile(convertTo) ? 0 : 1);
+ }
+ if (benchIOFile) {
+  _headless = 1;
+  exit(benchmarkIO(benchIOFile));
+ }
+ if (serveSocket) {
+  _headless = 1;
+  exit(serveGraph(serveSocket, argFile));
+ }
+ if (runSource) {
+  _headless = 1;
+  exit(runScript(runSource, argFile));
+ }
+ if (renderToFile || benchFrames || _replay_file) {
+  _headless = 1;
+  readOnly = 1;
+  _screen_x = renderWidth;
+  _screen_y = renderHeight;
+ }
+ if (physicsBudget < 0) physicsBudget = _headless ? 0.f : PHYSICS_BUDGET_MS;
+ if ((_record_file || _replay_file) && physicsBudget > 0) { // a replay has to do exactly the same steps as the recording did, whatever the timing
+  if (_record_file) printf("Recording: one physics step per frame (--physics-budget doesn't apply), so the session can be replayed exactly\n");
+  physicsBudget = 0.f;
+ }
+}
+
 void init() {
  tq_init();
  show_mouse();
  memset(nodes, 0, sizeof(nodes)); // this also initializes any pointers to NULL, so it's safe to call free() on them at any time
  memset(links, -1,sizeof(links)); // -1 is safe, will be interpereted as 'not a link'
- if (_global_argc==2) {
-  loadFile(_global_argv[1]);
-  strcpy(filename, _global_argv[1]);
-  // message_printf("Opened file: %s", filename);
- }
- if (nNodes < 1) {
-  // add root node
-  nodes[nNodes].size = 0.04f;
-  nodes[nNodes].r = 255;
-  nodes[nNodes].g = 255;
-  nodes[nNodes].b = 255;
-  nNodes++;
- }
- pthread_t fm; // file monitor thread (for editing a node)
- pthread_create(&fm,NULL,fileMonitor,NULL);
+ if (argFile) {
+  openGraph(argFile);
+  if (_headless) continueLoading(1); // (no frames to load it over)
+ }
+ if (nNodes < 1 && !loading) addRootNode();
+ undoClear();
+ if (joinSocket && !collabJoin(joinSocket)) message_printf("Couldn't join %s", joinSocket);
+ if (commandSource && !openCommands(commandSource, 0)) message_printf("Couldn't read commands from %s", commandSource);
+ startFileMonitor(); // (for editing node text)
  #ifdef USE_MULTISAMPLING
  glLineWidth(2.5f);
  #endif
@@ -406,8 +3896,24 @@ void init() {
 
 
 
+void simulate();
+void render();
+
 void draw() {
- static int state=0; // states: 0 = default behavior; 1 = asking whether to save changes before opening another file; 2 = answered yes; 3 = answered no; 4 = asking whether to save changes before quitting; 5 = answered yes; 6 = answered no
+ static int state=0; // states: 0 = default behavior; 1 = asking whether to save changes before opening another file; 2 = answered yes; 3 = answered no; 4 = asking whether to save changes before quitting; 5 = answered yes; 6 = answered no; 7 = waiting for the 'save as' dialog before asking what to open; 8 = waiting for it before quitting
+
+ finishSave(0); // (if a background save just finished)
+ continueLoading(0);
+ finishRelayout(0); // (gliding to a new layout, if any)
+ undoCheckpoint(); // (each frame's edits are one step to undo)
+ collabPoll();
+ pollCommands();
+ searchIndexStep();
+ applyEditedTexts();
+ switch (pollFileDialog()) {
+  case DIALOG_SAVE_AS: if (startSave(fileDialog.answer)) strcpy(filename, fileDialog.answer); break;
+  case DIALOG_OPEN:    if (!openGraph(fileDialog.answer)) message_printf("Failed: Couldn't load '%s'", fileDialog.answer); break;
+ }
 
  // The "Save changes?" dialogs only:
  if (state==1 || state==4) {
@@ -434,9 +3940,28 @@ void draw() {
 
  //==User input==
 
+ // while a file is loading, you can look around but not change anything (the graph isn't all there yet)
+ if (loading) {
+  static const unsigned char editKeys[] = {'N','E','C','D','M','+','=','-','S','O',127,15,19,25,26};
+  static const unsigned char editSpecialKeys[] = {GLUT_KEY_INSERT, GLUT_KEY_F5, GLUT_KEY_F6};
+  int tried = (keymap['F']==KEY_FRESHLY_PRESSED && (_key_mod & GLUT_ACTIVE_SHIFT));
+  if (tried) keymap['F'] = 0;
+  for (size_t i=0; i<sizeof(editKeys); i++)        { tried |= keymap[editKeys[i]]==KEY_FRESHLY_PRESSED;                 keymap[editKeys[i]] = 0; }
+  for (size_t i=0; i<sizeof(editSpecialKeys); i++) { tried |= special_keymap[editSpecialKeys[i]]==KEY_FRESHLY_PRESSED; special_keymap[editSpecialKeys[i]] = 0; }
+  if (tried) message("Still loading - try again in a moment");
+ }
+
+ // search node text (Ctrl-F). While searching, the keys type the query instead
+ if (keymap[6]==KEY_FRESHLY_PRESSED && !searching) {
+  searching = 1;
+  searchFind(searchQuery); // (the last search, if any, is still there)
+  searchShow();
+ }
+ if (searching) searchKeys();
+
  // select node (Left click)
  if (_mouse_button_map[0]==KEY_FRESHLY_PRESSED) {
-  int selected = nodeNearest(_mouse_x, _mouse_y);
+  int selected = nodeNearest(worldX(_mouse_x), worldY(_mouse_y));
   if ((_key_mod & GLUT_ACTIVE_SHIFT)) { // shift+click
    if (mark==selected) mark = -1;
    else mark=selected;
@@ -444,13 +3969,37 @@ void draw() {
  }
 
  // drag node (Right click)
- if (_mouse_button_map[2]==KEY_FRESHLY_PRESSED) toDrag = nodeNearest(_mouse_x, _mouse_y);
+ static float dragFromX, dragFromY; // where it was picked up (for undo)
+ if (_mouse_button_map[2]==KEY_FRESHLY_PRESSED) {
+  toDrag = nodeNearest(worldX(_mouse_x), worldY(_mouse_y));
+  dragFromX = nodes[toDrag].x;  dragFromY = nodes[toDrag].y;
+ }
  if (_mouse_button_map[2]) {
   if (toDrag >= 0) {
-   nodes[toDrag].x = _mouse_x;
-   nodes[toDrag].y = _mouse_y;
+   nodes[toDrag].x = worldX(_mouse_x);
+   nodes[toDrag].y = worldY(_mouse_y);
   }
- } else toDrag = -1;
+ } else {
+  if (toDrag >= 0) { // record where it was dropped
+   float x = nodes[toDrag].x, y = nodes[toDrag].y;
+   nodes[toDrag].x = dragFromX;  nodes[toDrag].y = dragFromY;
+   moveNode(toDrag, x, y);
+  }
+  toDrag = -1;
+ }
+
+ // undo (Ctrl-Z), redo (Ctrl-Y or Ctrl-Shift-Z)
+ int redoKey = keymap[25]==KEY_FRESHLY_PRESSED || ((_key_mod & GLUT_ACTIVE_CTRL) && keymap['Y']==KEY_FRESHLY_PRESSED);
+ int undoKey = keymap[26]==KEY_FRESHLY_PRESSED || ((_key_mod & GLUT_ACTIVE_CTRL) && keymap['Z']==KEY_FRESHLY_PRESSED);
+ if (undoKey && (_key_mod & GLUT_ACTIVE_SHIFT)) { undoKey = 0; redoKey = 1; }
+ if (undoKey || redoKey) {
+  if (undoKey ? undo() : redo()) {
+   if (focus < 0 || focus >= nNodes) focus = nodeNearest(viewX, viewY); // (it was the node that went away)
+   if (mark >= nNodes) mark = -1;
+   isModified=1;
+   message(undoKey ? "Undone" : "Redone");
+  } else message(undoKey ? "Nothing to undo" : "Nothing to redo");
+ }
 
  // mark current node (Spacebar)
  if (keymap[' ']==KEY_FRESHLY_PRESSED) {
@@ -460,12 +4009,9 @@ void draw() {
 
  // new node (N)
  if (keymap['N']==KEY_FRESHLY_PRESSED) {
+  int before = nNodes;
   addNodeFrom(focus); isModified=1; message("New node added");
-  if ((_key_mod & GLUT_ACTIVE_SHIFT)) { // Shift+N
-   int f = links[nLinks-1].from;
-   links[nLinks-1].from = links[nLinks-1].to;
-   links[nLinks-1].to = f;
-  }
+  if ((_key_mod & GLUT_ACTIVE_SHIFT) && nNodes > before) connectNodes(nNodes-1, focus); // Shift+N: flip the new connection
  }
 
  // edit node text (E)
@@ -483,9 +4029,10 @@ void draw() {
  if (keymap['D']==KEY_FRESHLY_PRESSED && mark >= 0 && mark != focus)
  {
   if (keymap['C']) {// special behavior: hold C and press D: connect the two nodes but disconnect the mark from other nodes
-   for (int i=0; i<nLinks; i++) if (links[i].to==mark || links[i].from==mark) links[i--] = links[--nLinks];
+   for (int i=0; i<nLinks; i++) if (links[i].to==mark || links[i].from==mark) { disconnectNodes(links[i].from, links[i].to); i--; }
    message("Connected, and removed other connections");
    connectNodes(focus, mark);
+   isModified=1;
   } else {          // default behavior: disconnect the two nodes:
    disconnectNodes(focus, mark);
    message("Disconnected");
@@ -497,20 +4044,16 @@ void draw() {
  if (keymap['F']==KEY_FRESHLY_PRESSED && mark >= 0 && mark != focus) {
   int f=focus; focus=mark; mark=f;
   if ((_key_mod & GLUT_ACTIVE_SHIFT)) {
-   Node n=nodes[focus]; nodes[focus]=nodes[mark]; nodes[mark]=n;
+   swapNodes(focus, mark);
+   isModified=1;
    message("Swapped the two nodes");
   } else message("Flipped selection/mark");
  }
 
  // insert node between 'mark' and 'focus' (Insert)
  if (special_keymap[GLUT_KEY_INSERT]==KEY_FRESHLY_PRESSED && focus >= 0 && mark >= 0 && nNodes < MAXNODES) {
-  int id = nNodes++;
-  nodes[id].x = 0.5f*(nodes[mark].x + nodes[focus].x);
-  nodes[id].y = 0.5f*(nodes[mark].y + nodes[focus].y);
-  nodes[id].r = 0.5f*(nodes[mark].r + nodes[focus].r);
-  nodes[id].g = 0.5f*(nodes[mark].g + nodes[focus].g);
-  nodes[id].b = 0.5f*(nodes[mark].b + nodes[focus].b);
-  nodes[id].flags = FLAG_MINIMAXED;
+  int id = newNode(0.5f*(nodes[mark].x + nodes[focus].x), 0.5f*(nodes[mark].y + nodes[focus].y),
+                   0.5f*(nodes[mark].r + nodes[focus].r), 0.5f*(nodes[mark].g + nodes[focus].g), 0.5f*(nodes[mark].b + nodes[focus].b), FLAG_MINIMAXED);
   disconnectNodes(mark, focus);
   if ((_key_mod & GLUT_ACTIVE_SHIFT)) {
    connectNodes(mark, id);
@@ -527,18 +4070,14 @@ void draw() {
  // delete node (Delete)
  if (keymap[127]==KEY_FRESHLY_PRESSED && nNodes>1) {
   deleteNode(focus);
-  focus = nodeNearest(0,0);
+  focus = nodeNearest(viewX, viewY);
   isModified=1;
   message("Deleted node");
  }
 
  // new orphaned node (+)
  if (keymap['+']==KEY_FRESHLY_PRESSED && nNodes < MAXNODES) {
-  int id = nNodes++;
-  nodes[id].x = _mouse_x;
-  nodes[id].y = _mouse_y;
-  nodes[id].r = nodes[id].g = nodes[id].b = 255;
-  nodes[id].flags = 0;
+  int id = newNode(worldX(_mouse_x), worldY(_mouse_y), 255, 255, 255, 0);
   focus = id;
   editTextNode(id);
   isModified=1;
@@ -550,40 +4089,44 @@ void draw() {
  if (colorDelta) {
   if (keymap['R']) {
    int l = nodes[focus].r + colorDelta;  if (l<0) l=0; else if (l>255) l=255;
-   nodes[focus].r = l;                   isModified=1;
+   if (l != nodes[focus].r) { Node *n = &nodes[focus]; setNodeColor(focus, l, n->g, n->b); isModified=1; }
   }
   if (keymap['G']) {
    int l = nodes[focus].g + colorDelta;  if (l<0) l=0; else if (l>255) l=255;
-   nodes[focus].g = l;                   isModified=1;
+   if (l != nodes[focus].g) { Node *n = &nodes[focus]; setNodeColor(focus, n->r, l, n->b); isModified=1; }
   }
   if (keymap['B']) {
    int l = nodes[focus].b + colorDelta;  if (l<0) l=0; else if (l>255) l=255;
-   nodes[focus].b = l;                   isModified=1;
+   if (l != nodes[focus].b) { Node *n = &nodes[focus]; setNodeColor(focus, n->r, n->g, l); isModified=1; }
   }
   message_printf("Node color: # %02X %02X %02X", nodes[focus].r, nodes[focus].g, nodes[focus].b); // XXX: since this is called at every frame (not just once per keystroke like the others are), would all the malloc() and free() involved in message_printf() and tq_line_centered()  eventually cause memory fragmentation?
  }
  
  // set node size mode (M)
  if (keymap['M']==KEY_FRESHLY_PRESSED) {
-  nodes[focus].flags ^= FLAG_MINIMAXED;
+  setNodeFlags(focus, nodes[focus].flags ^ FLAG_MINIMAXED);
   if ((nodes[focus].flags & FLAG_MINIMAXED)) message("Size: Minimum for most text");
   else message("Size: Auto");
  }
  
  // select a node using arrow keys
- static float selectorX = 0.f, selectorY = 0.f;
  if (special_keymap[GLUT_KEY_LEFT]||special_keymap[GLUT_KEY_RIGHT]||special_keymap[GLUT_KEY_DOWN]||special_keymap[GLUT_KEY_UP]) {
-  if (special_keymap[GLUT_KEY_LEFT ]) selectorX -= 0.02f;
-  if (special_keymap[GLUT_KEY_RIGHT]) selectorX += 0.02f;
-  if (special_keymap[GLUT_KEY_DOWN ]) selectorY -= 0.02f;
-  if (special_keymap[GLUT_KEY_UP   ]) selectorY += 0.02f;
+  if (!selecting) { selecting = 1; selectorX = viewX; selectorY = viewY; }
+  if (special_keymap[GLUT_KEY_LEFT ]) selectorX -= 0.02f/viewZoom;
+  if (special_keymap[GLUT_KEY_RIGHT]) selectorX += 0.02f/viewZoom;
+  if (special_keymap[GLUT_KEY_DOWN ]) selectorY -= 0.02f/viewZoom;
+  if (special_keymap[GLUT_KEY_UP   ]) selectorY += 0.02f/viewZoom;
   int selected = nodeNearest(selectorX, selectorY);
   if ((_key_mod & GLUT_ACTIVE_SHIFT)) mark = selected; else focus = selected;
- } else selectorX = selectorY = 0.f; 
+ } else selecting = 0;
+
+ // zoom (mouse wheel)
+ if (_mouse_button_map[3]==KEY_FRESHLY_PRESSED) viewZoom *= 1.25f;
+ if (_mouse_button_map[4]==KEY_FRESHLY_PRESSED) viewZoom *= 0.8f;
+ if (viewZoom < VIEW_ZOOM_MIN) viewZoom = VIEW_ZOOM_MIN;
+ if (viewZoom > VIEW_ZOOM_MAX) viewZoom = VIEW_ZOOM_MAX;
 
  // adjust graph directionality (J)
- static float directionalityX = 0.f;
- static float directionalityY = 0.f;
  if (keymap['J']==KEY_FRESHLY_PRESSED) {
   static int d=0;
   if (++d > 2) d=0;
@@ -599,25 +4142,53 @@ void draw() {
   }
  }
 
+ // untangle: lay the focus's part of the graph out again (U)
+ if (keymap['U']==KEY_FRESHLY_PRESSED) startRelayout();
+
+ // arrowheads push nodes away, or not (A)
+ if (keymap['A']==KEY_FRESHLY_PRESSED) {
+  repelArrowheads = !repelArrowheads;
+  message(repelArrowheads ? "Arrowheads push nodes away" : "Arrowheads don't push nodes away");
+ }
+
  // adjust bubble effect aka "space curvature" (K)
- static float relevanceRange = 7.f;
  if (keymap['K']==KEY_FRESHLY_PRESSED) {
   static int b=1;
   if (++b > 2) b=0;
   if      (b==0) {
    relevanceRange =19.f;
+   hopRange = 8;
    message("Bubble effect: Low");
   }else if(b==1) {
    relevanceRange = 7.f;
+   hopRange = 4;
    message("Bubble effect: Medium");
   }else if(b==2) {
    relevanceRange = 3.f;
+   hopRange = 2;
    message("Bubble effect: High");
   }
  }
  
+ // toggle relevance by hops from the focus (H)
+ if (keymap['H']==KEY_FRESHLY_PRESSED) {
+  hopMode = !hopMode;
+  message_printf("Relevance: %s\n", hopMode?"hops from the focus":"distance from the center");
+ }
+
+ // toggle simulating distant clusters as super-nodes (L)
+ if (keymap['L']==KEY_FRESHLY_PRESSED) {
+  lumpDistant = !lumpDistant;
+  message_printf("Distant clusters: %s\n", lumpDistant?"lumped together":"separate nodes");
+ }
+
+ // toggle adaptive steps (I)
+ if (keymap['I']==KEY_FRESHLY_PRESSED) {
+  adaptiveSteps = !adaptiveSteps;
+  message_printf("Adaptive steps: %s\n", adaptiveSteps?"ON":"OFF (wobble decides)");
+ }
+
  // toggle wobble (W)
- static int wobble=1;
  if (keymap['W']==KEY_FRESHLY_PRESSED) {
   wobble = !wobble;
   message_printf("Wobble: %s\n", wobble?"ON":"OFF");
@@ -659,29 +4230,16 @@ void draw() {
 
  // load file (Ctrl-O or F6)
  if (keymap[15]==KEY_FRESHLY_PRESSED || ((_key_mod & GLUT_ACTIVE_CTRL) && keymap['O']==KEY_FRESHLY_PRESSED) || special_keymap[GLUT_KEY_F6]==KEY_FRESHLY_PRESSED) {
-  if (isModified)state = 1; // dialog
-  else           state = 3; // bypass dialog
+  if (fileDialog.kind) message("Close the file dialog first");
+  else if (isModified) state = 1; // dialog
+  else                 state = 3; // bypass dialog
  }
  if (state==2 || state==3) {// 2 for 'yes' to saving changes, 3 for 'no'
   if (state==2) save();     // XXX: in this current implementation, if the user hits 'cancel' on the 'save as' dialog, it still shows the 'open' dialog immediately after, and is able to open a new file without saving changes to the current one. Is this correct behavior? Maybe not - it should probably cancel both the open and the save.     Similarly, if the user hits 'cancel' on the 'open' dialog, it still saves the file anyway. Is that correct, or should it cancel both the open and the save?
-  char fn[FILENAME_MAX];
-  FILE *f = popen("zenity --file --title 'Open graph file...' --maximized --close-on-unfocus", "r"); // or could also use --on-top
-  if (f) {
-   char *c = fgets(fn,FILENAME_MAX,f);
-   if (pclose(f)==0) {
-    int len=strlen(fn);
-    if (len>1) {
-     fn[len-1] = 0; // to remove the newline
-     if (loadFile(fn)) {
-      message_printf("Opened file: %s", fn);
-      strcpy(filename, fn);
-     }
-     else message_printf("Invalid file '%s' - did not load", fn);
-    }
-    else puts("Empty filename");
-   }
-   else puts("No filename selected");
-  }
+  state = 7;
+ }
+ if (state==7 && !fileDialog.kind) { // (the answer is picked up at the top of draw())
+  startFileDialog(DIALOG_OPEN);
   state = 0;
  }
 
@@ -690,84 +4248,695 @@ void draw() {
 
  // quit (ESC or Ctrl-Q)
  if (keymap[27]==KEY_FRESHLY_PRESSED || keymap[17]==KEY_FRESHLY_PRESSED || ((_key_mod & GLUT_ACTIVE_CTRL) && keymap['Q']==KEY_FRESHLY_PRESSED)) {
-  if (isModified)state = 4; // dialog
-  else           state = 6; // bypass dialog
+  if (fileDialog.kind) message("Close the file dialog first");
+  else if (isModified) state = 4; // dialog
+  else                 state = 6; // bypass dialog
+ }
+ if (state==5) { save(); state = 8; } // (untitled: 'save as' first)
+ if (state==6) { journalDiscardUnsaved(); _exit_the_program = 1; }
+ if (state==8 && !fileDialog.kind) _exit_the_program = 1;
+
+
+
+ physics();
+ render();
+}
+
+
+
+
+// CONNECTIONS BY NODE: every node's connections, as indices into links[]: node i's are adjacency[adjStart[i]] up to adjacency[adjStart[i+1]]. Remade (O(nodes + connections)) only when the connections have changed since, for HOP MODE and the ACTIVE SET
+int *adjacency = NULL, *adjStart = NULL;
+int adjNodes = -1, adjLinks = -1;  unsigned long adjVersion = 0; // what it was made for
+
+int adjacencyCurrent() { // boolean
+ return adjVersion == topologyVersion && adjNodes == nNodes && adjLinks == nLinks;
+}
+
+int updateAdjacency() { // returns 1 if it got remade, 0 if it was up to date, -1 if out of memory
+ if (adjacencyCurrent()) return 0;
+ int *start = realloc(adjStart, (nNodes+1)*sizeof(int));
+ if (!start) return -1;
+ adjStart = start;
+ int *adj = realloc(adjacency, (2*(size_t)nLinks+1)*sizeof(int));
+ if (!adj) return -1;
+ adjacency = adj;
+ memset(start, 0, (nNodes+1)*sizeof(int));
+ for (int i=0; i<nLinks; i++) { start[links[i].from+1]++;  start[links[i].to+1]++; }
+ for (int i=0; i<nNodes; i++) start[i+1] += start[i];
+ for (int i=0; i<nLinks; i++) { adj[start[links[i].from]++] = i;  adj[start[links[i].to]++] = i; } // (moves each start to the next node's)
+ for (int i=nNodes; i>0; i--) start[i] = start[i-1];
+ start[0] = 0;
+ adjNodes = nNodes;  adjLinks = nLinks;  adjVersion = topologyVersion;
+ return 1;
+}
+
+void makeRelevant(int i, float f) { // (from simulate()) f: how relevant, from 0 to 1
+ if (!nodes[i].nTextLevels) genNodeTextRenders(i); // first time it's been near the screen (or its text changed)
+ if (nodes[i].falloff <= 0) nodes[i].repelSize = 0.5f*f; // just became relevant: it keeps its full size until it has had a turn at the (sliced) repelling
+ nodes[i].falloff = f*f*f;
+ if ((nodes[i].flags & FLAG_MINIMAXED)) nodes[i].falloff *= 0.2f * TEXT_BOX_SIZES[nodes[i].nTextLevels > 0 && nodes[i].textRenders[0].n > 0 ? nodes[i].nTextLevels-1 : 0];
+ nodes[i].size = 0.5f*f;
+ r[nRelevant++] = &nodes[i];
+}
+
+// ACTIVE SET: only the relevant nodes, and the connections that touch at least one of them, get simulated (and the nodes at the other end of those, which get pulled along). Everything else stands still.
+// The relevant nodes are found in the level-0 cluster cells around the view, instead of checking every node. When a node comes into the range, its connections join the active ones, and when it leaves, the ones with no relevant end left go. So a frame costs about the same however much of the graph is offscreen.
+// (Not while loading: then everything moves, so everything is simulated)
+unsigned activeFrame = 0;
+unsigned relevantFrame[MAXNODES];  // the last activeFrame each node was relevant in
+unsigned movingFrame[MAXNODES];
+int wasRelevant[MAXNODES], nWasRelevant = 0;
+int moving[MAXNODES], nMoving = 0; // the nodes to simulate
+int activeLinks[MAXLINKS], nActiveLinks = 0;
+int linkSlot[MAXLINKS];            // 1-based index into activeLinks[], or 0 if it isn't active
+int activeFailed = 0;              // boolean: out of memory, so everything gets simulated
+
+void activateLinks(int i) {
+ for (int k=adjStart[i]; k<adjStart[i+1]; k++) {
+  int l = adjacency[k];
+  if (!linkSlot[l]) { activeLinks[nActiveLinks++] = l;  linkSlot[l] = nActiveLinks; }
  }
- if (state==5 || state==6) {// 5 for 'yes' to saving changes, 6 for 'no'
-  if (state==5) save();
-  _exit_the_program = 1;
+}
+
+void deactivateLinks(int i) { // the ones with no relevant end left
+ for (int k=adjStart[i]; k<adjStart[i+1]; k++) {
+  int l = adjacency[k];
+  if (!linkSlot[l] || relevantFrame[links[l].from] == activeFrame || relevantFrame[links[l].to] == activeFrame) continue;
+  int last = activeLinks[--nActiveLinks];
+  activeLinks[linkSlot[l]-1] = last;  linkSlot[last] = linkSlot[l];
+  linkSlot[l] = 0;
  }
+}
 
+void clearActive() { // (then every relevant node counts as coming into range)
+ for (int k=0; k<nActiveLinks; k++) linkSlot[activeLinks[k]] = 0;
+ nActiveLinks = nWasRelevant = nMoving = 0;
+ activeFrame++;
+}
 
+int updateActive() { // (from simulate()) finds the relevant nodes, and what to simulate. Returns 0 if out of memory
+ int remade = updateAdjacency();
+ if (remade < 0) return 0;
+ if (remade) clearActive(); // (the connections may have new numbers)
+ nWasRelevant = 0;
+ for (int k=0; k<nRelevant; k++) wasRelevant[nWasRelevant++] = r[k] - nodes;
+ nRelevant = 0;
+ activeFrame++;
+ float reach = sqrtf(relevanceRange) / viewZoom; // (in the world)
+ float inv = viewZoom*viewZoom / relevanceRange;
+ int x1 = (int)floorf((viewX-reach) / CLUSTER_CELL_SIZE), x2 = (int)floorf((viewX+reach) / CLUSTER_CELL_SIZE);
+ int y1 = (int)floorf((viewY-reach) / CLUSTER_CELL_SIZE), y2 = (int)floorf((viewY+reach) / CLUSTER_CELL_SIZE);
+ for (int iy=y1; iy<=y2; iy++) {
+  for (int ix=x1; ix<=x2; ix++) {
+   Cluster *c = clusterLookup(0, ix, iy, 0);
+   if (!c) continue;
+   for (int m=c->first; m; m=nodes[m-1].cl.next) {
+    int i = m-1;
+    float x = nodes[i].x - viewX, y = nodes[i].y - viewY;
+    float f = 1.f - inv*(x*x + y*y);
+    if (f <= 0) continue;
+    makeRelevant(i, f);
+    if (relevantFrame[i] != activeFrame-1) activateLinks(i); // coming into range
+    relevantFrame[i] = activeFrame;
+   }
+  }
+ }
+ for (int k=0; k<nWasRelevant; k++) { // leaving the range
+  int i = wasRelevant[k];
+  if (i >= nNodes || relevantFrame[i] == activeFrame) continue;
+  nodes[i].falloff = nodes[i].size = 0;
+  deactivateLinks(i);
+ }
+ nMoving = 0;
+ for (int k=0; k<nRelevant; k++) { int i = r[k] - nodes;  movingFrame[i] = activeFrame;  moving[nMoving++] = i; }
+ for (int k=0; k<nActiveLinks; k++) {
+  int a = links[activeLinks[k]].from, b = links[activeLinks[k]].to;
+  if (movingFrame[a] != activeFrame) { movingFrame[a] = activeFrame;  moving[nMoving++] = a; }
+  if (movingFrame[b] != activeFrame) { movingFrame[b] = activeFrame;  moving[nMoving++] = b; }
+ }
+ return 1;
+}
 
+// HOP MODE (H): how relevant a node is comes from how many connections away from the focus it is, instead of how far from it on screen.
+// Only the nodes within hopRange hops get simulated and drawn. They're found by a breadth-first search, which only gets redone when the focus or the connections change, so a frame costs about the same however big the rest of the graph is.
+// A node that comes into range from far away gets put next to the node that brought it in (the rest of the graph stands still, so it could be anywhere)
+#define HOP_MAX_NODES 4096 // the search stops here (a hub could bring in the whole graph)
+int hopSets[2][HOP_MAX_NODES], *hopNodes = hopSets[0], nHopNodes = 0; // the nodes in range, nearest first (and the previous set)
+unsigned char hopDistance[MAXNODES];
+unsigned hopStamp[MAXNODES], hopEpoch = 1; // a node is in range if its stamp is hopEpoch
+int *hopLinks = NULL, nHopLinks = 0, maxHopLinks = 0; // the connections with both ends in range
+int hopFocus = -1, hopFocusRange = 0;      // what the set was found for (0: nothing yet)
 
- //==Physics==
- // center the graph
- if (!_mouse_button_map[2]) {
-  static float dx=0; dx *= 0.875f; dx += nodes[focus].x / -128;
-  static float dy=0; dy *= 0.875f; dy += nodes[focus].y / -128;
-  for (int i=0; i<nNodes; i++) {
-   nodes[i].x += dx;
-   nodes[i].y += dy;
+int updateHops() { // (from simulate()) finds the nodes in range, if the focus or the connections changed. Returns 0 if out of memory
+ int remade = updateAdjacency();
+ if (remade < 0) return 0;
+ if (remade) hopFocusRange = 0; // (find the set again)
+ if (focus == hopFocus && hopRange == hopFocusRange) return 1;
+ hopFocus = focus;  hopFocusRange = hopRange;
+ unsigned previous = hopEpoch;
+ if (!++hopEpoch) { memset(hopStamp, 0, sizeof(hopStamp)); previous = 0; hopEpoch = 1; }
+ int *old = hopNodes, nOld = nHopNodes;
+ hopNodes = hopSets[hopNodes == hopSets[0]];
+ nHopNodes = 0;
+ if (focus >= 0 && focus < nNodes) {
+  hopNodes[nHopNodes++] = focus;
+  hopStamp[focus] = hopEpoch;
+  hopDistance[focus] = 0;
+ }
+ for (int q=0; q<nHopNodes && hopDistance[hopNodes[q]] < hopRange; q++) { // breadth-first
+  int u = hopNodes[q];
+  for (int k=adjStart[u]; k<adjStart[u+1] && nHopNodes < HOP_MAX_NODES; k++) {
+   const Link *l = &links[adjacency[k]];
+   int v = l->from == u ? l->to : l->from;
+   if (hopStamp[v] == hopEpoch) continue;
+   float dx = nodes[v].x - nodes[u].x, dy = nodes[v].y - nodes[u].y;
+   if (hopStamp[v] != previous && dx*dx + dy*dy > 1.f && !isParked(v)) { // coming into range from far away
+    nodes[v].x = nodes[u].x + RND()*0.05f;
+    nodes[v].y = nodes[u].y + RND()*0.05f;
+   }
+   hopStamp[v] = hopEpoch;
+   hopDistance[v] = hopDistance[u] + 1;
+   hopNodes[nHopNodes++] = v;
+  }
+ }
+ for (int k=0; k<nOld; k++) if (old[k] < nNodes && hopStamp[old[k]] != hopEpoch) nodes[old[k]].falloff = nodes[old[k]].size = 0; // out of range now
+ nHopLinks = 0;
+ for (int q=0; q<nHopNodes; q++) {
+  int u = hopNodes[q];
+  for (int k=adjStart[u]; k<adjStart[u+1]; k++) {
+   int i = adjacency[k];
+   if (links[i].from != u || hopStamp[links[i].to] != hopEpoch) continue; // (each one once, from its 'from' end)
+   if (nHopLinks == maxHopLinks) {
+    int newMax = maxHopLinks ? maxHopLinks*2 : 1024;
+    int *p = realloc(hopLinks, newMax*sizeof(int));
+    if (!p) break;
+    hopLinks = p;  maxHopLinks = newMax;
+   }
+   hopLinks[nHopLinks++] = i;
   }
-  if (selectorX || selectorY) { selectorX += dx; selectorY += dy; }
  }
- // establish which nodes are "relevant" aka potentially onscreen and able to repel other nodes
- static Node* r[MAXNODES];
- int nRelevant=0;
- float inv = 1.f / relevanceRange;
+ return 1;
+}
+
+const int *simNodes = NULL, *simLinks = NULL; // what the last simulate() worked on: node simNodes[k] for k up to nSimNodes, etc. (NULL: none yet)
+int allIndices[MAXLINKS > MAXNODES ? MAXLINKS : MAXNODES], nAllIndices = 0; // allIndices[i] == i: what SIM_ALL works on, so the kernels always go through a list
+int nSimNodes = 0, nSimLinks = 0;
+
+void extendAllIndices() {
+ for (; nAllIndices < nNodes || nAllIndices < nLinks; nAllIndices++) allIndices[nAllIndices] = nAllIndices;
+}
+
+void simReset(int mode) { // O(n), when simulate() changes what it works on: nothing's relevant until it says so, and the clusters get brought up to date
  for (int i=0; i<nNodes; i++) {
-  float f = 1.f - inv*(nodes[i].x*nodes[i].x + nodes[i].y*nodes[i].y);
-  if (f <= 0) nodes[i].falloff = nodes[i].size = 0;
+  nodes[i].falloff = nodes[i].size = 0;
+  clusterSync(i);
+ }
+ nRelevant = 0;
+ clearActive();
+ hopFocusRange = 0;
+ simMode = mode;
+}
+
+// LINK CULLING: render() finds the connections that might be onscreen from the nodes in the level-0 cells around the screen, instead of checking every one, so drawing costs about the same however much of the graph is offscreen.
+// A connection whose ends' cells are at most LINK_REACH cells apart gets found from the cells around the screen even if it only passes through. The longer ones are kept in longLinks[], which gets added to whenever a node moves to another cell, and cleaned up when drawing
+#define LINK_REACH 4 // cells
+int longLinks[MAXLINKS], nLongLinks = 0;
+int longSlot[MAXLINKS];                  // 1-based index into longLinks[], or 0 if it isn't in it
+unsigned long longVersion = ~0ul;        // topologyVersion that longLinks[] is complete for (or ~0: it isn't)
+int drawLinks[MAXLINKS];
+unsigned drawnStamp[MAXLINKS], drawStamp = 0;
+
+int linkIsLong(int l) { // boolean. (A node that isn't in a cell can't be found from one, so its connections count as long)
+ int a = nodes[links[l].from].cl.slot[0], b = nodes[links[l].to].cl.slot[0];
+ if (!a || !b) return 1;
+ return abs(clusters[a-1].ix - clusters[b-1].ix) > LINK_REACH || abs(clusters[a-1].iy - clusters[b-1].iy) > LINK_REACH;
+}
+
+void addLongLink(int l) {
+ if (longSlot[l]) return;
+ longLinks[nLongLinks++] = l;
+ longSlot[l] = nLongLinks;
+}
+
+void removeLongLink(int l) {
+ int last = longLinks[--nLongLinks];
+ longLinks[longSlot[l]-1] = last;  longSlot[last] = longSlot[l];
+ longSlot[l] = 0;
+}
+
+void noteLongLinks(int id) { // (from clusterRegister()) the node is in a different cell now
+ if (longVersion != topologyVersion || !adjacencyCurrent()) { longVersion = ~0ul; return; } // (can't tell which connections are its. longLinks[] gets remade in full when it's next needed)
+ for (int k=adjStart[id]; k<adjStart[id+1]; k++) if (linkIsLong(adjacency[k])) addLongLink(adjacency[k]);
+}
+
+const int *linksToDraw(float wx, float wy, int *n) { // (from render()) the connections that might be within wx, wy of the view: hop mode's, or the ones found around the screen, or all of them
+ if (simMode == SIM_HOPS && simLinks) { *n = nSimLinks;  return simLinks; }
+ float fx1 = floorf((viewX-wx) / CLUSTER_CELL_SIZE) - LINK_REACH, fx2 = floorf((viewX+wx) / CLUSTER_CELL_SIZE) + LINK_REACH;
+ float fy1 = floorf((viewY-wy) / CLUSTER_CELL_SIZE) - LINK_REACH, fy2 = floorf((viewY+wy) / CLUSTER_CELL_SIZE) + LINK_REACH;
+ if (simMode < 0 || !adjacencyCurrent() || (fx2-fx1+1.f)*(fy2-fy1+1.f) > nNodes) { // the clusters or the connections by node aren't up to date (e.g. loading), or there are more cells on the screen than nodes: then checking them all is no worse
+  extendAllIndices();
+  *n = nLinks;
+  return allIndices;
+ }
+ if (longVersion != topologyVersion) { // (O(connections), but only after they've changed)
+  for (int k=0; k<nLongLinks; k++) longSlot[longLinks[k]] = 0;
+  nLongLinks = 0;
+  for (int l=0; l<nLinks; l++) if (linkIsLong(l)) addLongLink(l);
+  longVersion = topologyVersion;
+ }
+ int nd = 0;
+ drawStamp++;
+ for (int k=0; k<nLongLinks; k++) {
+  int l = longLinks[k];
+  if (!linkIsLong(l)) { removeLongLink(l);  k--;  continue; }
+  drawnStamp[l] = drawStamp;
+  drawLinks[nd++] = l;
+ }
+ for (int iy=(int)fy1; iy<=(int)fy2; iy++) {
+  for (int ix=(int)fx1; ix<=(int)fx2; ix++) {
+   Cluster *c = clusterLookup(0, ix, iy, 0);
+   if (!c) continue;
+   for (int m=c->first; m; m=nodes[m-1].cl.next) {
+    for (int k=adjStart[m-1]; k<adjStart[m]; k++) {
+     int l = adjacency[k];
+     if (drawnStamp[l] == drawStamp) continue;
+     drawnStamp[l] = drawStamp;
+     drawLinks[nd++] = l;
+    }
+   }
+  }
+ }
+ *n = nd;
+ return drawLinks;
+}
+
+// RELAYOUT (U): lays the focus's part of the graph (everything connected to it) out again from scratch, by stress majorization: it looks for positions where the distance between any two nodes is as close as it can be to the number of connections between them, which untangles what the physics gets stuck on.
+// Sparse, so it scales: each node only compares itself with its neighbors and with a few landmark nodes, which stand in for the nodes nearest them ("sparse stress", after a "pivot MDS" first guess from the same landmarks).
+// It works on a copy of the connections, on worker threads, then the nodes glide to their new places over RELAYOUT_GLIDE_FRAMES, and the physics carries on from there
+#define RELAYOUT_LANDMARKS      50
+#define RELAYOUT_MAX_DISTANCES  (1<<25)  // most landmark-to-node distances to keep (2 bytes each). Fewer landmarks for huge graphs
+#define RELAYOUT_ITERATIONS     300
+#define RELAYOUT_TOLERANCE      0.002f   // done when no node moves more than this (in connections)
+#define RELAYOUT_EDGE_LENGTH    0.1f     // world units per connection. About what the physics settles on
+#define RELAYOUT_GLIDE_FRAMES   60
+#define RELAYOUT_MAX_THREADS    16
+
+typedef struct {
+ int n;                  // nodes in the focus's part of the graph. Below, nodes are numbered 0 to n-1 in here (0 is the focus)
+ int *ids;               // their node ids
+ int *start, *adj;       // their connections (as in CONNECTIONS BY NODE)
+ unsigned long version;  // topologyVersion when it started: if that changes, the answer is for a different graph
+ int nThreads, ok;
+ int k;                  // landmarks
+ int *landmarks;
+ unsigned short *dist;   // dist[p*n + i]: connections between landmark p and node i
+ int **nearer;           // nearer[p][h]: how many of the nodes closest to landmark p are at most h connections from it
+ int *radius;            // (the most h can be, for each landmark)
+ float *x, *y, *nx, *ny; // positions, current & next. The answer ends up in x, y
+ double *sums;           // (a k*k matrix for each thread)
+ float *moved;           // (for each thread, the most any of its nodes moved)
+} RelayoutJob;
+RelayoutJob *relayoutJob = NULL;
+pthread_t relayoutThread;
+volatile int relayoutFinished = 0;
+RelayoutJob *glideJob = NULL; // the answer, while the nodes glide to it
+int glideFrames = 0;          // (frames left)
+
+typedef struct { RelayoutJob *job; void (*fn)(RelayoutJob *job, int thread, int from, int to); int thread, from, to; } RelayoutTask;
+void *relayoutTask(void *ptr) { // pthread
+ RelayoutTask *t = ptr;
+ t->fn(t->job, t->thread, t->from, t->to);
+ return NULL;
+}
+void relayoutParallel(RelayoutJob *job, void (*fn)(RelayoutJob *job, int thread, int from, int to)) { // fn() for all the nodes, split between the threads
+ RelayoutTask tasks[RELAYOUT_MAX_THREADS];
+ pthread_t threads[RELAYOUT_MAX_THREADS];
+ int started[RELAYOUT_MAX_THREADS] = {0};
+ for (int t=0; t<job->nThreads; t++) {
+  tasks[t] = (RelayoutTask){job, fn, t, (int)((long long)job->n*t/job->nThreads), (int)((long long)job->n*(t+1)/job->nThreads)};
+  if (t < job->nThreads-1) started[t] = !pthread_create(&threads[t], NULL, relayoutTask, &tasks[t]);
+  if (!started[t]) relayoutTask(&tasks[t]); // (the last one's done on this thread, and so is any that couldn't start)
+ }
+ for (int t=0; t<job->nThreads; t++) if (started[t]) pthread_join(threads[t], NULL);
+}
+
+void relayoutBFS(RelayoutJob *job, int source, unsigned short *d, int *queue) { // connections from source to every node
+ for (int i=0; i<job->n; i++) d[i] = 0xFFFF;
+ d[source] = 0;
+ int head = 0, tail = 0;
+ queue[tail++] = source;
+ while (head < tail) {
+  int i = queue[head++];
+  for (int e=job->start[i]; e<job->start[i+1]; e++) {
+   int j = job->adj[e];
+   if (d[j] != 0xFFFF) continue;
+   d[j] = d[i] < 0xFFFE ? d[i]+1 : 0xFFFE;
+   queue[tail++] = j;
+  }
+ }
+}
+
+float landmarkWeight(RelayoutJob *job, int p, int d) { // how much landmark p counts, from d connections away
+ int h = d/2;
+ if (h > job->radius[p]) h = job->radius[p];
+ return job->nearer[p][h] / ((float)d*d);
+}
+
+void relayoutFirstGuess(RelayoutJob *job, int thread, int from, int to) { // (pivot MDS) each thread's share of B'B, where B is the double-centered squared distances to the landmarks. Row means go in nx, column means in ny[0..k-1], the overall mean in ny[k]
+ int n = job->n, k = job->k;
+ double *s = &job->sums[(size_t)thread*k*k];
+ double b[RELAYOUT_LANDMARKS];
+ for (int i=from; i<to; i++) {
+  for (int p=0; p<k; p++) { float d = job->dist[(size_t)p*n+i]; b[p] = -0.5 * (d*d - job->nx[i] - job->ny[p] + job->ny[k]); }
+  for (int p=0; p<k; p++) for (int q=p; q<k; q++) s[p*k+q] += b[p]*b[q];
+ }
+}
+
+void relayoutStep(RelayoutJob *job, int thread, int from, int to) { // one round of stress majorization: each node goes where its neighbors & landmarks would put it, weighted
+ int n = job->n;
+ float *x = job->x, *y = job->y, moved = 0.f;
+ for (int i=from; i<to; i++) {
+  float xi = x[i], yi = y[i], sx = 0.f, sy = 0.f, sw = 0.f;
+  for (int e=job->start[i]; e<job->start[i+1]; e++) { // neighbors: 1 connection away, weight 1
+   int j = job->adj[e];
+   float dx = xi - x[j], dy = yi - y[j];
+   float inv = 1.f / (sqrtf(dx*dx + dy*dy) + 1e-9f);
+   sx += x[j] + dx*inv;
+   sy += y[j] + dy*inv;
+   sw += 1.f;
+  }
+  for (int p=0; p<job->k; p++) {
+   int d = job->dist[(size_t)p*n+i];
+   if (d <= 1) continue; // (itself, or a neighbor: already counted)
+   int q = job->landmarks[p];
+   float w = landmarkWeight(job, p, d);
+   float dx = xi - x[q], dy = yi - y[q];
+   float inv = d / (sqrtf(dx*dx + dy*dy) + 1e-9f);
+   sx += w * (x[q] + dx*inv);
+   sy += w * (y[q] + dy*inv);
+   sw += w;
+  }
+  if (sw > 0) { job->nx[i] = sx/sw;  job->ny[i] = sy/sw; }
+  else        { job->nx[i] = xi;     job->ny[i] = yi; }
+  float m = fabsf(job->nx[i] - xi) + fabsf(job->ny[i] - yi);
+  if (m > moved) moved = m;
+ }
+ job->moved[thread] = moved;
+}
+
+void powerIteration(const double *m, int k, double *v) { // v: m's biggest eigenvector (m is symmetric)
+ for (int p=0; p<k; p++) v[p] = 1.0 + 0.01*p;
+ for (int it=0; it<200; it++) {
+  double w[RELAYOUT_LANDMARKS], len = 0;
+  for (int p=0; p<k; p++) { w[p] = 0; for (int q=0; q<k; q++) w[p] += m[p*k+q]*v[q]; len += w[p]*w[p]; }
+  len = sqrt(len);
+  if (len <= 0) return;
+  for (int p=0; p<k; p++) v[p] = w[p]/len;
+ }
+}
+
+void *relayoutInBackground(void *ptr) { // pthread
+ RelayoutJob *job = ptr;
+ int n = job->n, k = job->k;
+ int *queue = malloc(n*sizeof(int));
+ float *nearest = malloc(n*sizeof(float));
+ unsigned short *owner = malloc(n*sizeof(unsigned short));
+ if (!queue || !nearest || !owner) goto out;
+ // landmarks: each one as far as possible from the ones before it, starting from the focus
+ for (int i=0; i<n; i++) { nearest[i] = 1e30f; owner[i] = 0; }
+ int next = 0;
+ for (int p=0; p<k; p++) {
+  job->landmarks[p] = next;
+  unsigned short *d = &job->dist[(size_t)p*n];
+  relayoutBFS(job, next, d, queue);
+  for (int i=0; i<n; i++) {
+   if (d[i] < nearest[i]) { nearest[i] = d[i]; owner[i] = p; }
+   if (nearest[i] > nearest[next]) next = i;
+  }
+ }
+ // each landmark stands in for the nodes nearer it than any other landmark: count them by distance
+ for (int p=0; p<k; p++) job->radius[p] = 0;
+ for (int i=0; i<n; i++) if (nearest[i] > job->radius[owner[i]]) job->radius[owner[i]] = nearest[i];
+ for (int p=0; p<k; p++) if (!(job->nearer[p] = calloc(job->radius[p]+1, sizeof(int)))) goto out;
+ for (int i=0; i<n; i++) job->nearer[owner[i]][(int)nearest[i]]++;
+ for (int p=0; p<k; p++) for (int h=1; h<=job->radius[p]; h++) job->nearer[p][h] += job->nearer[p][h-1];
+ // first guess (pivot MDS): the two main axes of the distances to the landmarks
+ double grand = 0;
+ for (int p=0; p<=k; p++) job->ny[p] = 0;
+ for (int i=0; i<n; i++) {
+  double row = 0;
+  for (int p=0; p<k; p++) { float d = job->dist[(size_t)p*n+i]; row += d*d;  job->ny[p] += d*d/n; }
+  job->nx[i] = row/k;
+  grand += row/k/n;
+ }
+ job->ny[k] = grand;
+ relayoutParallel(job, relayoutFirstGuess);
+ double m[RELAYOUT_LANDMARKS*RELAYOUT_LANDMARKS] = {0}, v1[RELAYOUT_LANDMARKS], v2[RELAYOUT_LANDMARKS];
+ for (int t=0; t<job->nThreads; t++) for (int p=0; p<k; p++) for (int q=p; q<k; q++) m[p*k+q] += job->sums[((size_t)t*k+p)*k+q];
+ for (int p=0; p<k; p++) for (int q=0; q<p; q++) m[p*k+q] = m[q*k+p];
+ powerIteration(m, k, v1);
+ double lambda = 0;
+ for (int p=0; p<k; p++) for (int q=0; q<k; q++) lambda += v1[p]*m[p*k+q]*v1[q];
+ for (int p=0; p<k; p++) for (int q=0; q<k; q++) m[p*k+q] -= lambda*v1[p]*v1[q];
+ powerIteration(m, k, v2);
+ for (int i=0; i<n; i++) {
+  double x = 0, y = 0;
+  for (int p=0; p<k; p++) {
+   float d = job->dist[(size_t)p*n+i];
+   double b = -0.5 * (d*d - job->nx[i] - job->ny[p] + grand);
+   x += b*v1[p];  y += b*v2[p];
+  }
+  job->x[i] = x + RND()*1e-3f; // (no two in the same place)
+  job->y[i] = y + RND()*1e-3f;
+ }
+ // ...scaled to fit the distances best
+ double num = 0, den = 0;
+ for (int i=0; i<n; i++) {
+  for (int e=job->start[i]; e<job->start[i+1]; e++) {
+   int j = job->adj[e];
+   float dx = job->x[i] - job->x[j], dy = job->y[i] - job->y[j], l = sqrtf(dx*dx + dy*dy);
+   num += l;  den += l*l;
+  }
+  for (int p=0; p<k; p++) {
+   int d = job->dist[(size_t)p*n+i];
+   if (d <= 1) continue;
+   int q = job->landmarks[p];
+   float dx = job->x[i] - job->x[q], dy = job->y[i] - job->y[q], l = sqrtf(dx*dx + dy*dy);
+   float w = landmarkWeight(job, p, d);
+   num += w*d*l;  den += w*l*l;
+  }
+ }
+ float scale = den > 0 ? num/den : 1.f;
+ for (int i=0; i<n; i++) { job->x[i] *= scale;  job->y[i] *= scale; }
+ // stress majorization, until it settles
+ for (int it=0; it<RELAYOUT_ITERATIONS; it++) {
+  relayoutParallel(job, relayoutStep);
+  float *t = job->x;  job->x = job->nx;  job->nx = t;
+  t = job->y;  job->y = job->ny;  job->ny = t;
+  float moved = 0.f;
+  for (int t=0; t<job->nThreads; t++) if (job->moved[t] > moved) moved = job->moved[t];
+  if (moved < RELAYOUT_TOLERANCE) break;
+ }
+ job->ok = 1;
+out:
+ free(queue);  free(nearest);  free(owner);
+ __sync_synchronize();
+ relayoutFinished = 1;
+ return NULL;
+}
+
+void freeRelayoutJob(RelayoutJob *job) {
+ if (!job) return;
+ if (job->nearer) for (int p=0; p<job->k; p++) free(job->nearer[p]);
+ free(job->nearer);  free(job->radius);  free(job->landmarks);  free(job->dist);
+ free(job->ids);  free(job->start);  free(job->adj);
+ free(job->x);  free(job->y);  free(job->nx);  free(job->ny);
+ free(job->sums);  free(job->moved);
+ free(job);
+}
+
+int startRelayout() { // returns 0 if it couldn't start
+ if (relayoutJob) { message("Still working out the layout - try again in a moment"); return 0; }
+ if (loading) { message("Still loading - try again in a moment"); return 0; }
+ if (focus < 0 || focus >= nNodes) { message("Relayout: select a node first"); return 0; }
+ if (updateAdjacency() < 0) { message("Failed: Out of memory"); return 0; }
+ RelayoutJob *job = calloc(1, sizeof(RelayoutJob));
+ int *index = malloc(nNodes*sizeof(int)); // (node id -> number in the job, or -1)
+ if (!job || !index) goto fail;
+ job->version = topologyVersion;
+ // the focus's part of the graph
+ if (!(job->ids = malloc(nNodes*sizeof(int)))) goto fail;
+ for (int i=0; i<nNodes; i++) index[i] = -1;
+ index[focus] = 0;  job->ids[0] = focus;  job->n = 1;
+ size_t nAdj = 0;
+ for (int h=0; h<job->n; h++) {
+  int i = job->ids[h];
+  for (int e=adjStart[i]; e<adjStart[i+1]; e++) {
+   int j = links[adjacency[e]].from == i ? links[adjacency[e]].to : links[adjacency[e]].from;
+   if (j == i) continue;
+   nAdj++;
+   if (index[j] < 0) { index[j] = job->n;  job->ids[job->n++] = j; }
+  }
+ }
+ int n = job->n;
+ job->k = RELAYOUT_MAX_DISTANCES / n;
+ if (job->k > RELAYOUT_LANDMARKS) job->k = RELAYOUT_LANDMARKS;
+ if (job->k > n) job->k = n;
+ if (job->k < 1) job->k = 1;
+ job->nThreads = sysconf(_SC_NPROCESSORS_ONLN);
+ if (job->nThreads > RELAYOUT_MAX_THREADS) job->nThreads = RELAYOUT_MAX_THREADS;
+ if (job->nThreads > n) job->nThreads = n;
+ if (job->nThreads < 1) job->nThreads = 1;
+ job->start = malloc((n+1)*sizeof(int));
+ job->adj = malloc((nAdj+1)*sizeof(int));
+ job->landmarks = malloc(job->k*sizeof(int));
+ job->dist = malloc((size_t)job->k*n*sizeof(unsigned short));
+ job->nearer = calloc(job->k, sizeof(int*));
+ job->radius = malloc(job->k*sizeof(int));
+ job->x = malloc(n*sizeof(float));  job->nx = malloc(n*sizeof(float));
+ job->y = malloc((n > job->k ? n : job->k+1)*sizeof(float));  job->ny = malloc((n > job->k ? n : job->k+1)*sizeof(float)); // (ny holds k+1 means to begin with, and x & y swap with nx & ny)
+ job->sums = calloc((size_t)job->nThreads*job->k*job->k, sizeof(double));
+ job->moved = malloc(job->nThreads*sizeof(float));
+ if (!job->start || !job->adj || !job->landmarks || !job->dist || !job->nearer || !job->radius || !job->x || !job->nx || !job->y || !job->ny || !job->sums || !job->moved) goto fail;
+ nAdj = 0;
+ for (int h=0; h<n; h++) {
+  int i = job->ids[h];
+  job->start[h] = nAdj;
+  for (int e=adjStart[i]; e<adjStart[i+1]; e++) {
+   int j = links[adjacency[e]].from == i ? links[adjacency[e]].to : links[adjacency[e]].from;
+   if (j != i) job->adj[nAdj++] = index[j];
+  }
+ }
+ job->start[n] = nAdj;
+ free(index);
+ relayoutFinished = 0;
+ if (pthread_create(&relayoutThread, NULL, relayoutInBackground, job)) { freeRelayoutJob(job); message("Failed: Couldn't start the relayout"); return 0; }
+ relayoutJob = job;
+ message_printf("Working out a new layout for %d nodes...", n);
+ return 1;
+fail:
+ free(index);
+ freeRelayoutJob(job);
+ message("Failed: Out of memory");
+ return 0;
+}
+
+void finishRelayout(int wait) { // call this every frame. wait: boolean: block until it's worked out, and put the nodes straight there
+ if (relayoutJob && (wait || relayoutFinished)) {
+  pthread_join(relayoutThread, NULL);
+  RelayoutJob *job = relayoutJob;
+  relayoutJob = NULL;
+  if (!job->ok) { message("Failed: Out of memory");  freeRelayoutJob(job); }
+  else if (job->version != topologyVersion) { message("The connections changed meanwhile - relayout again");  freeRelayoutJob(job); }
   else {
-   nodes[i].falloff = f*f*f;
-   if ((nodes[i].flags & FLAG_MINIMAXED)) nodes[i].falloff *= 0.2f * TEXT_BOX_SIZES[nodes[i].nTextLevels > 0 && nodes[i].textRenders[0].n > 0 ? nodes[i].nTextLevels-1 : 0];
-   nodes[i].size = 0.5f*f;
-   r[nRelevant++] = &nodes[i];
+   // into world coordinates, with the focus staying where it is (so the camera doesn't jump)
+   float ox = nodes[job->ids[0]].x - job->x[0]*RELAYOUT_EDGE_LENGTH, oy = nodes[job->ids[0]].y - job->y[0]*RELAYOUT_EDGE_LENGTH;
+   for (int i=0; i<job->n; i++) { job->x[i] = ox + job->x[i]*RELAYOUT_EDGE_LENGTH;  job->y[i] = oy + job->y[i]*RELAYOUT_EDGE_LENGTH; }
+   freeRelayoutJob(glideJob);
+   glideJob = job;
+   glideFrames = wait ? 1 : RELAYOUT_GLIDE_FRAMES;
+   message_printf("New layout for %d nodes", job->n);
+  }
+ }
+ if (!glideJob) return;
+ if (glideJob->version != topologyVersion) glideFrames = 0; // (the nodes got renumbered: these aren't their positions any more)
+ else {
+  for (int i=0; i<glideJob->n; i++) {
+   Node *a = &nodes[glideJob->ids[i]];
+   a->x += (glideJob->x[i] - a->x) / glideFrames;
+   a->y += (glideJob->y[i] - a->y) / glideFrames;
+   a->dx = a->dy = 0.f;
+   clusterSync(glideJob->ids[i]);
   }
+  glideFrames--;
  }
+ if (glideFrames <= 0) { freeRelayoutJob(glideJob);  glideJob = NULL; }
+}
+
+// PHYSICS KERNELS: the forces and the motion, for one step. Written once, as a function of the settings that would otherwise be tested inside the loops, and compiled into a separate copy for each combination of them (constant arguments, always inlined), so the loops have no branches on them. simulate() picks the copy from physicsKernels[]
+static inline __attribute__((always_inline)) void physicsKernel(int motion, int directional, int arrowheads, int lump) { // (MOTION_..., directionality not none, repelArrowheads, lumpDistant outside hop mode)
+ int nn = nSimNodes, nl = nSimLinks;
+ const int *sn = simNodes, *sl = simLinks;
  // apply bond forces
- float strength = wobble? (keymap['Y'] ? 0.022f : 0.002f) : (keymap['Y'] ? 0.088f : 0.014f);
- for (int i=0; i<nLinks; i++) {
+ float strength = motion==MOTION_WOBBLE? (keymap['Y'] ? 0.022f : 0.002f) : (keymap['Y'] ? 0.088f : 0.014f);
+ for (int k=0; k<nl; k++) {
+  int i = sl[k];
+  if (isParked(links[i].from) || isParked(links[i].to)) continue; // (still loading - see PARK_DISTANCE. Left as a test: it's per node, and false as soon as loading is)
+  if (lump && nodes[links[i].to].size <= 0 && nodes[links[i].from].size <= 0
+  && nodes[links[i].to].cl.slot[1] && nodes[links[i].to].cl.slot[1] == nodes[links[i].from].cl.slot[1]) continue; // internal to a rigid super-node: these forces would cancel out anyway
   float dx = nodes[links[i].to].x - nodes[links[i].from].x;
   float dy = nodes[links[i].to].y - nodes[links[i].from].y;
   float inv = strength / sqrtf(dx*dx+dy*dy+1.f);
   dx *= inv; dy *= inv;
-  float f = nodes[links[i].from].falloff * nodes[links[i].to].falloff * strength;
-  dx -= directionalityX * f;
-  dy -= directionalityY * f;
+  if (directional) {
+   float f = nodes[links[i].from].falloff * nodes[links[i].to].falloff * strength;
+   dx -= directionalityX * f;
+   dy -= directionalityY * f;
+  }
   nodes[links[i].to  ].dx -= dx;
   nodes[links[i].to  ].dy -= dy;
   nodes[links[i].from].dx += dx;
   nodes[links[i].from].dy += dy;
  }
  // apply repel forces
- strength = wobble? 0.00001f : 0.00007f;
+ strength = motion==MOTION_WOBBLE? 0.00001f : 0.00007f;
  if (keymap['Z']) strength *= 9.f; // zoom
- for (int h = 0; h<nRelevant; h++) {
-  for (int i=h+1; i<nRelevant; i++) {
-   float dx = r[i]->x - r[h]->x;
-   float dy = r[i]->y - r[h]->y;
-   float maxsize = fabs(dx) > fabs(dy) ? fabs(dx) : fabs(dy); maxsize *= 0.44f;
-   if (r[h]->size > maxsize) r[h]->size = maxsize;
-   if (r[i]->size > maxsize) r[i]->size = maxsize;
-   if (maxsize < 0.0001f) { r[i]->x += RND()*0.0001f; r[i]->y += RND()*0.0001f; }
-   float dsq = dx*dx+dy*dy;
-   float inv = 1.f/sqrtf(dsq + 0.01f);  // for normalizing       (+ bias to avoid singularities)
-   inv *= strength*inv*(inv - 1.f);     // for inverse square law(- bias to prevent orphaned nodes from drifting off to far)
-   inv *= r[h]->falloff * r[i]->falloff;// for clustering in distance
-   dx *= inv; dy *= inv;                // apply
-   r[h]->dx -= dx;
-   r[h]->dy -= dy;
-   r[i]->dx += dx;
-   r[i]->dy += dy;
+ double repelStart = secondsNow();
+ if (repelSlices <= 1) {
+  for (int h = 0; h<nRelevant; h++) {
+   for (int i=h+1; i<nRelevant; i++) {
+    float dx = r[i]->x - r[h]->x;
+    float dy = r[i]->y - r[h]->y;
+    float maxsize = fabs(dx) > fabs(dy) ? fabs(dx) : fabs(dy); maxsize *= 0.44f;
+    if (r[h]->size > maxsize) r[h]->size = maxsize;
+    if (r[i]->size > maxsize) r[i]->size = maxsize;
+    if (maxsize < 0.0001f) { r[i]->x += RND()*0.0001f; r[i]->y += RND()*0.0001f; }
+    float dsq = dx*dx+dy*dy;
+    float inv = 1.f/sqrtf(dsq + 0.01f);  // for normalizing       (+ bias to avoid singularities)
+    inv *= strength*inv*(inv - 1.f);     // for inverse square law(- bias to prevent orphaned nodes from drifting off to far)
+    inv *= r[h]->falloff * r[i]->falloff;// for clustering in distance
+    dx *= inv; dy *= inv;                // apply
+    r[h]->dx -= dx;
+    r[h]->dy -= dy;
+    r[i]->dx += dx;
+    r[i]->dy += dy;
+   }
+  }
+  for (int h = 0; h<nRelevant; h++) r[h]->repelSize = r[h]->size; // (for if it gets sliced next step)
+ } else { // sliced (see PHYSICS BUDGET): a node whose turn it is gets pushed by all the others, as hard as repelSlices steps' worth. The rest keep the size they had last turn
+  repelPhase = (repelPhase + 1) % repelSlices;
+  float sliced = strength * repelSlices;
+  for (int h = 0; h<nRelevant; h++) {
+   if ((r[h] - nodes) % repelSlices != repelPhase) {
+    if (r[h]->size > r[h]->repelSize) r[h]->size = r[h]->repelSize;
+    continue;
+   }
+   for (int i=0; i<nRelevant; i++) {
+    if (i == h) continue;
+    float dx = r[i]->x - r[h]->x;
+    float dy = r[i]->y - r[h]->y;
+    float maxsize = fabs(dx) > fabs(dy) ? fabs(dx) : fabs(dy); maxsize *= 0.44f;
+    if (r[h]->size > maxsize) r[h]->size = maxsize;
+    if (maxsize < 0.0001f) { r[h]->x += RND()*0.0001f; r[h]->y += RND()*0.0001f; }
+    float dsq = dx*dx+dy*dy;
+    float inv = 1.f/sqrtf(dsq + 0.01f);
+    inv *= sliced*inv*(inv - 1.f);
+    inv *= r[h]->falloff * r[i]->falloff;
+    r[h]->dx -= dx*inv;
+    r[h]->dy -= dy*inv;
+   }
+   r[h]->repelSize = r[h]->size;
   }
  }
- #ifdef REPEL_ARROWHEADS
- for (int h=0; h<nLinks; h++) {
+ double repelTime = secondsNow() - repelStart;
+ repelMs += ((float)repelTime*1e3f - repelMs) * 0.25f;
+ if (arrowheads) for (int k=0; k<nl; k++) {
+  int h = sl[k];
   float mx = 0.5f*(nodes[links[h].to].x + nodes[links[h].from].x);
   float my = 0.5f*(nodes[links[h].to].y + nodes[links[h].from].y);
-  float f  = 1.0f - mx*mx - my*my;
+  float vx = (mx - viewX)*viewZoom, vy = (my - viewY)*viewZoom;
+  float f  = 1.0f - vx*vx - vy*vy;
   if (f <= 0) continue;
   f = f*f*f;
   for (int i=0; i<nRelevant; i++) {
@@ -782,38 +4951,169 @@ void draw() {
    r[i]->dy += dy; // TODO: to ensure conservation of momentum, also apply dx and dy to the arrowhead. Implementation: put dx and dy in the Link structure, add a final loop to apply 0.5*dx and 0.5*dy to the 'from' and 'to' nodes
   }
  }
- #endif
  // vibration (just for fun)
  if (keymap['V']) {
-  for (int i=0; i<nNodes; i++) {
+  for (int k=0; k<nn; k++) {
+   int i = sn[k];
    nodes[i].dx += RND()*0.004f;
    nodes[i].dy += RND()*0.004f;
   }
  }
+ // distant clusters move as one (if enabled): each distant node being simulated takes the average motion of its cluster's simulated members. (The rest stand still)
+ if (lump) { // (in hop mode, distant clusters stand still)
+  static unsigned frame=0; frame++;
+  for (int k=0; k<nn; k++) {
+   int i = sn[k];
+   if (nodes[i].size > 0 || !nodes[i].cl.slot[1]) continue;
+   Cluster *c = &clusters[nodes[i].cl.slot[1]-1];
+   if (c->stamp != frame) { c->stamp = frame; c->fx = c->fy = 0.f; c->nFar = 0; }
+   c->fx += nodes[i].dx;
+   c->fy += nodes[i].dy;
+   c->nFar++;
+  }
+  for (int k=0; k<nn; k++) {
+   int i = sn[k];
+   if (nodes[i].size > 0 || !nodes[i].cl.slot[1]) continue;
+   Cluster *c = &clusters[nodes[i].cl.slot[1]-1];
+   nodes[i].dx = c->fx / c->nFar;
+   nodes[i].dy = c->fy / c->nFar;
+  }
+ }
  // update positions
- if (wobble) {
-  for (int i=0; i<nNodes; i++) {
+ float moved = 0.f, mx = 0.f, my = 0.f;
+ if (motion == MOTION_WOBBLE) {
+  for (int k=0; k<nn; k++) {
+   int i = sn[k];
    nodes[i].x += nodes[i].dx;
    nodes[i].y += nodes[i].dy;
+   moved += nodes[i].dx*nodes[i].dx + nodes[i].dy*nodes[i].dy;  mx += nodes[i].dx;  my += nodes[i].dy;
    nodes[i].dx *= 0.9375f;
    nodes[i].dy *= 0.9375f;
+   clusterSync(i);
+  }
+ } else if (motion == MOTION_ADAPTIVE) { // each node's step grows while the force on it keeps pointing the same way, and shrinks when it turns back (it's overshooting)
+  for (int k=0; k<nn; k++) {
+   int i = sn[k];
+   float fx = nodes[i].dx, fy = nodes[i].dy;
+   float turn = fx*nodes[i].fx + fy*nodes[i].fy;
+   float heat = nodes[i].heat > 0.f ? nodes[i].heat : 1.f;
+   if      (turn > 0.f) { heat *= HEAT_UP;    if (heat > HEAT_MAX) heat = HEAT_MAX; }
+   else if (turn < 0.f) { heat *= HEAT_DOWN;  if (heat < HEAT_MIN) heat = HEAT_MIN; }
+   nodes[i].x += fx*heat;
+   nodes[i].y += fy*heat;
+   moved += (fx*fx + fy*fy)*heat*heat;  mx += fx*heat;  my += fy*heat;
+   nodes[i].fx = fx;  nodes[i].fy = fy;  nodes[i].heat = heat;
+   nodes[i].dx = nodes[i].dy = 0.f;
+   clusterSync(i);
   }
  } else {
-  for (int i=0; i<nNodes; i++) {
+  for (int k=0; k<nn; k++) {
+   int i = sn[k];
    nodes[i].x += nodes[i].dx;
    nodes[i].y += nodes[i].dy;
+   moved += nodes[i].dx*nodes[i].dx + nodes[i].dy*nodes[i].dy;  mx += nodes[i].dx;  my += nodes[i].dy;
    nodes[i].dx = nodes[i].dy = 0.f;
+   clusterSync(i);
+  }
+ }
+ if (nn > 0) { mx /= nn;  my /= nn; }
+ stepMovement = nn > 0 ? sqrtf(fmaxf(moved/nn - mx*mx - my*my, 0.f)) : 0.f; // (not counting the whole graph drifting along, which the camera follows anyway)
+}
+#define PHYSICS_KERNEL(m,d,a,l) void physicsKernel##m##d##a##l() { physicsKernel(m, d, a, l); }
+#define PHYSICS_KERNELS(m) PHYSICS_KERNEL(m,0,0,0) PHYSICS_KERNEL(m,0,0,1) PHYSICS_KERNEL(m,0,1,0) PHYSICS_KERNEL(m,0,1,1) \
+                           PHYSICS_KERNEL(m,1,0,0) PHYSICS_KERNEL(m,1,0,1) PHYSICS_KERNEL(m,1,1,0) PHYSICS_KERNEL(m,1,1,1)
+PHYSICS_KERNELS(0) PHYSICS_KERNELS(1) PHYSICS_KERNELS(2)
+#define PHYSICS_KERNEL_ROW(m) {{{physicsKernel##m##000, physicsKernel##m##001}, {physicsKernel##m##010, physicsKernel##m##011}}, \
+                               {{physicsKernel##m##100, physicsKernel##m##101}, {physicsKernel##m##110, physicsKernel##m##111}}}
+void (*const physicsKernels[3][2][2][2])() = { // [motion][directional][arrowheads][lump]
+ PHYSICS_KERNEL_ROW(0), PHYSICS_KERNEL_ROW(1), PHYSICS_KERNEL_ROW(2),
+};
+
+int settle(int steps) { // (headless) that many steps of physics. Returns how many it took for the layout to settle (see LAYOUT_SETTLED), or -1 if it didn't
+ int settled = -1;
+ for (int i=0; i<steps; i++) {
+  simulate();
+  if (stepMovement < LAYOUT_SETTLED) { if (settled < 0) settled = i+1; }
+  else settled = -1;
+ }
+ return settled;
+}
+
+void simulate() { // one step of physics
+ // the camera follows the focus
+ if (!_mouse_button_map[2] && focus >= 0 && !isParked(focus)) {
+  static float dx=0; dx *= 0.875f; dx += (nodes[focus].x - viewX) / 128;
+  static float dy=0; dy *= 0.875f; dy += (nodes[focus].y - viewY) / 128;
+  viewX += dx;
+  viewY += dy;
+ }
+ // establish which nodes are "relevant" aka potentially onscreen and able to repel other nodes, and which nodes and connections need simulating
+ int mode = hopMode ? SIM_HOPS : loading || activeFailed ? SIM_ALL : SIM_ACTIVE;
+ if (mode != simMode) simReset(mode);
+ extendAllIndices();
+ simNodes = simLinks = allIndices;
+ nSimNodes = nNodes;  nSimLinks = nLinks;
+ if (mode == SIM_HOPS) {
+  if (!updateHops()) { hopMode = 0;  nHopNodes = nHopLinks = 0;  message("Out of memory for hop mode"); }
+  nRelevant=0;
+  for (int k=0; k<nHopNodes; k++) makeRelevant(hopNodes[k], 1.f - hopDistance[hopNodes[k]] / (hopRange + 1.f));
+  simNodes = hopNodes;  nSimNodes = nHopNodes;
+  simLinks = hopLinks;  nSimLinks = nHopLinks;
+ } else if (mode == SIM_ACTIVE && updateActive()) {
+  simNodes = moving;       nSimNodes = nMoving;
+  simLinks = activeLinks;  nSimLinks = nActiveLinks;
+ } else {
+  if (mode == SIM_ACTIVE) activeFailed = 1; // (out of memory)
+  nRelevant=0;
+  float inv = viewZoom*viewZoom / relevanceRange; // (the range is on screen)
+  for (int i=0; i<nNodes; i++) {
+   float x = nodes[i].x - viewX, y = nodes[i].y - viewY;
+   float f = 1.f - inv*(x*x + y*y);
+   if (f <= 0) nodes[i].falloff = nodes[i].size = 0;
+   else makeRelevant(i, f);
   }
  }
+ physicsKernels[adaptiveSteps ? MOTION_ADAPTIVE : wobble ? MOTION_WOBBLE : MOTION_PLAIN][directionalityX != 0.f || directionalityY != 0.f][!!repelArrowheads][lumpDistant && mode != SIM_HOPS]();
+}
+
+void physics() { // (once per frame) as many steps of physics as fit in physicsBudget, or one, with the repelling sliced up so that it fits
+ if (physicsBudget <= 0) { physicsSteps = repelSlices = 1;  simulate();  return; }
+ double t0 = secondsNow();
+ for (int k=0; k<physicsSteps; k++) simulate();
+ stepMs += ((float)(secondsNow() - t0)*1e3f / physicsSteps - stepMs) * 0.25f;
+ // what would one whole step cost? A sliced one does about 2/repelSlices of the repelling (each turn's node meets all the others, but only once)
+ float other = stepMs > repelMs ? stepMs - repelMs : 0.f;
+ float repel = repelSlices > 1 ? repelMs * repelSlices * 0.5f : repelMs;
+ if (other + repel <= physicsBudget) {
+  repelSlices = 1;
+  physicsSteps = other + repel > 0 ? (int)(physicsBudget / (other + repel)) : MAX_SUBSTEPS;
+  if (physicsSteps > MAX_SUBSTEPS) physicsSteps = MAX_SUBSTEPS;
+  if (physicsSteps < 1) physicsSteps = 1;
+ } else {
+  physicsSteps = 1;
+  float room = physicsBudget - other;
+  repelSlices = room > 0 ? (int)ceilf(2.f * repel / room) : MAX_REPEL_SLICES;
+  if (repelSlices > MAX_REPEL_SLICES) repelSlices = MAX_REPEL_SLICES;
+  if (repelSlices < 2) repelSlices = 2;
+ }
+}
+
 
 
- //==Rendering==
- const float FONT_SIZE = 0.017f; // (nominal minimum)
 
+void viewProjection(int world) { // world: draw in node coordinates, through the camera. Otherwise in screen coordinates
  // this projection matrix gives us "aspect-ratio-independent" normalized coordinates instead of the standard "normalized device coordinates"
- glMatrixMode(GL_PROJECTION);
- glLoadIdentity();
+ load_projection_identity();
  glScalef((GLfloat)_screen_size/(GLfloat)_screen_x, (GLfloat)_screen_size/(GLfloat)_screen_y, 1.f);
+ if (world) {
+  glScalef(viewZoom, viewZoom, 1.f);
+  glTranslatef(-viewX, -viewY, 0.f);
+ }
+}
+
+void render() { // draws the graph. Doesn't change it, so it can be called repeatedly for the same frame (e.g. once per tile, for a big image)
+ const float FONT_SIZE = 0.017f / viewZoom; // (nominal minimum, on screen)
+ viewProjection(1);
 
  // show the "potential connection" between mark and focus
  if (mark >= 0 && focus >= 0) {
@@ -824,23 +5124,40 @@ void draw() {
   glEnd();
  }
 
- // draw the links
+ // precalculate screen boundaries
+ float bx = _screen_x / _screen_size;
+ float by = _screen_y / _screen_size;
+ float wx = bx / viewZoom, wy = by / viewZoom; // (in the world, around viewX, viewY)
+ float margin = LINK_CULL_MARGIN / viewZoom;
+
+ // draw the links: the ones that might be onscreen (see LINK CULLING), except in hop mode, where only the ones in range
+ int nl;
+ const int *drawList = linksToDraw(wx+margin, wy+margin, &nl);
+ float pixelsPerUnit = 0.5f * _screen_size * viewZoom;
  #ifdef USE_MULTISAMPLING
  glBegin(GL_TRIANGLES);
  glColor3f(0.7f, 0.7f, 0.7f);
- for (int i=0; i<nLinks; i++) {
+ int lineOnly = 0;
+ for (int k=0; k<nl; k++) {
+  int i = drawList[k];
   if (links[i].from >= 0 && links[i].to >= 0) {
    Node *a = &nodes[links[i].from]; Node *b = &nodes[links[i].to];
+   if (!segmentOnscreen(a->x - viewX, a->y - viewY, b->x - viewX, b->y - viewY, wx+margin, wy+margin)) continue;
    float mx =(b->x + a->x)*0.5f;
    float my =(b->y + a->y)*0.5f;
    float dx = b->x - a->x;
    float dy = b->y - a->y;
-   float norm = 0.01f / sqrtf(dx*dx + dy*dy);
+   float len = sqrtf(dx*dx + dy*dy);
+   if (len*pixelsPerUnit < 1.f) continue; // less than a pixel long: nothing to see
+   int distant = (a->size <= 0 && b->size <= 0); // both ends are outside the relevance range
+   if (distant != lineOnly) { lineOnly = distant; if (distant) glColor3f(0.35f, 0.35f, 0.35f); else glColor3f(0.7f, 0.7f, 0.7f); }
+   float norm = 0.01f / len;
    dx *= norm; dy *= norm;
    // main line
    glVertex2f(a->x - dy*0.4f, a->y + dx*0.4f);
    glVertex2f(a->x + dy*0.4f, a->y - dx*0.4f);
    glVertex2f(b->x,           b->y);
+   if (distant || len*pixelsPerUnit < LINK_MIN_CHEVRON_PIXELS) continue;
    // arrowhead at middle
    glVertex2f(mx+dy-dx, my-dx-dy);
    glVertex2f(mx   +dx, my   +dy);
@@ -851,19 +5168,27 @@ void draw() {
  #else
  glBegin(GL_LINES);
  glColor3f(1.f,1.f,1.f);
- for (int i=0; i<nLinks; i++) {
+ int lineOnly = 0;
+ for (int k=0; k<nl; k++) {
+  int i = drawList[k];
   if (links[i].from >= 0 && links[i].to >= 0) {
    Node *a = &nodes[links[i].from]; Node *b = &nodes[links[i].to];
+   if (!segmentOnscreen(a->x - viewX, a->y - viewY, b->x - viewX, b->y - viewY, wx+margin, wy+margin)) continue;
+   float dx = b->x - a->x;
+   float dy = b->y - a->y;
+   float len = sqrtf(dx*dx + dy*dy);
+   if (len*pixelsPerUnit < 1.f) continue; // less than a pixel long: nothing to see
+   int distant = (a->size <= 0 && b->size <= 0); // both ends are outside the relevance range
+   if (distant != lineOnly) { lineOnly = distant; if (distant) glColor3f(0.4f, 0.4f, 0.4f); else glColor3f(1.f, 1.f, 1.f); }
    // main line
    glVertex2f(a->x, a->y);
    glVertex2f(b->x, b->y);
+   if (distant || len*pixelsPerUnit < LINK_MIN_CHEVRON_PIXELS) continue; // level of detail: a chevron would just be a smudge
    // chevron at the middle of the line, to indicate direction
    float shift = 0.5f*(a->size - b->size);
    float mx =(b->x + a->x)*0.5f;
    float my =(b->y + a->y)*0.5f;
-   float dx = b->x - a->x;
-   float dy = b->y - a->y;
-   float norm = 1.f / sqrtf(dx*dx + dy*dy);
+   float norm = 1.f / len;
    dx *= norm;     dy *= norm;
    mx += dx*shift; my += dy*shift;
    dx *= 0.007f;   dy *= 0.007f;
@@ -876,10 +5201,6 @@ void draw() {
  glEnd();
  #endif
 
- // precalculate screen boundaries
- float bx = _screen_x / _screen_size;
- float by = _screen_y / _screen_size;
-
  // draw the nodes
  for (int i=0; i<nRelevant; i++) { // this implementation uses Immediate Mode. XXX: instead of this, maybe use a vertex array with GL_POINTS, use point sprites with a shader that makes the rounded square shape? Then again, it might not be much faster, because the CPU still has to iterate through all the nodes anyway in other parts of the code.
   if (r[i]->size > 0) {
@@ -892,7 +5213,7 @@ void draw() {
    float x2 = r[i]->x+r[i]->size;
    float y2 = r[i]->y+r[i]->size;
    float c  = r[i]->size*0.57f; if (c>0.01f) c=0.01f; // corner size
-   if (x1<bx && x2>-bx && y1<by && y2>-by) {
+   if (x1<viewX+wx && x2>viewX-wx && y1<viewY+wy && y2>viewY-wy) {
     glBegin(GL_POLYGON);
     glColor3ub(r[i]->r, r[i]->g, r[i]->b);
     glVertex2f(x2-c, y2  );
@@ -908,15 +5229,33 @@ void draw() {
   }
  }
  
+ // draw distant clusters as impostors. They're outside the relevance range, so usually offscreen: in that case they're pinned to the screen edge, pointing the way
+ nImpostors = 0;
+ if (!hopMode) for (int i=0; i<nTopClusters; i++) findImpostors(&clusters[topClusters[i]], relevanceRange);
+ viewProjection(0);
+ for (int i=0; i<nImpostors; i++) {
+  Impostor *im = &impostors[i];
+  float ex = bx - 2.f*im->size, ey = by - 2.f*im->size;
+  float t = 1.f;
+  if (fabsf(im->x)*t > ex) t = ex / fabsf(im->x);
+  if (fabsf(im->y)*t > ey) t = ey / fabsf(im->y);
+  im->x *= t; im->y *= t;
+  glColor3ub(im->r/2, im->g/2, im->b/2);
+  glBegin(GL_POLYGON);
+  for (int a=0; a<8; a++) glVertex2f(im->x + im->size*cosf(a*(float)M_PI*0.25f), im->y + im->size*sinf(a*(float)M_PI*0.25f));
+  glEnd();
+ }
+ viewProjection(1);
+
  // draw the text on the nodes
  glPushAttrib(GL_ENABLE_BIT); tq_mode();
  for (int i=0; i<nRelevant; i++) {
   // filter out nodes with nothing to show
   if (r[i]->textRenders[0].n <= 0) continue;
-  if (r[i]->x - r[i]->size  >  bx) continue;
-  if (r[i]->x + r[i]->size  < -bx) continue;
-  if (r[i]->y - r[i]->size  >  by) continue;
-  if (r[i]->y + r[i]->size  < -by) continue;
+  if (r[i]->x - r[i]->size  > viewX+wx) continue;
+  if (r[i]->x + r[i]->size  < viewX-wx) continue;
+  if (r[i]->y - r[i]->size  > viewY+wy) continue;
+  if (r[i]->y + r[i]->size  < viewY-wy) continue;
   // decide which textRender to use, if any.
   int tl = r[i]->nTextLevels-1;
   while(tl >= 0 && TEXT_BOX_SIZES[tl]*FONT_SIZE*0.5f > r[i]->size) tl--;   // XXX: in cases where text is very short (say, 1 or 2 chars), this implementation hides the text too readily, because it's hiding based on nominal text size instead of actual text size. If I want to change this, I'd have to refactor text-quads.h::tq_centered_fitted() to also return data on how much scaling was done for making it "fitted".
@@ -933,6 +5272,25 @@ void draw() {
    glPopMatrix();
   }
  }
+ // label the impostors with how many nodes they stand for
+ viewProjection(0);
+ glBlendEquation(GL_FUNC_ADD);
+ glColor3f(1.f, 1.f, 1.f);
+ for (int i=0; i<nImpostors; i++) {
+  Cluster *c = impostors[i].c;
+  if (c->labelCount != c->count || !c->label.v) { // (remade only when the count changes)
+   char str[16];
+   snprintf(str, sizeof(str), "%d", c->count);
+   tq_delete(&c->label);
+   c->label = tq_line_centered(str);
+   c->labelCount = c->count;
+  }
+  glPushMatrix();
+  glTranslatef(impostors[i].x, impostors[i].y, 0.f);
+  glScalef(impostors[i].size, impostors[i].size, 1.f);
+  tq_draw(c->label);
+  glPopMatrix();
+ }
  // draw any message text (top of screen)
  if (messageTimeout > 0) {
   float lum = messageTimeout * (1.f / MESSAGE_TIMEOUT_NFRAMES);
@@ -947,6 +5305,7 @@ void draw() {
   messageTimeout--;
  }
  glPopAttrib(); // done drawing text
+ viewProjection(1);
 
  // highlight marked node
  if (mark >= 0) {
@@ -959,15 +5318,16 @@ void draw() {
   glColor3f(1.0f, 1.0f, 0.0f);
   drawCircle(nodes[focus].x, nodes[focus].y, nodes[focus].size*(float)M_SQRT2);
  }
- // highlight node being edited
- if (monitorEditNode >= 0) {
-  glColor3f(0.5f, 0.0f, 1.0f);
-  drawCircle(nodes[monitorEditNode].x, nodes[monitorEditNode].y, nodes[monitorEditNode].size*(float)M_SQRT2);
+ // highlight nodes being edited
+ glColor3f(0.5f, 0.0f, 1.0f);
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) {
+  int id = editSessions[i].node;
+  if (id >= 0) drawCircle(nodes[id].x, nodes[id].y, nodes[id].size*(float)M_SQRT2);
  }
  // selector
- if (selectorX || selectorY) {
+ if (selecting) {
   glColor3f(0.0f, 1.0f, 0.0f);
-  drawCircle(selectorX, selectorY, 0.02f);
+  drawCircle(selectorX, selectorY, 0.02f/viewZoom);
  }
 }
 
@@ -975,6 +5335,16 @@ void draw() {
 
 
 void done() {
+ if (loading) { loader.cancel = 1; continueLoading(1); }
+ closeFileDialog();
+ collabPoll(); // (sends the last edits, if they fit in the socket)
+ collabDisconnect(NULL);
+ closeCommands();
+ finishSave(1);                    // don't quit in the middle of saving
+ undoClear();
+ finishCompaction();
+ for (int i=0; i<MAX_EDIT_SESSIONS; i++) if (editSessions[i].node >= 0) endEditSession(&editSessions[i]);
+ if (editWatch >= 0) rmdir(editDir);
  for (int i=0; i<nNodes; i++) eraseNodeText(i);
  tq_delete(&helpRender);
  tq_delete(&messageRender);
@@ -982,3 +5352,96 @@ void done() {
  tq_delete(&dialog4Render);
  tq_done();
 }
+
+
+
+
+//////////////////////////////////////////////////////
+// HEADLESS MODES: rendering to a PNG file, and benchmarking.                  [see USE_HEADLESS in fullscreen_main.h]
+
+double secondsNow() {
+ struct timespec t;
+ clock_gettime(CLOCK_MONOTONIC, &t);
+ return t.tv_sec + t.tv_nsec*1e-9;
+}
+
+int renderPNG(const char *pngFilename) { // renders the current frame at _screen_x * _screen_y, one strip of tiles at a time, so the image can be much bigger than a framebuffer. Returns 1 on success
+ int tile = renderTile < _headless_max_tile ? renderTile : _headless_max_tile;
+ int tw = tile < _screen_x ? tile : _screen_x;
+ int th = tile < _screen_y ? tile : _screen_y;
+ if (!headless_framebuffer(tw, th)) return 0;
+ unsigned char *strip = malloc((size_t)_screen_x * th * 3);
+ unsigned char *pixels = malloc((size_t)tw * th * 3);
+ FILE *f = fopen(pngFilename, "wb");
+ png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+ png_infop info = png ? png_create_info_struct(png) : NULL;
+ if (!strip || !pixels || !f || !info || setjmp(png_jmpbuf(png))) {
+  if (!f) perror(pngFilename); else fprintf(stderr, "Failed writing %s\n", pngFilename);
+  if (png) png_destroy_write_struct(&png, &info);
+  if (f) fclose(f);
+  free(strip); free(pixels);
+  return 0;
+ }
+ png_init_io(png, f);
+ png_set_IHDR(png, info, _screen_x, _screen_y, 8, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+ png_write_info(png, info);
+ for (int top=0; top<_screen_y; top+=th) { // image rows go top to bottom; OpenGL's go bottom to top
+  int h = _screen_y-top < th ? _screen_y-top : th;
+  for (int x=0; x<_screen_x; x+=tw) {
+   int w = _screen_x-x < tw ? _screen_x-x : tw;
+   headless_tile(x, _screen_y-top-h, w, h);
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   render();
+   headless_read_pixels(pixels);
+   for (int y=0; y<h; y++) memcpy(&strip[((size_t)(h-1-y)*_screen_x + x)*3], &pixels[(size_t)y*w*3], (size_t)w*3);
+  }
+  for (int y=0; y<h; y++) png_write_row(png, &strip[(size_t)y*_screen_x*3]);
+ }
+ png_write_end(png, NULL);
+ png_destroy_write_struct(&png, &info);
+ free(strip); free(pixels);
+ _tile_w = _tile_h = 0;
+ return fclose(f)==0;
+}
+
+void reportSettling(int settled) {
+ const char *motion = adaptiveSteps ? "adaptive steps" : wobble ? "wobble" : "no wobble";
+ if (settled >= 0) printf("layout:  settled after %d of %d steps (%s)\n", settled, layoutSteps, motion);
+ else              printf("layout:  still moving after %d steps (%s), %.2g per step\n", layoutSteps, motion, stepMovement);
+}
+
+int headless() {
+ messageTimeout = 0; // don't put the "press F1" message in pictures
+ if (benchFrames) {
+  if (!headless_framebuffer(_screen_x, _screen_y)) return 1;
+  headless_tile(0, 0, _screen_x, _screen_y);
+  int settled = settle(layoutSteps); // let the layout settle, so we time a typical frame, not the initial explosion
+  double tPhysics=0, tRender=0;
+  for (int i=0; i<benchFrames; i++) {
+   double t0 = secondsNow();
+   physics();
+   double t1 = secondsNow();
+   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+   render();
+   glFinish();
+   double t2 = secondsNow();
+   tPhysics += t1-t0;
+   tRender  += t2-t1;
+  }
+  #ifdef USE_MULTISAMPLING
+  const char *variant = "multisampled triangles";
+  #else
+  const char *variant = "lines";
+  #endif
+  printf("%d nodes, %d links, %dx%d, links drawn as %s (%s)\n", nNodes, nLinks, _screen_x, _screen_y, variant, (const char*)glGetString(GL_RENDERER));
+  printf("physics: %.3f ms/frame\nrender:  %.3f ms/frame\ntotal:   %.3f ms/frame\n", 1e3*tPhysics/benchFrames, 1e3*tRender/benchFrames, 1e3*(tPhysics+tRender)/benchFrames);
+  if (physicsBudget > 0) printf("physics budget: %g ms/frame. Chose %d step(s)/frame, repelling in %d slice(s). Measured %.3f ms/step, %.3f of it repelling\n", physicsBudget, physicsSteps, repelSlices, stepMs, repelMs);
+  else                   printf("physics budget: none (--physics-budget), 1 step/frame\n");
+  reportSettling(settled);
+  return 0;
+ }
+ reportSettling(settle(layoutSteps));
+ if (!renderPNG(renderToFile)) return 1;
+ printf("Rendered %dx%d to %s\n", _screen_x, _screen_y, renderToFile);
+ return 0;
+}
@@ -26,7 +26,7 @@ typedef struct { float x, y, tx, ty; } TQ_Vertex; // XXX: maybe use 16-bit snorm
 typedef struct { TQ_Vertex *v; int n;} TQ_Drawable;
 TQ_Vertex _tq_alphabet[1024]; // 256 quads (one for every char value)
 GLuint    _tq_texture;
-unsigned  _tq_flags=0;
+__thread unsigned _tq_flags=0; // (per thread, so text can be laid out on any thread)
 #define    TQ_FLAG_COMPLETE 1
 
 